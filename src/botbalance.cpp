@@ -1,3 +1,11 @@
+// botbalance.cpp: keeps the number of active players topped up with bots
+//
+// the balance is not checked every tick: the events that change the number of
+// active players (joins, leaves, spectating and team changes) ask for it, and
+// it runs once they have been quiet for botbalancedelay ms, so a player who
+// drops and reconnects does not cost a bot added and removed again. bots are
+// removed only once the players outnumber numbots by more than botbalanceslack
+
 #include "engine.h"
 
 #include <cmath>
@@ -15,44 +23,81 @@
 
 #include "tools.h"
 #include "geom.h"
+#include "command.h"
 #include "iengine.h"
 #include "igame.h"
 
 #include "game.h"
+#include "botbalance.h"
 #include "cserver.h"
+#include "logger.h"
+
+VAR(botbalancedelay, 0, 2000, 60000); //ms without joins, leaves or spectating before bots are added or removed
+VAR(botbalanceslack, 0, 1, 8); //players over numbots tolerated before bots are removed
+
+static bool botbalancepending = true;
+static int botbalancemillis = 0;
+
+void requestbotbalance(bool immediate)
+{
+    if(immediate)
+    {
+        botbalancemillis = totalmillis;
+    }
+    else if(!botbalancepending || botbalancemillis - totalmillis > 0)
+    {
+        botbalancemillis = totalmillis + botbalancedelay; //every event restarts the wait, unless a balance is already due
+    }
+    botbalancepending = true;
+}
 
 //num: number of players to have on the server
 //return true if #bots was changed
-bool balancebots(int num)
+static bool balancebots(int num)
 {
     int curnum = server::clients.size();
     //remove from curnum any clients that are spectating
-    for(int i = 0; i < server::clients.size(); ++i)
+    for(uint i = 0; i < server::clients.size(); ++i)
     {
         if(server::clients[i]->state.state == ClientState_Spectator)
         {
             curnum--;
         }
     }
-    
-    //printf("Number of Clients: %d\n", curnum);
-    if(num < curnum)
+    logoutf(Log_Bots, LogLevel_Debug, "balancing %d active players to %d", curnum, num);
+    bool changed = false;
+    if(curnum > num + botbalanceslack)
     {
         for(int i = 0; i < curnum-num; ++i)
         {
-            server::aiman::deleteai();
+            if(!server::aiman::deleteai())
+            {
+                break;
+            }
+            changed = true;
         }
-        return true;
     }
     else if(num > curnum)
     {
-        //printf("a\n");
         for(int i = 0; i < num-curnum; ++i)
         {
-            printf("attempting to add: %d\n", i);
-            server::aiman::addai(80, -1);
+            if(!server::aiman::addai(80, -1))
+            {
+                break;
+            }
+            changed = true;
         }
-        return true;
     }
-    return false;
+    return changed;
+}
+
+//called every tick of a running game; only counts the players once a balance is due
+bool updatebotbalance(int num)
+{
+    if(!botbalancepending || totalmillis - botbalancemillis < 0)
+    {
+        return false;
+    }
+    botbalancepending = false;
+    return balancebots(num);
 }
@@ -1,6 +1,8 @@
 #ifndef BOTBALANCE_H_
 #define BOTBALANCE_H_
 
-extern bool balancebots(int num);
+// asks for the bots to be rebalanced once the players settle, or on the next tick
+extern void requestbotbalance(bool immediate = false);
+extern bool updatebotbalance(int num);
 
 #endif
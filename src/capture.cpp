@@ -0,0 +1,337 @@
+// capture.cpp: raw capture of the packets clients send
+//
+// demos record what the server sends; a capture records what it receives,
+// along with the ticks, connects and worldstate sends around it, so that
+// utils/replaycapture can feed the same input through the game logic on a
+// virtual clock. startcapture only names the file: the capture starts with
+// the next networked tick. a capture started before any client connects
+// replays exactly; for players already on the server when it starts, the
+// capture stands in a Connect message carrying their name, model and color.
+// records are compressed and written on a writer thread, as demos are
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+#include "igame.h"
+
+#include "game.h"
+#include "cserver.h"
+#include "capture.h"
+#include "ringbuffer.h"
+#include "logger.h"
+
+VAR(capturecompress, 0, 1, 9); //zlib level for captures, 0 writes them uncompressed
+VAR(capturemaxsize, 0, 1024, 4096); //MB of packets captured before the capture stops, 0 for no limit
+
+//records are built into chunks on the game thread and compressed and written
+//by a writer thread, which also closes the stream once the capture ends
+struct capturechunk
+{
+    stream *f;
+    std::vector<uchar> data;
+    bool end;           //the last chunk of its capture: the writer deletes f after it
+};
+
+constexpr uint CAPTUREFREESIZE = 64;
+constexpr size_t CAPTURECHUNKSIZE = 64*1024;
+
+static std::mutex capturemutex;
+static std::condition_variable capturecond;
+static std::deque<capturechunk *> capturequeue;           //queued chunks, game thread to writer
+static spscring<capturechunk *, CAPTUREFREESIZE> capturefree; //written chunks, writer to game thread
+static std::thread capturewriter;
+static bool capturewriting = false;
+static std::atomic<bool> capturefailed(false);             //set by the writer, closes the capture on the next tick
+
+static stream *capturef = nullptr; //the stream of the capture being recorded, owned by the writer
+static capturechunk *capturecur = nullptr;
+static string capturefile = "";
+static bool capturepending = false;
+static unsigned long long capturebytes = 0;
+static int capturelastflush = 0;
+
+static void writecapturechunk(capturechunk *c, stream *&failed)
+{
+    if(c->f != failed && c->data.size() && c->f->write(c->data.data(), c->data.size()) != c->data.size())
+    {
+        failed = c->f;
+        capturefailed.store(true, std::memory_order_relaxed);
+    }
+    if(c->end)
+    {
+        if(failed == c->f)
+        {
+            failed = nullptr;
+        }
+        delete c->f;
+    }
+    c->data.clear();
+    if(c->data.capacity() > CAPTURECHUNKSIZE || !capturefree.push(c))
+    {
+        delete c;
+    }
+}
+
+static void capturewriterloop()
+{
+    stream *failed = nullptr;
+    std::unique_lock<std::mutex> lock(capturemutex);
+    for(;;)
+    {
+        if(capturequeue.empty())
+        {
+            if(!capturewriting)
+            {
+                break;
+            }
+            capturecond.wait(lock);
+            continue;
+        }
+        capturechunk *c = capturequeue.front();
+        capturequeue.pop_front();
+        lock.unlock();
+        writecapturechunk(c, failed);
+        lock.lock();
+    }
+}
+
+static void stopcapturewriter();
+
+static void queuecapturechunk(capturechunk *c)
+{
+    if(!capturewriter.joinable())
+    {
+        capturewriting = true;
+        capturewriter = std::thread(capturewriterloop);
+        atexit(stopcapturewriter);
+    }
+    {
+        std::lock_guard<std::mutex> lock(capturemutex);
+        capturequeue.push_back(c);
+    }
+    capturecond.notify_one();
+}
+
+//hands the records appended so far to the writer
+static void flushcapture(bool end = false)
+{
+    if(!capturecur)
+    {
+        if(!end)
+        {
+            return;
+        }
+        capturecur = new capturechunk;
+    }
+    capturecur->f = capturef;
+    capturecur->end = end;
+    queuecapturechunk(capturecur);
+    capturecur = nullptr;
+    capturelastflush = totalmillis;
+}
+
+static void closecapture()
+{
+    if(capturef)
+    {
+        flushcapture(true);
+        capturef = nullptr;
+        logoutf(Log_Demo, LogLevel_Info, "stopped capture to %s after %llu bytes of packets", capturefile, capturebytes);
+    }
+}
+
+//lets the writer finish the capture being recorded, then stops it
+static void stopcapturewriter()
+{
+    closecapture();
+    if(!capturewriter.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(capturemutex);
+        capturewriting = false;
+    }
+    capturecond.notify_one();
+    capturewriter.join();
+}
+
+static void captureappend(const void *data, size_t len)
+{
+    if(!capturecur && !capturefree.pop(capturecur))
+    {
+        capturecur = new capturechunk;
+        capturecur->data.reserve(CAPTURECHUNKSIZE);
+    }
+    const uchar *p = static_cast<const uchar *>(data);
+    capturecur->data.insert(capturecur->data.end(), p, p + len);
+    if(capturecur->data.size() >= CAPTURECHUNKSIZE)
+    {
+        flushcapture();
+    }
+}
+
+static void capturewrite(int type, int a, int b, const void *data = nullptr, int len = 0)
+{
+    int record[3] = { type, a, b };
+    captureappend(record, sizeof(record));
+    if(len)
+    {
+        captureappend(data, len);
+    }
+}
+
+//a stand-in for the Connect message of a player that was there before the capture
+static void captureplayer(server::clientinfo *ci)
+{
+    uchar buf[MAXTRANS];
+    ucharbuf p(buf, sizeof(buf));
+    putint(p, NetMsg_Connect);
+    sendstring(ci->name, p);
+    putint(p, ci->playermodel);
+    putint(p, ci->playercolor);
+    sendstring("", p);
+    sendstring("", p);
+    sendstring("", p);
+    capturewrite(Capture_Connect, ci->clientnum, getclientip(ci->clientnum));
+    capturewrite(Capture_Packet | 1<<8 | ENET_PACKET_FLAG_RELIABLE<<16, ci->clientnum, p.length(), buf, p.length());
+}
+
+static void opencapture()
+{
+    capturepending = false;
+    capturef = capturecompress ? opengzfile(path(capturefile), "wb", nullptr, capturecompress) : openrawfile(path(capturefile), "wb");
+    if(!capturef)
+    {
+        logoutf(Log_Demo, LogLevel_Warn, "could not open %s for the capture", capturefile);
+        return;
+    }
+    captureheader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CAPTURE_VERSION;
+    hdr.protocol = PROTOCOL_VERSION;
+    hdr.seed = static_cast<uint>(time(nullptr));
+    hdr.millis = totalmillis;
+    hdr.mode = server::gamemode;
+    copystring(hdr.map, server::smapname);
+    captureappend(&hdr, sizeof(hdr));
+    //seeded at the start of a tick with the map loaded; the replay seeds at the
+    //same point, after loading the map and before the first tick, so that both
+    //draw the same numbers from here on
+    srand(hdr.seed);
+    capturebytes = 0;
+    capturelastflush = totalmillis;
+    capturefailed.store(false, std::memory_order_relaxed);
+    for(uint i = 0; i < server::clients.size(); i++)
+    {
+        server::clientinfo *ci = server::clients[i];
+        if(ci->state.aitype == AI_None && !ci->local)
+        {
+            captureplayer(ci);
+        }
+    }
+    logoutf(Log_Demo, LogLevel_Info, "capturing received packets to %s", capturefile);
+}
+
+void capturetick(int millis)
+{
+    if(capturef && capturefailed.load(std::memory_order_relaxed))
+    {
+        logoutf(Log_Demo, LogLevel_Warn, "could not write to capture %s", capturefile);
+        closecapture();
+    }
+    if(capturepending)
+    {
+        opencapture();
+    }
+    if(capturef)
+    {
+        if(totalmillis - capturelastflush >= 1000)
+        {
+            flushcapture();
+        }
+        capturewrite(Capture_Tick, millis, 0);
+    }
+}
+
+void captureconnect(int cn, uint ip)
+{
+    if(capturef)
+    {
+        capturewrite(Capture_Connect, cn, ip);
+    }
+}
+
+void capturedisconnect(int cn)
+{
+    if(capturef)
+    {
+        capturewrite(Capture_Disconnect, cn, 0);
+    }
+}
+
+void capturepacket(int cn, int chan, const ENetPacket *packet)
+{
+    if(!capturef)
+    {
+        return;
+    }
+    int len = static_cast<int>(packet->dataLength);
+    capturewrite(Capture_Packet | chan<<8 | (packet->flags&0xFF)<<16, cn, len, packet->data, len);
+    capturebytes += len;
+    if(capturemaxsize && capturebytes >= static_cast<unsigned long long>(capturemaxsize)<<20)
+    {
+        closecapture();
+    }
+}
+
+void capturesend()
+{
+    if(capturef)
+    {
+        capturewrite(Capture_Send, 0, 0);
+    }
+}
+
+void startcapture(const char *file)
+{
+    if(!file[0])
+    {
+        logoutf(Log_Demo, LogLevel_Warn, "startcapture needs a file name");
+        return;
+    }
+    closecapture();
+    copystring(capturefile, file);
+    capturepending = true;
+}
+COMMAND(startcapture, "s");
+
+void stopcapture()
+{
+    capturepending = false;
+    closecapture();
+}
+COMMAND(stopcapture, "");
@@ -0,0 +1,36 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+// raw capture of the packets clients send, replayed through the game logic
+// by utils/replaycapture.cpp
+
+constexpr int CAPTURE_VERSION = 1;                // bump when capture format changes
+constexpr const char * CAPTURE_MAGIC = "TESSERACT_CAPT\0\0";
+
+struct captureheader
+{
+    char magic[16];
+    int version, protocol;
+    uint seed;          // rand() seed set at the start of the first tick
+    int millis;         // totalmillis when the capture started
+    int mode;
+    string map;
+};
+
+// every record is three ints, a packet's followed by its bytes
+enum
+{
+    Capture_Tick = 0,   // { type, millis, 0 }: updateserver(millis)
+    Capture_Connect,    // { type, cn, ip }
+    Capture_Disconnect, // { type, cn, 0 }: the client went away, not a kick
+    Capture_Packet,     // { type | chan<<8 | flags<<16, cn, len }
+    Capture_Send        // { type, 0, 0 }: sendpackets built a worldstate
+};
+
+extern void capturetick(int millis);
+extern void captureconnect(int cn, uint ip);
+extern void capturedisconnect(int cn);
+extern void capturepacket(int cn, int chan, const ENetPacket *packet);
+extern void capturesend();
+
+#endif
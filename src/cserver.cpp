@@ -26,6 +26,15 @@
 #include "cserver.h"
 #include "demo.h"
 #include "mapcontrol.h"
+#include "scoretable.h"
+#include "statslog.h"
+#include "transfer.h"
+#include "mapcache.h"
+#include "metrics.h"
+#include "msgprofile.h"
+#include "trace.h"
+#include "logger.h"
+#include "capture.h"
 
 //server game handling
 //includes:
@@ -164,39 +173,6 @@ namespace server
         projs.reset();
     }
     //end servstate
-    struct savedscore
-    {
-        uint ip;
-        string name;
-        int frags, score, deaths, teamkills, shotdamage, damage;
-        int timeplayed;
-        float effectiveness;
-
-        void save(servstate &gs)
-        {
-            frags = gs.frags;
-            score = gs.score;
-            deaths = gs.deaths;
-            teamkills = gs.teamkills;
-            shotdamage = gs.shotdamage;
-            damage = gs.damage;
-            timeplayed = gs.timeplayed;
-            effectiveness = gs.effectiveness;
-        }
-
-        void restore(servstate &gs)
-        {
-            gs.frags = frags;
-            gs.score = score;
-            gs.deaths = deaths;
-            gs.teamkills = teamkills;
-            gs.shotdamage = shotdamage;
-            gs.damage = damage;
-            gs.timeplayed = timeplayed;
-            gs.effectiveness = effectiveness;
-        }
-    };
-
     extern int gamemillis, nextexceeded;
 
 // clientinfo implementation
@@ -309,6 +285,8 @@ namespace server
         name[0] = 0;
         team = 0;
         playermodel = -1;
+        crcstatus = 0;
+        countedcrc = 0;
         playercolor = 0;
         privilege = Priv_None;
         connected = local = false;
@@ -363,7 +341,20 @@ namespace server
     enet_uint32 lastsend = 0;
     int mastermode = MasterMode_Open,
         mastermask = MM_PRIVSERV;
-    stream *mapdata = nullptr;
+    transferbuffer *mapdata = nullptr; //the current map as sent to clients that ask for it
+
+    static void setmapdata(transferbuffer *buf)
+    {
+        if(buf)
+        {
+            buf->refs++;
+        }
+        if(mapdata)
+        {
+            mapdata->release();
+        }
+        mapdata = buf;
+    }
 
     std::vector<uint> allowedips;
     std::vector<ban> bannedips;
@@ -415,8 +406,10 @@ namespace server
     VAR(restrictpausegame, 0, 1, 1);
     VAR(restrictgamespeed, 0, 1, 1);
 
-    SVAR(serverdesc, "");
-    SVAR(serverpass, "");
+    void invalidateserverinfo();
+
+    SVARF(serverdesc, "", invalidateserverinfo());
+    SVARF(serverpass, "", invalidateserverinfo());
     SVAR(adminpass, "");
     VARF(publicserver, 0, 0, 2, {
         switch(publicserver)
@@ -547,21 +540,6 @@ namespace server
 
     uint mcrc = 0;
     std::vector<server_entity> sents;
-    std::vector<savedscore> scores;
-
-    int msgsizelookup(int msg)
-    {
-        static int sizetable[NetMsg_NumMsgs] = { -1 };
-        if(sizetable[0] < 0)
-        {
-            memset(sizetable, -1, sizeof(sizetable));
-            for(const int *p = msgsizes; *p >= 0; p += 2)
-            {
-                sizetable[p[0]] = p[1];
-            }
-        }
-        return msg >= 0 && msg < NetMsg_NumMsgs ? sizetable[msg] : -1;
-    }
 
     const char *modeprettyname(int n, const char *unknown)
     {
@@ -592,6 +570,47 @@ namespace server
          sendf(-1, 1, "ris", NetMsg_ServerMsg, s);
     }
 
+    //server commands that admins may run remotely with NetMsg_ServerCommand
+    static const char * const remotecommands[] = { "demoseek", "demospeed", "savereplay" };
+
+    void servercommand(clientinfo *ci, const char *cmd)
+    {
+        if(ci->privilege < Priv_Admin && !ci->local)
+        {
+            return;
+        }
+        //one plain command only: no statement separators, nested expressions or lookups
+        if(cmd[strcspn(cmd, ";()[]\"@$\n")])
+        {
+            sendf(ci->clientnum, 1, "ris", NetMsg_ServerMsg, "invalid server command");
+            return;
+        }
+        size_t len = strcspn(cmd, " \t");
+        bool allowed = false;
+        for(const char *name : remotecommands)
+        {
+            if(strlen(name) == len && !strncmp(name, cmd, len))
+            {
+                allowed = true;
+                break;
+            }
+        }
+        if(!allowed)
+        {
+            sendf(ci->clientnum, 1, "ris", NetMsg_ServerMsg, "unknown server command");
+            return;
+        }
+        char *ret = executeret(cmd);
+        if(ret)
+        {
+            if(ret[0])
+            {
+                sendf(ci->clientnum, 1, "ris", NetMsg_ServerMsg, ret);
+            }
+            delete[] ret;
+        }
+    }
+
     void resetitems()
     {
         mcrc = 0;
@@ -599,10 +618,26 @@ namespace server
         //cps.reset();
     }
 
-    void changemap(const char *name, int mode);
+    void changemap(const char *name, int mode, uint resume);
+    void updatemapcrc(clientinfo *ci);
+    void removemapcrc(clientinfo *ci);
+    void resetmapcrcs();
+
     void serverinit()
     {
-        changemap("def1a", 1);
+        scorematch m;
+        if(loadscores(m))
+        {
+            //carry on with the match the server was restarted in, and its saved scores
+            logoutf(Log_Game, LogLevel_Info, "resuming %s at %d:%02d", m.map, m.gamemillis/60000, (m.gamemillis/1000)%60);
+            changemap(m.map, m.mode, m.id);
+            gamemillis = m.gamemillis;
+        }
+        else
+        {
+            changemap("def1a", 1);
+        }
+        loaddemos();
         resetitems();
     }
 
@@ -733,6 +768,7 @@ namespace server
 
     void autoteam()
     {
+        metricsscope watch(TickPhase_AutoTeam);
         std::vector<clientinfo *> team[MAXTEAMS];
         float teamrank[MAXTEAMS] = {0};
         for(int round = 0, remaining = clients.size(); remaining>=0; round++)
@@ -832,6 +868,7 @@ namespace server
     void recordpacket(int chan, void *data, int len)
     {
         writedemo(chan, data, len);
+        writereplay(chan, data, len);
     }
 
     int welcomepacket(packetbuf &p, clientinfo *ci);
@@ -845,6 +882,7 @@ namespace server
             return;
         }
         gamepaused = val;
+        invalidateserverinfo();
         sendf(-1, 1, "riii", NetMsg_PauseGame, gamepaused ? 1 : 0, ci ? ci->clientnum : -1);
     }
 
@@ -878,6 +916,7 @@ namespace server
             return;
         }
         gamespeed = val;
+        invalidateserverinfo();
         sendf(-1, 1, "riii", NetMsg_GameSpeed, gamespeed, ci ? ci->clientnum : -1);
     }
 
@@ -1004,6 +1043,7 @@ namespace server
         {
             mastermode = MasterMode_Open;
             allowedips.clear();
+            invalidateserverinfo();
         }
         string msg;
         if(val && authname)
@@ -1117,23 +1157,7 @@ namespace server
                 }
             }
         }
-        for(uint i = 0; i < scores.size(); i++)
-        {
-            savedscore &sc = scores[i];
-            if(sc.ip == ip && !strcmp(sc.name, ci->name))
-            {
-                return &sc;
-            }
-        }
-        if(!insert)
-        {
-            return 0;
-        }
-        scores.emplace_back();
-        savedscore &sc = scores.back();
-        sc.ip = ip;
-        copystring(sc.name, ci->name);
-        return &sc;
+        return findsavedscore(ip, ci->name, insert);
     }
 
     void savescore(clientinfo *ci)
@@ -1145,46 +1169,13 @@ namespace server
         }
     }
 
-    static struct msgfilter
-    {
-        uchar msgmask[NetMsg_NumMsgs];
-
-        msgfilter(int msg, ...)
-        {
-            memset(msgmask, 0, sizeof(msgmask));
-            va_list msgs;
-            va_start(msgs, msg);
-            for(uchar val = 1; msg < NetMsg_NumMsgs; msg = va_arg(msgs, int))
-            {
-                if(msg < 0)
-                {
-                    val = uchar(-msg);
-                }
-                else
-                {
-                    msgmask[msg] = val;
-                }
-            }
-            va_end(msgs);
-        }
-
-        uchar operator[](int msg) const
-        {
-            return msg >= 0 && msg < NetMsg_NumMsgs ? msgmask[msg] : 0;
-        }
-    } msgfilter(-1, NetMsg_Connect, NetMsg_ServerInfo, NetMsg_InitClient, NetMsg_Welcome, NetMsg_MapChange, NetMsg_ServerMsg, NetMsg_Damage, NetMsg_Hitpush, NetMsg_ShotFX, NetMsg_ExplodeFX, NetMsg_Died, NetMsg_SpawnState, NetMsg_ForceDeath, NetMsg_TeamInfo, NetMsg_ItemAcceptance, NetMsg_ItemSpawn, NetMsg_TimeUp, NetMsg_ClientDiscon, NetMsg_CurrentMaster, NetMsg_Pong, NetMsg_Resume, NetMsg_SendDemoList, NetMsg_SendDemo, NetMsg_DemoPlayback, NetMsg_SendMap, NetMsg_Client, NetMsg_AuthChallenge, NetMsg_InitAI, NetMsg_DemoPacket, NetMsg_GetScore,
-                -2, NetMsg_CalcLight, NetMsg_Remip, NetMsg_Newmap, NetMsg_GetMap, NetMsg_SendMap, NetMsg_Clipboard,
-                -3, NetMsg_EditEnt, NetMsg_EditFace, NetMsg_EditTex, NetMsg_EditMat, NetMsg_EditFlip, NetMsg_Copy, NetMsg_Paste, NetMsg_Rotate, NetMsg_Replace, NetMsg_EditVar, NetMsg_EditVSlot, NetMsg_Undo, NetMsg_Redo,
-                -4, NetMsg_AddCube, NetMsg_DelCube, NetMsg_EditFace, NetMsg_Pos, NetMsg_NumMsgs,  NetMsg_GetMap, NetMsg_SendMap),
-      connectfilter(-1, NetMsg_Connect, -2, NetMsg_AuthAnswer, -3, NetMsg_Ping, NetMsg_NumMsgs);
-
     int checktype(int type, clientinfo *ci)
     {
         if(ci)
         {
             if(!ci->connected)
             {
-                switch(connectfilter[type])
+                switch(connectfilterlookup(type))
                 {
                     // allow only before authconnect
                     case 1:
@@ -1213,7 +1204,7 @@ namespace server
                 return type;
             }
         }
-        switch(msgfilter[type])
+        switch(msgfilterlookup(type))
         {
             // server-only messages
             case 1:
@@ -1300,6 +1291,7 @@ namespace server
             return;
         }
         int wslen = wsbuf.length();
+        metricsworldstate(Worldstate_Positions, wslen);
         recordpacket(0, wsbuf.buf, wslen);
         wsbuf.put(wsbuf.buf, wslen);
         for(int i = 0; i < clients.size(); i++)
@@ -1367,6 +1359,7 @@ namespace server
             return;
         }
         int wslen = wsbuf.length();
+        metricsworldstate(Worldstate_Messages, wslen);
         recordpacket(1, wsbuf.buf, wslen);
         wsbuf.put(wsbuf.buf, wslen);
         for(int i = 0; i < clients.size(); i++)
@@ -1432,6 +1425,7 @@ namespace server
 
     bool buildworldstate()
     {
+        TRACE_SPAN("buildworldstate");
         int wsmax = 0;
         for(int i = 0; i < clients.size(); i++)
         {
@@ -1498,6 +1492,7 @@ namespace server
 
     bool sendpackets(bool force)
     {
+        TRACE_SPAN("sendpackets");
         if(clients.empty() || (!hasnonlocalclients() && !demorecord))
         {
             return false;
@@ -1507,6 +1502,7 @@ namespace server
         {
             return false;
         }
+        capturesend();
         bool flush = buildworldstate();
         lastsend += curtime - (curtime%7); //delay of 7ms between packet reciepts (143fps)
         return flush;
@@ -1749,12 +1745,14 @@ namespace server
         sendpacket(-1, 1, p.finalize(), ci->clientnum);
     }
 
-    void changemap(const char *s, int mode)
+    void changemap(const char *s, int mode, uint resume)
     {
+        metricsscope watch(TickPhase_ChangeMap);
         stopdemo();
         pausegame(false);
         changegamespeed(100);
         aiman::clearai();
+        logroundstats();
 
         gamemode = mode;
         gamemillis = 0;
@@ -1762,7 +1760,10 @@ namespace server
         interm = 0;
         nextexceeded = 0;
         copystring(smapname, s);
-        scores.clear();
+        invalidateserverinfo();
+        savecachedmaps();
+        setmapdata(nullptr);
+        clearscores(smapname, gamemode, resume);
         shouldcheckteamkills = false;
         teamkills.clear();
         for(int i = 0; i < clients.size(); i++)
@@ -1803,6 +1804,7 @@ namespace server
                 sendspawn(ci);
             }
         }
+        resetmapcrcs();
         aiman::changemap();
 
         if(modecheck(gamemode, Mode_Demo))
@@ -1817,6 +1819,7 @@ namespace server
             demonextmatch = false;
             setupdemorecord();
         }
+        replaymapchange();
     }
 
     void rotatemap()
@@ -1832,6 +1835,7 @@ namespace server
             sendf(-1, 1, "ri2", NetMsg_TimeUp, 0);
             changegamespeed(100);
             interm = gamemillis + 10000;
+            msgprofileintermission();
         }
     }
 
@@ -2076,6 +2080,7 @@ namespace server
             gameevent *ev = ci->events[0];
             if(ev->flush(ci, millis))
             {
+                metricsevent();
                 clearevent(ci);
             }
             else
@@ -2087,6 +2092,7 @@ namespace server
 
     void processevents()
     {
+        TRACE_SPAN("processevents");
         for(int i = 0; i < clients.size(); i++)
         {
             clientinfo *ci = clients[i];
@@ -2122,7 +2128,7 @@ namespace server
         ci->timesync = false;
     }
 
-    VAR(numbots, 0, 8, 16);
+    VARF(numbots, 0, 8, 16, requestbotbalance(true));
 
     void serverupdate() //called from engine/server.src
     {
@@ -2132,6 +2138,7 @@ namespace server
         if(shouldstep && !gamepaused) //if people are online and game is unpaused
         {
             gamemillis += curtime; //advance clock if applicable
+            setscoreclock(interm ? -1 : gamemillis);
 
             if(modecheck(gamemode, Mode_Demo))
             {
@@ -2139,7 +2146,7 @@ namespace server
             }
             else if(!modecheck(gamemode, Mode_Untimed) || gamemillis < gamelimit)
             {
-                balancebots(numbots);
+                updatebotbalance(numbots);
                 processevents(); //foreach client flushevents (handle events & clear?)
                 if(curtime)
                 {
@@ -2196,6 +2203,9 @@ namespace server
 
         if(shouldcheckteamkills) checkteamkills(); //check team kills on matches that care
 
+        updatetransfers();
+        updatedemos();
+
         ////////// This section is only run if there are people online //////////
 
         if(shouldstep && !gamepaused) //while unpaused & players ingame, check if match should be over
@@ -2227,10 +2237,12 @@ namespace server
         }
         ci->state.state = ClientState_Spectator;
         ci->state.timeplayed += lastmillis - ci->state.lasttimeplayed;
+        updatemapcrc(ci);
         if(!ci->local && (!ci->privilege || ci->warned))
         {
             aiman::removeai(ci);
         }
+        requestbotbalance();
         sendf(-1, 1, "ri3", NetMsg_Spectator, ci->clientnum, 1);
     }
 
@@ -2240,125 +2252,243 @@ namespace server
 
         crcinfo() {}
         crcinfo(int crc, int matches) : crc(crc), matches(matches) {}
+    };
 
-        bool operator<(const crcinfo &y)
-        {
-            return matches < y.matches;
-        }
+    // what a client adds to the map crc tally
+    enum
+    {
+        MapCRC_None = 0,    //spectators and bots are not counted
+        MapCRC_Unsent,
+        MapCRC_Invalid,
+        MapCRC_Other,       //counted towards the total only
+        MapCRC_Reported
     };
 
+    // live tally of the map crcs reported by active clients, updated as they report,
+    // spectate or leave so checkmaps only has to look at clients whose report changed
+    std::vector<crcinfo> mapcrcs;
+    std::vector<int> crcchanged;
+    int crctotal = 0,
+        crcunsent = 0,
+        lastcrc = 0;
+    bool crcrescan = true,
+         lastaccepted = false,
+         lastspectate = false;
+
     VAR(modifiedmapspectator, 0, 1, 2);
 
-    void checkmaps(int req = -1)
+    static void countmapcrc(int status, int crc, int n)
     {
-        if(!smapname[0])
+        if(status == MapCRC_None)
         {
             return;
         }
-        std::vector<crcinfo> crcs;
-        int total = 0,
-            unsent = 0,
-            invalid = 0;
-        if(mcrc)
+        crctotal += n;
+        if(status == MapCRC_Unsent)
         {
-            crcs.push_back(crcinfo(mcrc, clients.size() + 1));
+            crcunsent += n;
         }
-        for(int i = 0; i < clients.size(); i++)
+        else if(status == MapCRC_Reported)
         {
-            clientinfo *ci = clients[i];
-            if(ci->state.state==ClientState_Spectator || ci->state.aitype != AI_None)
+            for(int i = 0; i < mapcrcs.size(); i++)
             {
-                continue;
-            }
-            total++;
-            if(!ci->clientmap[0])
-            {
-                if(ci->mapcrc < 0)
-                {
-                    invalid++;
-                }
-                else if(!ci->mapcrc)
+                if(mapcrcs[i].crc == crc)
                 {
-                    unsent++;
+                    mapcrcs[i].matches += n;
+                    if(mapcrcs[i].matches <= 0)
+                    {
+                        mapcrcs.erase(mapcrcs.begin() + i);
+                    }
+                    return;
                 }
             }
+            mapcrcs.push_back(crcinfo(crc, n));
+        }
+    }
+
+    void updatemapcrc(clientinfo *ci)
+    {
+        int status = MapCRC_None,
+            crc = 0;
+        if(ci->state.state!=ClientState_Spectator && ci->state.aitype == AI_None)
+        {
+            if(ci->clientmap[0])
+            {
+                status = MapCRC_Reported;
+                crc = ci->mapcrc;
+            }
             else
             {
-                crcinfo *match = nullptr;
-                for(int j = 0; j < crcs.size(); j++)
-                {
-                    if(crcs[j].crc == ci->mapcrc)
-                    {
-                        match = &crcs[j];
-                        break;
-                    }
-                }
-                if(!match)
-                {
-                    crcs.push_back(crcinfo(ci->mapcrc, 1));
-                }
-                else
-                {
-                    match->matches++;
-                }
+                status = ci->mapcrc < 0 ? MapCRC_Invalid : (!ci->mapcrc ? MapCRC_Unsent : MapCRC_Other);
             }
         }
-        if(!mcrc && total - unsent < std::min(total, 4))
+        if(status == ci->crcstatus && crc == ci->countedcrc)
         {
             return;
         }
+        countmapcrc(ci->crcstatus, ci->countedcrc, -1);
+        countmapcrc(status, crc, 1);
+        ci->crcstatus = status;
+        ci->countedcrc = crc;
+        if(std::find(crcchanged.begin(), crcchanged.end(), ci->clientnum) == crcchanged.end())
+        {
+            crcchanged.push_back(ci->clientnum);
+        }
+    }
 
-        std::sort(crcs.begin(), crcs.end());
-        string msg;
+    void removemapcrc(clientinfo *ci)
+    {
+        countmapcrc(ci->crcstatus, ci->countedcrc, -1);
+        ci->crcstatus = MapCRC_None;
+        ci->countedcrc = 0;
+    }
+
+    //recounts every client after their map state was cleared by a map change
+    void resetmapcrcs()
+    {
+        mapcrcs.clear();
+        crcchanged.clear();
+        crctotal = crcunsent = 0;
+        crcrescan = true;
         for(int i = 0; i < clients.size(); i++)
         {
             clientinfo *ci = clients[i];
-            if(ci->state.state==ClientState_Spectator || ci->state.aitype != AI_None || ci->clientmap[0] || ci->mapcrc >= 0 || (req < 0 && ci->warned))
+            ci->crcstatus = MapCRC_None;
+            ci->countedcrc = 0;
+            updatemapcrc(ci);
+        }
+        crcchanged.clear();
+    }
+
+    // the crc taken as the real map: the server's own if it knows it, otherwise the one
+    // reported by strictly more clients than any other; none if the top two are tied
+    static bool acceptedmapcrc(int &crc)
+    {
+        if(mcrc)
+        {
+            crc = mcrc;
+            return true;
+        }
+        const crcinfo *best = nullptr,
+                      *second = nullptr;
+        for(const crcinfo &info : mapcrcs)
+        {
+            if(!best || info.matches > best->matches)
             {
-                continue;
+                second = best;
+                best = &info;
             }
-            formatstring(msg, "%s has modified map \"%s\"", colorname(ci), smapname);
-            sendf(req, 1, "ris", NetMsg_ServerMsg, msg);
-            if(req < 0)
+            else if(!second || info.matches > second->matches)
             {
-                ci->warned = true;
+                second = &info;
             }
         }
-        if(crcs.size() >= 2)
+        if(!best || (second && second->matches >= best->matches))
+        {
+            crc = 0;
+            return false;
+        }
+        crc = best->crc;
+        return true;
+    }
+
+    static bool hasmodifiedmap(const clientinfo *ci, bool accepted, int crc)
+    {
+        switch(ci->crcstatus)
+        {
+            case MapCRC_Invalid:
+            {
+                return true;
+            }
+            case MapCRC_Reported:
+            {
+                return !accepted || ci->countedcrc != crc;
+            }
+            default:
+            {
+                return false;
+            }
+        }
+    }
+
+    static void warnmodifiedmap(clientinfo *ci, bool accepted, int crc, std::vector<clientinfo *> &spectate)
+    {
+        if(!ci->warned && hasmodifiedmap(ci, accepted, crc))
+        {
+            string msg;
+            formatstring(msg, "%s has modified map \"%s\"", colorname(ci), smapname);
+            sendf(-1, 1, "ris", NetMsg_ServerMsg, msg);
+            ci->warned = true;
+        }
+        if(!ci->local && ci->warned && ci->state.state != ClientState_Spectator)
+        {
+            spectate.push_back(ci);
+        }
+    }
+
+    void checkmaps(int req = -1)
+    {
+        TRACE_SPAN("checkmaps");
+        metricsscope watch(TickPhase_CheckMaps);
+        if(!smapname[0])
         {
-            for(int i = 0; i < crcs.size(); i++)
+            return;
+        }
+        if(!mcrc && crctotal - crcunsent < std::min(crctotal, 4))
+        {
+            return;
+        }
+        int crc;
+        bool accepted = acceptedmapcrc(crc);
+        if(req >= 0)
+        {
+            string msg;
+            for(int i = 0; i < clients.size(); i++)
             {
-                crcinfo &info = crcs[i];
-                if(i || info.matches <= crcs[i+1].matches)
+                clientinfo *ci = clients[i];
+                if(hasmodifiedmap(ci, accepted, crc))
                 {
-                    for(int j = 0; j < clients.size(); j++)
-                    {
-                        clientinfo *ci = clients[j];
-                        if(ci->state.state==ClientState_Spectator || ci->state.aitype != AI_None || !ci->clientmap[0] || ci->mapcrc != info.crc || (req < 0 && ci->warned))
-                        {
-                            continue;
-                        }
-                        formatstring(msg, "%s has modified map \"%s\"", colorname(ci), smapname);
-                        sendf(req, 1, "ris", NetMsg_ServerMsg, msg);
-                        if(req < 0)
-                        {
-                            ci->warned = true;
-                        }
-                    }
+                    formatstring(msg, "%s has modified map \"%s\"", colorname(ci), smapname);
+                    sendf(req, 1, "ris", NetMsg_ServerMsg, msg);
                 }
             }
+            return;
         }
-        if(req < 0 && modifiedmapspectator && (mcrc || modifiedmapspectator > 1))
+        bool shouldforce = modifiedmapspectator && (mcrc || modifiedmapspectator > 1);
+        //a new accepted crc or spectator policy can affect anyone, otherwise only changed reports matter
+        bool rescan = crcrescan || accepted != lastaccepted || crc != lastcrc || shouldforce != lastspectate;
+        crcrescan = false;
+        lastaccepted = accepted;
+        lastcrc = crc;
+        lastspectate = shouldforce;
+        std::vector<int> changed;
+        changed.swap(crcchanged);
+        std::vector<clientinfo *> spectate;
+        if(rescan)
         {
             for(int i = 0; i < clients.size(); i++)
             {
-                clientinfo *ci = clients[i];
-                if(!ci->local && ci->warned && ci->state.state != ClientState_Spectator)
+                warnmodifiedmap(clients[i], accepted, crc, spectate);
+            }
+        }
+        else
+        {
+            for(int cn : changed)
+            {
+                clientinfo *ci = getinfo(cn);
+                if(ci && ci->connected)
                 {
-                    forcespectator(ci);
+                    warnmodifiedmap(ci, accepted, crc, spectate);
                 }
             }
         }
+        if(shouldforce)
+        {
+            for(clientinfo *ci : spectate)
+            {
+                forcespectator(ci);
+            }
+        }
     }
 
     bool shouldspectate(clientinfo *ci)
@@ -2377,6 +2507,7 @@ namespace server
         ci->state.lasttimeplayed = lastmillis;
         aiman::addclient(ci);
         sendf(-1, 1, "ri3", NetMsg_Spectator, ci->clientnum, 0);
+        updatemapcrc(ci);
         if(ci->clientmap[0] || ci->mapcrc)
         {
             checkmaps();
@@ -2417,6 +2548,7 @@ namespace server
     void clientdisconnect(int n)
     {
         clientinfo *ci = getinfo(n);
+        canceltransfers(ci);
         if(ci->connected)
         {
             if(ci->privilege)
@@ -2425,13 +2557,17 @@ namespace server
             }
             ci->state.timeplayed += lastmillis - ci->state.lasttimeplayed;
             savescore(ci);
+            logdisconnectstats(ci);
             sendf(-1, 1, "ri2", NetMsg_ClientDiscon, n);
+            removemapcrc(ci);
             auto itr = std::find(clients.begin(), clients.end(), ci);
             if(itr != clients.end())
             {
                 clients.erase(itr);
             }
+            invalidateserverinfo();
             aiman::removeai(ci);
+            requestbotbalance();
             if(!numclients(-1, false, true))
             {
                 noclients(); // bans clear when server empties
@@ -2578,17 +2714,13 @@ namespace server
         {
             return;
         }
-        if(mapdata)
-        {
-            DELETEP(mapdata);
-        }
-        mapdata = opentempfile("mapdata", "w+b");
-        if(!mapdata)
+        transferbuffer *buf = cachemap(smapname, data, len);
+        if(!buf)
         {
-            sendf(sender, 1, "ris", NetMsg_ServerMsg, "failed to open temporary file for map");
+            sendf(sender, 1, "ris", NetMsg_ServerMsg, "failed to store map");
             return;
         }
-        mapdata->write(data, len);
+        setmapdata(buf);
         sendservmsgf("[%s sent a map to server, \"/getmap\" to receive it]", colorname(ci));
     }
 
@@ -2642,6 +2774,8 @@ namespace server
             ci->state.state = ClientState_Spectator;
         }
         ci->state.lasttimeplayed = lastmillis;
+        updatemapcrc(ci);
+        invalidateserverinfo();
 
         ci->team = modecheck(gamemode, Mode_Team) ? chooseworstteam(ci) : 0;
 
@@ -2759,10 +2893,13 @@ namespace server
         #define QUEUE_MSG { \
             if(cm && (!cm->local || demorecord || hasnonlocalclients())) \
             { \
+                unsigned long long queuecycles = msgprofilestart(); \
+                int queuelen = p.length() - curmsg; \
                 while(curmsg<p.length()) \
                 { \
                     cm->messages.push_back(p.buf[curmsg++]); \
                 } \
+                msgprofileend(MsgProfile_Queued, type, queuelen, queuecycles); \
             } \
         }
         #define QUEUE_BUF(body) { \
@@ -2773,10 +2910,20 @@ namespace server
             } \
         }
         #define QUEUE_STR(text) QUEUE_BUF(sendstring(text, cm->messages))
-        int curmsg;
+        int curmsg,
+            msgtype = -1,
+            msgstart = 0;
+        unsigned long long msgcycles = 0;
         while((curmsg = p.length()) < p.maxlen)
         {
-            switch(type = checktype(getint(p), ci))
+            if(msgtype >= 0)
+            {
+                metricsmessage(Metrics_In, msgtype, curmsg - msgstart);
+                msgprofileend(MsgProfile_Parsed, msgtype, curmsg - msgstart, msgcycles);
+            }
+            msgstart = curmsg;
+            msgcycles = msgprofilestart();
+            switch(msgtype = type = checktype(getint(p), ci))
             {
                 case NetMsg_Pos:
                 {
@@ -2908,10 +3055,12 @@ namespace server
                         {
                             ci->mapcrc = 0;
                         }
+                        updatemapcrc(ci);
                         break;
                     }
                     copystring(ci->clientmap, text);
                     ci->mapcrc = text[0] ? crc : 1;
+                    updatemapcrc(ci);
                     checkmaps();
                     if(cq && cq != ci && cq->ownernum != ci->clientnum)
                     {
@@ -2933,6 +3082,7 @@ namespace server
                     if(!ci->clientmap[0] && !ci->mapcrc)
                     {
                         ci->mapcrc = -1;
+                        updatemapcrc(ci);
                         checkmaps();
                         if(ci == cq)
                         {
@@ -3095,7 +3245,7 @@ namespace server
                     QUEUE_STR(text);
                     if(cq)
                     {
-                        printf("%s: %s\n", colorname(cq), text);
+                        logoutf(Log_Chat, LogLevel_Info, "%s: %s", colorname(cq), text);
                     }
                     break;
                 }
@@ -3118,7 +3268,7 @@ namespace server
                     }
                     if(cq)
                     {
-                        printf("%s <%s>: %s\n", colorname(cq), teamnames[cq->team], text);
+                        logoutf(Log_Chat, LogLevel_Info, "%s <%s>: %s", colorname(cq), teamnames[cq->team], text);
                     }
                     break;
                 }
@@ -3296,6 +3446,7 @@ namespace server
                         {
                             mastermode = mm;
                             allowedips.clear();
+                            invalidateserverinfo();
                             if(mm>=MasterMode_Private)
                             {
                                 for(int i = 0; i < clients.size(); i++)
@@ -3443,21 +3594,24 @@ namespace server
                 }
                 case NetMsg_GetMap:
                 {
+                    //nobody uploaded the map this round: send a cached copy if it is the real map
+                    int crc;
+                    if(!mapdata && acceptedmapcrc(crc))
+                    {
+                        setmapdata(findcachedmap(smapname, static_cast<uint>(crc)));
+                    }
                     if(!mapdata)
                     {
                         sendf(sender, 1, "ris", NetMsg_ServerMsg, "no map to send");
                     }
-                    else if(ci->getmap)
+                    else if(hastransfer(ci, NetMsg_SendMap))
                     {
                         sendf(sender, 1, "ris", NetMsg_ServerMsg, "already sending map");
                     }
                     else
                     {
                         sendservmsgf("[%s is getting the map]", colorname(ci));
-                        if((ci->getmap = sendfile(sender, 2, mapdata, "ri", NetMsg_SendMap)))
-                        {
-                            ci->getmap->freeCallback = freegetmap;
-                        }
+                        sendtransfer(ci, NetMsg_SendMap, mapdata);
                         ci->needclipboard = totalmillis ? totalmillis : 1;
                     }
                     break;
@@ -3506,6 +3660,7 @@ namespace server
                 case NetMsg_AddBot:
                 {
                     numbots++;
+                    requestbotbalance(true);
                     getint(p); //throw away
                     break;
                 }
@@ -3513,6 +3668,7 @@ namespace server
                 {
                     numbots--;
                     aiman::reqdel(ci);
+                    requestbotbalance(true);
                     break;
                 }
                 case NetMsg_BotLimit:
@@ -3708,6 +3864,7 @@ namespace server
                 case NetMsg_ServerCommand:
                 {
                     getstring(text, p);
+                    servercommand(ci, text);
                     break;
                 }
                 case -1:
@@ -3734,7 +3891,7 @@ namespace server
                     }
                     if(ci)
                     {
-                        switch(msgfilter[type]) //msgfilter[] returns msgmask[msg] or 0
+                        switch(msgfilterlookup(type))
                         {
                             case 2:
                             case 3:
@@ -3760,6 +3917,11 @@ namespace server
                 }
             }
         }
+        if(msgtype >= 0)
+        {
+            metricsmessage(Metrics_In, msgtype, p.length() - msgstart);
+            msgprofileend(MsgProfile_Parsed, msgtype, p.length() - msgstart, msgcycles);
+        }
     }
 
 #undef QUEUE_STR
@@ -3782,6 +3944,7 @@ enum
     EXT_ERROR                    =   1,
     EXT_PLAYERSTATS_RESP_IDS     =  -10,
     EXT_PLAYERSTATS_RESP_STATS   =  -11,
+    EXT_PLAYERSTATS_RESP_BATCH   =  -12,
     EXT_UPTIME                   =   0,
     EXT_PLAYERSTATS              =   1,
     EXT_TEAMSCORE                =   2,
@@ -3790,7 +3953,7 @@ enum
     Client:
     -----
     A: 0 EXT_UPTIME
-    B: 0 EXT_PLAYERSTATS cn #a client number or -1 for all players#
+    B: 0 EXT_PLAYERSTATS cn [1] #a client number or -1 for all players, 1 to ask for batched stats#
     C: 0 EXT_TEAMSCORE
 
     Server:
@@ -3799,6 +3962,8 @@ enum
     B: 0 EXT_PLAYERSTATS cn #send by client# EXT_ACK EXT_VERSION 0 or 1 #error, if cn was > -1 and client does not exist# ...
          EXT_PLAYERSTATS_RESP_IDS pid(s) #1 packet#
          EXT_PLAYERSTATS_RESP_STATS pid playerdata #1 packet for each player#
+       or, when batched stats were asked for:
+         EXT_PLAYERSTATS_RESP_BATCH numplayers count loop(pid playerdata) #as few packets as fit the players#
     C: 0 EXT_TEAMSCORE EXT_ACK EXT_VERSION 0 or 1 #error, no teammode# remaining_time gamemode loop(teamdata [numbases bases] or -1)
 
     Errors:
@@ -3808,9 +3973,22 @@ enum
 
     VAR(extinfoip, 0, 0, 1);
 
-    void extinfoplayer(ucharbuf &p, clientinfo *ci)
+    // player records serialized at most once per tick however often extinfo is
+    // polled; each record starts with EXT_PLAYERSTATS_RESP_STATS, so it can be sent
+    // as is or packed several to a datagram by skipping that first byte
+    struct extinfosnapshot
+    {
+        int millis = -1;
+        std::vector<uchar> ids;         //EXT_PLAYERSTATS_RESP_IDS followed by every pid
+        std::vector<uchar> data;
+        std::vector<int> cns;
+        std::vector<uint> records;      //offset of each record in data, then the end of the last
+    } extinfoplayers;
+
+    constexpr int EXTINFO_BATCH_SIZE = 1200; //largest batched reply, below common path mtus
+
+    static void extinfoplayer(ucharbuf &q, clientinfo *ci)
     {
-        ucharbuf q = p;
         putint(q, EXT_PLAYERSTATS_RESP_STATS); // send player stats following
         putint(q, ci->clientnum); //add player id
         putint(q, ci->ping);
@@ -3828,7 +4006,84 @@ enum
         putint(q, ci->state.state);
         uint ip = extinfoip ? getclientip(ci->clientnum) : 0;
         q.put((uchar*)&ip, 3);
-        sendserverinforeply(q);
+    }
+
+    static extinfosnapshot &updateextinfoplayers()
+    {
+        extinfosnapshot &s = extinfoplayers;
+        if(s.millis == totalmillis)
+        {
+            return s;
+        }
+        s.millis = totalmillis;
+        s.ids.clear();
+        s.data.clear();
+        s.cns.clear();
+        s.records.clear();
+        uchar buf[MAXTRANS];
+        ucharbuf q(buf, sizeof(buf));
+        putint(q, EXT_PLAYERSTATS_RESP_IDS); //send player ids following
+        for(int i = 0; i < clients.size(); i++)
+        {
+            putint(q, clients[i]->clientnum);
+        }
+        s.ids.assign(buf, buf + q.length());
+        for(int i = 0; i < clients.size(); i++)
+        {
+            ucharbuf r(buf, sizeof(buf));
+            extinfoplayer(r, clients[i]);
+            s.cns.push_back(clients[i]->clientnum);
+            s.records.push_back(s.data.size());
+            s.data.insert(s.data.end(), buf, buf + r.length());
+        }
+        s.records.push_back(s.data.size());
+        return s;
+    }
+
+    //sends the chosen records after the reply header already in p, one per datagram
+    static void sendextinfoplayers(ucharbuf &p, const extinfosnapshot &s, int first, int last)
+    {
+        int header = p.length();
+        for(int i = first; i < last; i++)
+        {
+            p.len = header;
+            p.put(&s.data[s.records[i]], std::min(static_cast<int>(s.records[i+1] - s.records[i]), p.remaining()));
+            sendserverinforeply(p);
+        }
+    }
+
+    //packs as many records per datagram as fit in EXTINFO_BATCH_SIZE
+    static void sendextinfobatch(ucharbuf &p, const extinfosnapshot &s)
+    {
+        int header = p.length(),
+            numplayers = static_cast<int>(s.cns.size());
+        int i = 0;
+        do
+        {
+            p.len = header;
+            putint(p, EXT_PLAYERSTATS_RESP_BATCH);
+            putint(p, numplayers);
+            int count = 0,
+                size = 0,
+                limit = std::min(EXTINFO_BATCH_SIZE - p.length() - 5, p.remaining() - 5);
+            while(i + count < numplayers)
+            {
+                int len = s.records[i+count+1] - s.records[i+count] - 1; //skip EXT_PLAYERSTATS_RESP_STATS
+                if(count && size + len > limit)
+                {
+                    break;
+                }
+                size += len;
+                count++;
+            }
+            putint(p, count);
+            for(int j = i; j < i + count; j++)
+            {
+                p.put(&s.data[s.records[j]+1], std::min(static_cast<int>(s.records[j+1] - s.records[j] - 1), p.remaining()));
+            }
+            sendserverinforeply(p);
+            i += count;
+        } while(i < numplayers);
     }
 
     static inline void extinfoteamscore(ucharbuf &p, int team, int score)
@@ -3890,50 +4145,40 @@ enum
             case EXT_PLAYERSTATS:
             {
                 int cn = getint(req); //a special player, -1 for all
-                clientinfo *ci = nullptr;
+                bool batch = req.remaining() && getint(req) == 1;
+                const extinfosnapshot &s = updateextinfoplayers();
+                int first = 0,
+                    last = static_cast<int>(s.cns.size());
                 if(cn >= 0)
                 {
-                    for(int i = 0; i < clients.size(); i++)
-                    {
-                        if(clients[i]->clientnum == cn)
-                        {
-                            ci = clients[i];
-                            break;
-                        }
-                    }
-                    if(!ci)
+                    auto itr = std::find(s.cns.begin(), s.cns.end(), cn);
+                    if(itr == s.cns.end())
                     {
                         putint(p, EXT_ERROR); //client requested by id was not found
                         sendserverinforeply(p);
                         return;
                     }
+                    first = itr - s.cns.begin();
+                    last = first + 1;
                 }
                 putint(p, EXT_NO_ERROR); //so far no error can happen anymore
-                ucharbuf q = p; //remember buffer position
-                putint(q, EXT_PLAYERSTATS_RESP_IDS); //send player ids following
-                if(ci)
+                if(batch && cn < 0)
                 {
-                    putint(q, ci->clientnum);
-                }
-                else
-                {
-                    for(int i = 0; i < clients.size(); i++)
-                    {
-                        putint(q, clients[i]->clientnum);
-                    }
+                    sendextinfobatch(p, s);
+                    return;
                 }
-                sendserverinforeply(q);
-                if(ci)
+                ucharbuf q = p; //remember buffer position
+                if(cn >= 0)
                 {
-                    extinfoplayer(p, ci);
+                    putint(q, EXT_PLAYERSTATS_RESP_IDS); //send player ids following
+                    putint(q, cn);
                 }
                 else
                 {
-                    for(int i = 0; i < clients.size(); i++)
-                    {
-                        extinfoplayer(p, clients[i]);
-                    }
+                    q.put(s.ids.data(), std::min(static_cast<int>(s.ids.size()), q.remaining()));
                 }
+                sendserverinforeply(q);
+                sendextinfoplayers(p, s, first, last);
                 return;
             }
             case EXT_TEAMSCORE:
@@ -3950,19 +4195,31 @@ enum
         sendserverinforeply(p);
     }
 //end of extinfo
-    void serverinforeply(ucharbuf &req, ucharbuf &p)
+
+    // the reply to server browser pings is kept serialized and rebuilt only when
+    // something it reports changes: connects, map, pause or speed, mastermode and
+    // settings invalidate it, the time left and limits are compared on every ping
+    std::vector<uchar> serverinfocache;
+    bool serverinfovalid = false;
+    int serverinfosecs = -1,
+        serverinfomaxclients = -1,
+        serverinfomastermask = -1;
+
+    void invalidateserverinfo()
     {
-        if(req.remaining() && !getint(req))
-        {
-            extserverinforeply(req, p);
-            return;
-        }
+        serverinfovalid = false;
+    }
+
+    static void buildserverinfo(int secs)
+    {
+        uchar buf[MAXTRANS];
+        ucharbuf p(buf, sizeof(buf));
         putint(p, PROTOCOL_VERSION);
         putint(p, numclients(-1, false, true));
         putint(p, maxclients);
         putint(p, gamepaused || gamespeed != 100 ? 5 : 3); // number of attrs following
         putint(p, gamemode);
-        putint(p, !modecheck(gamemode, Mode_Untimed) ? std::max((gamelimit - gamemillis)/1000, 0) : 0);
+        putint(p, secs);
         putint(p, serverpass[0] ? MasterMode_Password : (modecheck(gamemode, Mode_LocalOnly) ? MasterMode_Private : (mastermode || mastermask&MM_AUTOAPPROVE ? mastermode : MasterMode_Auth)));
         if(gamepaused || gamespeed != 100)
         {
@@ -3971,6 +4228,26 @@ enum
         }
         sendstring(smapname, p);
         sendstring(serverdesc, p);
+        serverinfocache.assign(buf, buf + p.length());
+        serverinfovalid = true;
+        serverinfosecs = secs;
+        serverinfomaxclients = maxclients;
+        serverinfomastermask = mastermask;
+    }
+
+    void serverinforeply(ucharbuf &req, ucharbuf &p)
+    {
+        if(req.remaining() && !getint(req))
+        {
+            extserverinforeply(req, p);
+            return;
+        }
+        int secs = !modecheck(gamemode, Mode_Untimed) ? std::max((gamelimit - gamemillis)/1000, 0) : 0;
+        if(!serverinfovalid || secs != serverinfosecs || maxclients != serverinfomaxclients || mastermask != serverinfomastermask)
+        {
+            buildserverinfo(secs);
+        }
+        p.put(serverinfocache.data(), std::min(static_cast<int>(serverinfocache.size()), p.remaining()));
         sendserverinforeply(p);
     }
 
@@ -4278,30 +4555,30 @@ enum
             return false;
         }
 
-        void reinitai(clientinfo *ci)
+        //puts the bot's info into p, returning true if its state has to be sent after
+        bool reinitai(clientinfo *ci, packetbuf &p)
         {
             if(ci->ownernum < 0)
             {
                 deleteai(ci);
+                return false;
             }
-            else if(ci->aireinit >= 1)
+            if(ci->aireinit < 1)
             {
-                //send packet out w/ info
-                sendf(-1, 1, "ri8s", NetMsg_InitAI, ci->clientnum, ci->ownernum, ci->state.aitype, ci->state.skill, ci->playermodel, ci->playercolor, ci->team, ci->name);
-                if(ci->aireinit == 2)
-                {
-                    ci->reassign();
-                    if(ci->state.state==ClientState_Alive)
-                    {
-                        sendspawn(ci);
-                    }
-                    else
-                    {
-                        sendresume(ci);
-                    }
-                }
-                ci->aireinit = 0;
+                return false;
             }
+            putint(p, NetMsg_InitAI);
+            putint(p, ci->clientnum);
+            putint(p, ci->ownernum);
+            putint(p, ci->state.aitype);
+            putint(p, ci->state.skill);
+            putint(p, ci->playermodel);
+            putint(p, ci->playercolor);
+            putint(p, ci->team);
+            sendstring(ci->name, p);
+            bool reassign = ci->aireinit == 2;
+            ci->aireinit = 0;
+            return reassign;
         }
 
         void shiftai(clientinfo *ci, clientinfo *owner = nullptr)
@@ -4344,11 +4621,31 @@ enum
             {
                 balanceteams();
             }
+            //one packet introduces every new or moved bot, then their owners get their states
+            packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+            std::vector<clientinfo *> reassigned;
             for(int i = bots.size(); --i >=0;) //note reverse iteration
             {
-                if(bots[i])
+                if(bots[i] && reinitai(bots[i], p))
+                {
+                    reassigned.push_back(bots[i]);
+                }
+            }
+            if(p.length())
+            {
+                metricsmessage(Metrics_Out, NetMsg_InitAI, p.length());
+                sendpacket(-1, 1, p.finalize());
+            }
+            for(clientinfo *ci : reassigned)
+            {
+                ci->reassign();
+                if(ci->state.state==ClientState_Alive)
+                {
+                    sendspawn(ci);
+                }
+                else
                 {
-                    reinitai(bots[i]);
+                    sendresume(ci);
                 }
             }
         }
@@ -4397,6 +4694,7 @@ enum
             }
             botlimit = clamp(limit, 0, MAXBOTS);
             dorefresh = true;
+            requestbotbalance(true);
             DEF_FORMAT_STRING(msg, "bot limit is now %d", botlimit);
             sendservmsg(msg);
         }
@@ -4416,6 +4714,7 @@ enum
         void changemap()
         {
             dorefresh = true;
+            requestbotbalance(true); //bots were cleared with the old map
             for(int i = 0; i < clients.size(); i++)
             {
                 if(clients[i]->local || clients[i]->privilege)
@@ -4434,6 +4733,7 @@ enum
             if(ci->state.aitype == AI_None)
             {
                 dorefresh = true;
+                requestbotbalance();
             }
         }
 
@@ -4442,6 +4742,7 @@ enum
             if(ci->state.aitype == AI_None)
             {
                 dorefresh = true;
+                requestbotbalance();
             }
         }
     }
@@ -303,8 +303,9 @@ namespace server
         int ping, aireinit;
         string clientmap;
         int mapcrc;
+        int crcstatus, countedcrc; //what this client currently adds to the map crc tally
         bool warned, gameclip;
-        ENetPacket *getdemo, *getmap, *clipboard;
+        ENetPacket *clipboard;
         int lastclipboard, needclipboard;
         int connectauth;
         uint authreq;
@@ -313,7 +314,7 @@ namespace server
         int authkickvictim;
         char *authkickreason;
 
-        clientinfo() : getdemo(nullptr), getmap(nullptr), clipboard(nullptr), authchallenge(nullptr), authkickreason(nullptr) { reset(); }
+        clientinfo() : clipboard(nullptr), authchallenge(nullptr), authkickreason(nullptr) { reset(); }
         ~clientinfo()
         {
             for(gameevent * i : events)
@@ -358,10 +359,12 @@ namespace server
     extern int welcomepacket(packetbuf &p, clientinfo *ci);
 
     extern std::vector<clientinfo *> clients;
-    extern int gamemillis;
+    extern int gamemode, gamemillis;
     extern string smapname;
     extern teaminfo teaminfos[MAXTEAMS];
     extern void sendspawn(clientinfo *ci);
+    extern void changemap(const char *name, int mode, uint resume = 0);
+    extern int numbots;
     extern void pausegame(bool val, clientinfo * ci = nullptr);
 
     namespace aiman
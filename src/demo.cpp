@@ -15,6 +15,11 @@
 #include <ctype.h>
 #include <time.h>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 #include <enet/enet.h>
 #include <zlib.h>
@@ -28,7 +33,14 @@
 
 #include "cserver.h"
 #include "game.h"
+#include "demoreader.h"
+#include "demo.h"
 #include "mapcontrol.h"
+#include "ringbuffer.h"
+#include "transfer.h"
+#include "trace.h"
+#include "metrics.h"
+#include "logger.h"
 
 namespace server
 {
@@ -36,23 +48,84 @@ namespace server
     int nextplayback = 0,
         demomillis = 0;
 
+    static int demomillisrest = 0; //hundredths of a ms of playback carried over to the next tick
+
     VAR(maxdemos, 0, 5, 25);
     VAR(maxdemosize, 0, 16, 31);
     VAR(restrictdemos, 0, 1, 1);
+    VAR(democompress, 0, 6, 9); //zlib level for recorded demos, 0 records them uncompressed
+    VAR(demototalsize, 0, 128, 4096); //MB of recorded demos kept on disk, 0 for no limit
+    VAR(demomaxage, 0, 0, 8760); //hours recorded demos are kept, 0 for no limit
+    SVAR(demodir, "demos"); //directory recorded demos are stored in
+    VAR(demokeyframe, 0, 30, 600); //seconds between seek points in recorded demos, 0 for none
+    VAR(demommap, 0, 1, 1); //map uncompressed demos for playback rather than reading them
+    VARF(demospeed, 25, 100, 1600, //playback speed in percent
+    {
+        if(demoplayback)
+        {
+            sendservmsgf("demo playback speed %d%%", demospeed);
+        }
+    });
 
+    // recorded demos live in demodir as <time>_<mode>_<map>.dmo; only this index is kept in memory
     struct demofile
     {
-        string info;
-        uchar *data;
+        string info, file;
+        uint time;
         int len;
     };
 
-    std::vector<demofile> demos;
+    std::vector<demofile> demos; //oldest first
 
     bool demonextmatch = false;
-    stream *demotmp = nullptr,
-           *demorecord = nullptr,
-           *demoplayback = nullptr;
+    stream *demorecord = nullptr; //the stream the demo being recorded is written through
+    demoreader *demoplayback = nullptr;
+
+    static void setdemoinfo(demofile &d, int mode, const char *map)
+    {
+        time_t t = d.time;
+        char *timestr = ctime(&t),
+             *trim = timestr + strlen(timestr);
+        while(trim>timestr && iscubespace(*--trim))
+        {
+            *trim = '\0';
+        }
+        formatstring(d.info, "%s: %s, %s, %.2f%s", timestr, modeprettyname(mode), map, d.len > 1024*1024 ? d.len/(1024*1024.f) : d.len/1024.0f, d.len > 1024*1024 ? "MB" : "kB");
+    }
+
+    //rebuilds the demo index from the files in demodir
+    void loaddemos()
+    {
+        demos.clear();
+        std::vector<char *> files;
+        listdir(demodir, "dmo", files);
+        for(char *name : files)
+        {
+            uint t;
+            int mode, n = 0;
+            if(sscanf(name, "%u_%d_%n", &t, &mode, &n) == 2 && n > 0)
+            {
+                demofile d;
+                formatstring(d.file, "%s%c%s.dmo", demodir, PATHDIV, name);
+                stream *f = openrawfile(d.file, "rb");
+                if(f)
+                {
+                    d.time = t;
+                    d.len = static_cast<int>(f->size());
+                    delete f;
+                    setdemoinfo(d, mode, &name[n]);
+                    demos.push_back(d);
+                }
+            }
+            delete[] name;
+        }
+        std::sort(demos.begin(), demos.end(), [] (const demofile &a, const demofile &b) { return a.time < b.time; });
+        prunedemos();
+        if(demos.size())
+        {
+            logoutf(Log_Demo, LogLevel_Info, "found %d recorded demos in %s", static_cast<int>(demos.size()), demodir);
+        }
+    }
 
     void listdemos(int cn)
     {
@@ -72,46 +145,22 @@ namespace server
         {
             for(uint i = 0; i < demos.size(); i++)
             {
-                delete[] demos[i].data;
+                remove(demos[i].file);
             }
             demos.clear();
             sendservmsg("cleared all demos");
         }
         else if(demos.size() > n-1)
         {
-            delete[] demos[n-1].data;
+            remove(demos[n-1].file);
             demos.erase(demos.begin() + n-1);
             sendservmsgf("cleared demo %d", n);
         }
     }
 
-    void freegetmap(ENetPacket *packet)
-    {
-        for(int i = 0; i < clients.size(); i++)
-        {
-            clientinfo *ci = clients[i];
-            if(ci->getmap == packet)
-            {
-                ci->getmap = nullptr;
-            }
-        }
-    }
-
-    static void freegetdemo(ENetPacket *packet)
-    {
-        for(int i = 0; i < clients.size(); i++)
-        {
-            clientinfo *ci = clients[i];
-            if(ci->getdemo == packet)
-            {
-                ci->getdemo = nullptr;
-            }
-        }
-    }
-
     void senddemo(clientinfo *ci, int num)
     {
-        if(ci->getdemo)
+        if(hastransfer(ci, NetMsg_SendDemo))
         {
             return;
         }
@@ -124,10 +173,13 @@ namespace server
             return;
         }
         demofile &d = demos[num-1];
-        if((ci->getdemo = sendf(ci->clientnum, 2, "rim", NetMsg_SendDemo, d.len, d.data)))
+        stream *f = openrawfile(d.file, "rb");
+        if(!f)
         {
-            ci->getdemo->freeCallback = freegetdemo;
+            return;
         }
+        //the demo is read a chunk at a time as the transfer goes out
+        sendtransfer(ci, NetMsg_SendDemo, f, true);
     }
 
     void enddemoplayback()
@@ -154,145 +206,519 @@ namespace server
     void setupdemoplayback()
     {
         if(demoplayback) return;
-        demoheader hdr;
-        string msg;
-        msg[0] = '\0';
         DEF_FORMAT_STRING(file, "%s.dmo", smapname);
-        demoplayback = openfile(file, "rb");
-        if(!demoplayback) formatstring(msg, "could not read demo \"%s\"", file);
-        else if(demoplayback->read(&hdr, sizeof(demoheader))!=sizeof(demoheader) || memcmp(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic)))
-            formatstring(msg, "\"%s\" is not a demo file", file);
-        else
-        {
-            if(hdr.version!=DEMO_VERSION) formatstring(msg, "demo \"%s\" requires an %s version of Tesseract", file, hdr.version<DEMO_VERSION ? "older" : "newer");
-            else if(hdr.protocol!=PROTOCOL_VERSION) formatstring(msg, "demo \"%s\" requires an %s version of Tesseract", file, hdr.protocol<PROTOCOL_VERSION ? "older" : "newer");
-        }
-        if(msg[0])
+        demoplayback = new demoreader;
+        if(!demoplayback->open(file, demommap!=0))
         {
+            sendservmsg(demoplayback->error);
             DELETEP(demoplayback);
-            sendservmsg(msg);
             return;
         }
 
         sendservmsgf("playing demo \"%s\"", file);
 
-        demomillis = 0;
+        demomillis = demomillisrest = 0;
         sendf(-1, 1, "ri3", NetMsg_DemoPlayback, 1, -1);
 
-        if(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
+        if(!demoplayback->readmillis(nextplayback))
         {
             enddemoplayback();
             return;
         }
     }
 
+    static void freedemopacket(ENetPacket *packet)
+    {
+        static_cast<demomapping *>(packet->userData)->release();
+    }
+
+    static ENetPacket *readdemopacket(int &chan)
+    {
+        int len;
+        if(!demoplayback->readrecord(chan, len))
+        {
+            return nullptr;
+        }
+        if(demoplayback->map)
+        {
+            //send the record in place; the mapping stays alive until every packet using it is freed
+            uchar *data = demoplayback->mapdata(len);
+            ENetPacket *packet = data ? enet_packet_create(data-1, len+1, ENET_PACKET_FLAG_NO_ALLOCATE) : nullptr;
+            if(!packet)
+            {
+                return nullptr;
+            }
+            data[-1] = NetMsg_DemoPacket;
+            demoplayback->map->refs++;
+            packet->userData = demoplayback->map;
+            packet->freeCallback = freedemopacket;
+            return packet;
+        }
+        ENetPacket *packet = enet_packet_create(nullptr, len+1, 0);
+        if(!packet || !demoplayback->readdata(packet->data+1, len))
+        {
+            if(packet)
+            {
+                enet_packet_destroy(packet);
+            }
+            return nullptr;
+        }
+        packet->data[0] = NetMsg_DemoPacket;
+        return packet;
+    }
+
+    static void senddemopacket(int chan, ENetPacket *packet)
+    {
+        sendpacket(-1, chan, packet);
+        if(!packet->referenceCount)
+        {
+            enet_packet_destroy(packet);
+        }
+    }
+
+    //plays every packet recorded up to millis; if skip is set, position
+    //updates on channel 0 are superseded by later ones and only the last is sent
+    static void playdemoto(int millis, bool skip)
+    {
+        ENetPacket *positions = nullptr;
+        while(demoplayback && millis>=nextplayback)
+        {
+            int chan;
+            ENetPacket *packet = readdemopacket(chan);
+            if(!packet)
+            {
+                break;
+            }
+            if(skip && !chan)
+            {
+                if(positions)
+                {
+                    enet_packet_destroy(positions);
+                }
+                positions = packet;
+            }
+            else
+            {
+                senddemopacket(chan, packet);
+            }
+            if(demoplayback && !demoplayback->readmillis(nextplayback))
+            {
+                break;
+            }
+        }
+        if(positions)
+        {
+            senddemopacket(0, positions);
+        }
+        if(demoplayback && millis>=nextplayback)
+        {
+            enddemoplayback();
+        }
+    }
+
     void readdemo()
     {
         if(!demoplayback)
         {
             return;
         }
-        demomillis += curtime;
-        while(demomillis>=nextplayback)
+        int step = curtime*demospeed + demomillisrest;
+        demomillis += step/100;
+        demomillisrest = step%100;
+        playdemoto(demomillis, demospeed > 100);
+    }
+
+    //jumps to the given second of the demo being played
+    void demoseek(int *secs)
+    {
+        if(!demoplayback)
+        {
+            return;
+        }
+        int millis = std::max(*secs, 0)*1000;
+        const demoseekframe *k = nullptr;
+        for(uint i = 0; i < demoplayback->keyframes.size() && demoplayback->keyframes[i].pos.millis <= millis; i++)
         {
-            int chan, len;
-            if(demoplayback->read(&chan, sizeof(chan))!=sizeof(chan) ||
-               demoplayback->read(&len, sizeof(len))!=sizeof(len))
+            k = &demoplayback->keyframes[i];
+        }
+        //restart from a seek point unless it is quicker to skip ahead from where playback is now
+        if(k && (millis < demomillis || k->pos.millis > demomillis))
+        {
+            if(!demoplayback->seek(*k))
             {
                 enddemoplayback();
                 return;
             }
-            ENetPacket *packet = enet_packet_create(nullptr, len+1, 0);
-            if(!packet || demoplayback->read(packet->data+1, len)!=size_t(len))
+            ENetPacket *packet = enet_packet_create(nullptr, k->snapshot.size()+1, ENET_PACKET_FLAG_RELIABLE);
+            packet->data[0] = NetMsg_DemoPacket;
+            memcpy(packet->data+1, k->snapshot.data(), k->snapshot.size());
+            senddemopacket(1, packet);
+            demomillis = k->pos.millis;
+            if(!demoplayback->readmillis(nextplayback))
             {
-                if(packet)
-                {
-                    enet_packet_destroy(packet);
-                }
                 enddemoplayback();
                 return;
             }
-            packet->data[0] = NetMsg_DemoPacket;
-            sendpacket(-1, chan, packet);
-            if(!packet->referenceCount)
+        }
+        else if(millis < demomillis)
+        {
+            sendservmsg("this demo has no seek index");
+            return;
+        }
+        demomillis = millis;
+        playdemoto(demomillis, true);
+        sendservmsgf("demo playback at %d:%02d", millis/60000, (millis/1000)%60);
+    }
+    COMMAND(demoseek, "i");
+
+    //removes the oldest demos until the count, total size and age limits are met; the newest demo is only removed by count
+    void prunedemos(int extra)
+    {
+        uint now = static_cast<uint>(time(nullptr));
+        long long total = 0;
+        for(uint i = 0; i < demos.size(); i++)
+        {
+            total += demos[i].len;
+        }
+        uint n = 0;
+        for(; n < demos.size(); n++)
+        {
+            const demofile &d = demos[n];
+            bool overcount = static_cast<int>(demos.size() - n) + extra > maxdemos,
+                 oversize = demototalsize && total > (static_cast<long long>(demototalsize)<<20) && n+1 < demos.size(),
+                 overage = demomaxage && now - d.time > static_cast<uint>(demomaxage)*3600 && n+1 < demos.size();
+            if(!overcount && !oversize && !overage)
             {
-                enet_packet_destroy(packet);
+                break;
+            }
+            total -= d.len;
+            remove(d.file);
+        }
+        demos.erase(demos.begin(), demos.begin() + n);
+    }
+
+    static void adddemofile(const char *file, uint t, int len, int mode, const char *map)
+    {
+        demos.emplace_back();
+        demofile &d = demos.back();
+        copystring(d.file, file);
+        d.time = t;
+        d.len = len;
+        setdemoinfo(d, mode, map);
+        sendservmsgf("demo \"%s\" recorded", d.info);
+        prunedemos();
+    }
+
+    //names a new demo of the current map in demodir, creating demodir if needed;
+    //t moves on past the names of demos already on disk or still being written
+    static void newdemofile(string &file, uint &t)
+    {
+        if(!fileexists(demodir, "d"))
+        {
+            createdir(demodir);
+        }
+        string map;
+        copystring(map, smapname);
+        for(char *c = map; *c; c++)
+        {
+            if(!iscubealnum(*c) && *c != '-')
+            {
+                *c = '_';
             }
-            if(!demoplayback)
+        }
+        for(;; t++)
+        {
+            formatstring(file, "%s%c%u_%d_%s.dmo", demodir, PATHDIV, t, gamemode, map);
+            if(!fileexists(file, "r"))
             {
                 break;
             }
-            if(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
+        }
+    }
+
+    // demos are written by one writer thread, so ticks never wait on zlib or
+    // the disk. the game thread batches recorded packets into chunks and queues
+    // them to the writer, which compresses them into the demo's file; ending a
+    // demo queues a last chunk, after which the writer finishes the stream,
+    // appends the seek index and closes the file on its own. finished demos are
+    // handed back and added to the demo list on a later tick
+    enum
+    {
+        DemoChunk_Data = 0,
+        DemoChunk_Keyframe,     //a snapshot to be indexed at this point rather than written
+        DemoChunk_End
+    };
+
+    struct demochunk;
+
+    struct demojob
+    {
+        stream *file,           //the demo file
+               *body;           //the stream the body is written through, file itself if uncompressed
+        string name, map;
+        uint time;
+        int mode, len;
+        bool ok;
+        std::atomic<stream::offset> written; //bytes of file written so far
+        std::vector<demochunk *> keyframes; //seek points written so far, owned by the writer
+    };
+
+    struct demochunk
+    {
+        demojob *job;
+        uchar *data;
+        int type, len, maxlen;
+        demoseekpoint pos;
+
+        demochunk(demojob *job, int size, int type = DemoChunk_Data) : job(job), data(size ? new uchar[size] : nullptr), type(type), len(0), maxlen(size) {}
+        ~demochunk() { delete[] data; }
+    };
+
+    constexpr uint DEMOFREESIZE = 256;
+    constexpr int DEMOCHUNKSIZE = 64*1024;
+
+    static std::mutex demomutex;
+    static std::condition_variable democond;
+    static std::deque<demochunk *> demoqueue;       //queued chunks, game thread to writer
+    static std::vector<demojob *> demofinished;     //closed demos, writer to game thread
+    static spscring<demochunk *, DEMOFREESIZE> demofree; //written chunks, writer to game thread
+    static std::thread demowriter;
+    static bool demowriting = false;
+    static demojob *democurjob = nullptr; //the demo being recorded
+    static demochunk *democur = nullptr;
+    static int nextdemokeyframe = 0;
+
+    //appends the seek index once the demo body is complete
+    static void writedemoindex(demojob *job)
+    {
+        if(job->keyframes.size() && job->file->seek(0, SEEK_END))
+        {
+            demoindexfooter footer;
+            memcpy(footer.magic, DEMOINDEX_MAGIC, sizeof(footer.magic));
+            footer.bodyend = static_cast<uint>(job->file->tell());
+            footer.numkeyframes = static_cast<int>(job->keyframes.size());
+            for(demochunk *c : job->keyframes)
             {
-                enddemoplayback();
-                return;
+                job->ok = job->ok && job->file->write(&c->pos, sizeof(c->pos)) == sizeof(c->pos) &&
+                          job->file->write(c->data, c->len) == static_cast<size_t>(c->len);
             }
+            job->ok = job->ok && job->file->write(&footer, sizeof(footer)) == sizeof(footer);
         }
+        for(demochunk *c : job->keyframes)
+        {
+            delete c;
+        }
+        job->keyframes.clear();
     }
 
-    void prunedemos(int extra = 0)
+    //writes a chunk on the writer thread; returns its demo once that is closed
+    static demojob *writedemochunk(demochunk *c)
     {
-        int n = clamp(static_cast<int>(demos.size()) + extra - maxdemos, 0, static_cast<int>(demos.size()));
-        if(n <= 0)
+        demojob *job = c->job;
+        switch(c->type)
         {
-            return;
+            case DemoChunk_Keyframe:
+            {
+                job->body->flush();
+                c->pos.rawoffset = job->body->rawtell();
+                c->pos.offset = job->body->tell();
+                job->keyframes.push_back(c);
+                return nullptr;
+            }
+            case DemoChunk_End:
+            {
+                delete c;
+                if(job->body != job->file)
+                {
+                    delete job->body; //finishes the compressed stream, leaving the file open
+                }
+                job->body = nullptr;
+                writedemoindex(job);
+                job->len = static_cast<int>(job->file->size());
+                DELETEP(job->file);
+                return job;
+            }
         }
-        for(int i = 0; i < n; ++i)
         {
-            delete[] demos[i].data;
+            TRACE_SPAN("demowrite");
+            job->ok = job->ok && job->body->write(c->data, c->len) == static_cast<size_t>(c->len);
         }
-        demos.erase(demos.begin(), demos.begin() + n);
+        job->written.store(job->body->rawtell(), std::memory_order_relaxed);
+        c->len = 0;
+        if(c->maxlen != DEMOCHUNKSIZE || !demofree.push(c))
+        {
+            delete c;
+        }
+        return nullptr;
     }
 
-    void adddemo()
+    static void demowriterloop()
     {
-        if(!demotmp)
+        settracethread("demowriter");
+        std::unique_lock<std::mutex> lock(demomutex);
+        for(;;)
+        {
+            if(demoqueue.empty())
+            {
+                if(!demowriting)
+                {
+                    break;
+                }
+                democond.wait(lock);
+                continue;
+            }
+            demochunk *c = demoqueue.front();
+            demoqueue.pop_front();
+            lock.unlock();
+            demojob *job = writedemochunk(c);
+            lock.lock();
+            if(job)
+            {
+                demofinished.push_back(job);
+            }
+        }
+    }
+
+    //lets the writer finish every queued demo, then stops it
+    static void stopdemowriter()
+    {
+        if(!demowriter.joinable())
         {
             return;
         }
-        int len = static_cast<int>(std::min(demotmp->size(), stream::offset((maxdemosize<<20) + 0x10000)));
-        demos.emplace_back();
-        demofile &d = demos.back();
-        time_t t = time(nullptr);
-        char *timestr = ctime(&t),
-             *trim = timestr + strlen(timestr);
-        while(trim>timestr && iscubespace(*--trim))
         {
-            *trim = '\0';
+            std::lock_guard<std::mutex> lock(demomutex);
+            demowriting = false;
         }
-        formatstring(d.info, "%s: %s, %s, %.2f%s", timestr, modeprettyname(gamemode), smapname, len > 1024*1024 ? len/(1024*1024.f) : len/1024.0f, len > 1024*1024 ? "MB" : "kB");
-        sendservmsgf("demo \"%s\" recorded", d.info);
-        d.data = new uchar[len];
-        d.len = len;
-        demotmp->seek(0, SEEK_SET);
-        demotmp->read(d.data, len);
-        DELETEP(demotmp);
+        democond.notify_one();
+        demowriter.join();
     }
 
-    void enddemorecord()
+    static void queuedemochunk(demochunk *c)
     {
-        if(!demorecord)
+        if(!demowriter.joinable())
         {
-            return;
+            demowriting = true;
+            demowriter = std::thread(demowriterloop);
+            atexit(stopdemowriter);
+        }
+        {
+            std::lock_guard<std::mutex> lock(demomutex);
+            demoqueue.push_back(c);
         }
+        democond.notify_one();
+    }
 
-        DELETEP(demorecord);
+    static demochunk *getdemochunk(demojob *job, int len)
+    {
+        demochunk *c;
+        if(len > DEMOCHUNKSIZE)
+        {
+            return new demochunk(job, len);
+        }
+        if(demofree.pop(c))
+        {
+            c->job = job;
+            return c;
+        }
+        return new demochunk(job, DEMOCHUNKSIZE);
+    }
 
-        if(!demotmp)
+    //the chunk to append len more bytes of job to, queueing cur once it is full
+    static demochunk *demochunkfor(demojob *job, demochunk *&cur, int len)
+    {
+        if(!cur || cur->maxlen - cur->len < len)
         {
-            return;
+            if(cur)
+            {
+                queuedemochunk(cur);
+            }
+            cur = getdemochunk(job, len);
         }
-        if(!maxdemos || !maxdemosize)
+        return cur;
+    }
+
+    static demochunk *newdemokeyframe(demojob *job, int millis, int len)
+    {
+        demochunk *c = new demochunk(job, len, DemoChunk_Keyframe);
+        c->len = len;
+        c->pos.millis = millis;
+        c->pos.snaplen = len;
+        return c;
+    }
+
+    static void submitdemochunk()
+    {
+        if(democur)
         {
-            DELETEP(demotmp);
-            return;
+            queuedemochunk(democur);
+            democur = nullptr;
+        }
+    }
+
+    static void adddemokeyframe()
+    {
+        submitdemochunk();
+        packetbuf p(MAXTRANS);
+        welcomepacket(p, nullptr);
+        demochunk *c = newdemokeyframe(democurjob, gamemillis, p.len);
+        memcpy(c->data, p.buf, p.len);
+        queuedemochunk(c);
+        nextdemokeyframe = gamemillis + demokeyframe*1000;
+    }
+
+    //adds the demos the writer has closed to the demo list; called every tick
+    void updatedemos()
+    {
+        std::vector<demojob *> finished;
+        {
+            std::lock_guard<std::mutex> lock(demomutex);
+            if(demofinished.empty())
+            {
+                return;
+            }
+            finished.swap(demofinished);
+        }
+        for(demojob *job : finished)
+        {
+            if(!job->ok)
+            {
+                logoutf(Log_Demo, LogLevel_Warn, "could not write the demo %s", job->name);
+                remove(job->name);
+            }
+            else if(!maxdemos || !maxdemosize)
+            {
+                remove(job->name);
+            }
+            else
+            {
+                adddemofile(job->name, job->time, job->len, job->mode, job->map);
+            }
+            delete job;
         }
+    }
 
-        prunedemos(1);
-        adddemo();
+    void enddemorecord()
+    {
+        metricsscope watch(TickPhase_Demo);
+        if(!demorecord)
+        {
+            return;
+        }
+        submitdemochunk();
+        queuedemochunk(new demochunk(democurjob, 0, DemoChunk_End));
+        democurjob = nullptr;
+        demorecord = nullptr;
     }
 
 
+    //closes the demo being recorded and waits for the writer to finish every demo, before the server exits
+    void cleanupdemos()
+    {
+        enddemorecord();
+        stopdemowriter();
+    }
+
     void stopdemo()
     {
         if(modecheck(gamemode, Mode_Demo))
@@ -307,45 +733,264 @@ namespace server
 
     void writedemo(int chan, void *data, int len)
     {
-        if(!demorecord)
+        TRACE_SPAN("writedemo");
+        if(!demorecord || len > DEMO_MAXPACKET)
         {
             return;
         }
+        if(demokeyframe && gamemillis >= nextdemokeyframe)
+        {
+            adddemokeyframe();
+        }
         int stamp[3] = { gamemillis, chan, len };
-        demorecord->write(stamp, sizeof(stamp));
-        demorecord->write(data, len);
-        if(demorecord->rawtell() >= (maxdemosize<<20))
+        demochunkfor(democurjob, democur, sizeof(stamp) + len);
+        memcpy(&democur->data[democur->len], stamp, sizeof(stamp));
+        memcpy(&democur->data[democur->len + sizeof(stamp)], data, len);
+        democur->len += sizeof(stamp) + len;
+        if(democurjob->written.load(std::memory_order_relaxed) >= (maxdemosize<<20))
         {
             enddemorecord();
         }
     }
 
+    //opens a new demo file in demodir for the writer, with its header written
+    static demojob *newdemojob(uint t)
+    {
+        demojob *job = new demojob;
+        newdemofile(job->name, t);
+        job->time = t;
+        job->mode = gamemode;
+        copystring(job->map, smapname);
+        job->len = 0;
+        job->ok = true;
+        job->file = openrawfile(job->name, "w+b");
+        job->body = job->file && democompress ? opengzfile(nullptr, "wb", job->file, democompress) : job->file;
+        if(!job->body)
+        {
+            logoutf(Log_Demo, LogLevel_Warn, "could not open %s for recording", job->name);
+            if(job->file)
+            {
+                delete job->file;
+                remove(job->name);
+            }
+            delete job;
+            return nullptr;
+        }
+        demoheader hdr;
+        memcpy(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic));
+        hdr.version = DEMO_VERSION;
+        hdr.protocol = PROTOCOL_VERSION;
+        job->ok = job->body->write(&hdr, sizeof(demoheader)) == sizeof(demoheader);
+        job->written.store(job->body->rawtell());
+        return job;
+    }
+
     void setupdemorecord()
     {
+        metricsscope watch(TickPhase_Demo);
         if(modecheck(gamemode, Mode_LocalOnly) || modecheck(gamemode, Mode_Edit))
         {
             return;
         }
 
-        stream *f = openfile("demorecord", "wb");
-        if(!f)
+        democurjob = newdemojob(static_cast<uint>(time(nullptr)));
+        if(!democurjob)
         {
-            DELETEP(demotmp);
             return;
         }
 
         sendservmsg("recording demo");
 
-        demorecord = f;
-
-        demoheader hdr;
-        memcpy(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic));
-        hdr.version = DEMO_VERSION;
-        hdr.protocol = PROTOCOL_VERSION;
-        demorecord->write(&hdr, sizeof(demoheader));
+        demorecord = democurjob->body;
+        nextdemokeyframe = gamemillis;
 
         packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
         welcomepacket(p, nullptr);
         writedemo(1, p.buf, p.len);
     }
+
+    // the replay buffer keeps the most recently recorded packets in one
+    // preallocated ring, whether or not a demo is being recorded, so that the
+    // last few minutes of a match can be saved after the fact. records are laid
+    // out as in a demo body, timed by totalmillis so they stay ordered across map
+    // changes; a welcomepacket snapshot record (chan -1) is stored every
+    // demokeyframe seconds and after each map change, and a saved replay starts
+    // from one of them
+    struct replaysnapshot
+    {
+        unsigned long long pos;
+        int millis;
+    };
+
+    static uchar *replaybuf = nullptr;
+    static size_t replaybufsize = 0;
+    static unsigned long long replayhead = 0, //the ring holds the records in [replaytail, replayhead)
+                              replaytail = 0;
+    static std::vector<replaysnapshot> replaysnapshots; //oldest first
+    static int nextreplaysnapshot = 0;
+
+    static void resetreplay()
+    {
+        DELETEA(replaybuf);
+        replaybufsize = 0;
+        replayhead = replaytail = 0;
+        replaysnapshots.clear();
+        nextreplaysnapshot = 0;
+    }
+
+    VARF(replaysize, 0, 16, 1024, resetreplay()); //MB of recent packets kept for savereplay, 0 disables the replay buffer
+
+    static void replayput(const void *data, int len)
+    {
+        size_t offset = replayhead % replaybufsize,
+               first = std::min(static_cast<size_t>(len), replaybufsize - offset);
+        memcpy(&replaybuf[offset], data, first);
+        memcpy(replaybuf, static_cast<const uchar *>(data) + first, len - first);
+        replayhead += len;
+    }
+
+    static void replayget(unsigned long long pos, void *data, int len)
+    {
+        size_t offset = pos % replaybufsize,
+               first = std::min(static_cast<size_t>(len), replaybufsize - offset);
+        memcpy(data, &replaybuf[offset], first);
+        memcpy(static_cast<uchar *>(data) + first, replaybuf, len - first);
+    }
+
+    //drops the oldest records until len more bytes fit
+    static bool addreplayrecord(int chan, const void *data, int len)
+    {
+        int stamp[3] = { totalmillis, chan, len };
+        size_t need = sizeof(stamp) + len;
+        if(need > replaybufsize/2)
+        {
+            return false;
+        }
+        while(replayhead + need - replaytail > replaybufsize)
+        {
+            int old[3];
+            replayget(replaytail, old, sizeof(old));
+            replaytail += sizeof(old) + old[2];
+        }
+        uint expired = 0;
+        while(expired < replaysnapshots.size() && replaysnapshots[expired].pos < replaytail)
+        {
+            expired++;
+        }
+        replaysnapshots.erase(replaysnapshots.begin(), replaysnapshots.begin() + expired);
+        replayput(stamp, sizeof(stamp));
+        replayput(data, len);
+        return true;
+    }
+
+    static void addreplaysnapshot()
+    {
+        packetbuf p(MAXTRANS);
+        welcomepacket(p, nullptr);
+        unsigned long long pos = replayhead;
+        if(addreplayrecord(-1, p.buf, p.len))
+        {
+            replaysnapshots.push_back({ pos, totalmillis });
+        }
+        nextreplaysnapshot = totalmillis + (demokeyframe ? demokeyframe : 30)*1000;
+    }
+
+    void writereplay(int chan, void *data, int len)
+    {
+        if(!replaysize || modecheck(gamemode, Mode_LocalOnly) || modecheck(gamemode, Mode_Edit))
+        {
+            return;
+        }
+        if(!replaybuf)
+        {
+            replaybufsize = static_cast<size_t>(replaysize)<<20;
+            replaybuf = new uchar[replaybufsize];
+        }
+        if(replaysnapshots.empty() || totalmillis - nextreplaysnapshot >= 0)
+        {
+            addreplaysnapshot();
+        }
+        addreplayrecord(chan, data, len);
+    }
+
+    //called once a new map is set up, so the replay has a snapshot of it
+    void replaymapchange()
+    {
+        nextreplaysnapshot = totalmillis;
+    }
+
+    //saves the replay buffer as a demo starting at the last snapshot at least secs seconds old, or the oldest if secs is 0;
+    //the records are copied out here, at most maxdemosize MB of them, and compressed and written by the demo writer
+    void savereplay(int *secs)
+    {
+        if(!maxdemos || !maxdemosize)
+        {
+            sendservmsg("demo recording is disabled");
+            return;
+        }
+        if(replaysnapshots.empty())
+        {
+            sendservmsg("nothing to save in the replay buffer");
+            return;
+        }
+        unsigned long long maxsize = static_cast<unsigned long long>(maxdemosize)<<20;
+        const replaysnapshot *start = &replaysnapshots[0];
+        for(const replaysnapshot &s : replaysnapshots)
+        {
+            //a later snapshot than asked for if the records from there would not fit
+            if((*secs > 0 && totalmillis - s.millis >= *secs*1000) || replayhead - start->pos > maxsize)
+            {
+                start = &s;
+            }
+        }
+        demojob *job = newdemojob(static_cast<uint>(time(nullptr)));
+        if(!job)
+        {
+            return;
+        }
+        //later snapshots become the seek index of the saved demo
+        demochunk *cur = nullptr;
+        unsigned long long size = 0;
+        for(unsigned long long pos = start->pos; pos < replayhead;)
+        {
+            int stamp[3];
+            replayget(pos, stamp, sizeof(stamp));
+            size += sizeof(stamp) + stamp[2];
+            if(size > maxsize)
+            {
+                break;
+            }
+            pos += sizeof(stamp);
+            stamp[0] -= start->millis;
+            if(stamp[1] >= 0 || pos == start->pos + sizeof(stamp))
+            {
+                if(stamp[1] < 0)
+                {
+                    stamp[1] = 1; //the starting snapshot is played as the demo's welcome packet
+                }
+                demochunk *c = demochunkfor(job, cur, sizeof(stamp) + stamp[2]);
+                memcpy(&c->data[c->len], stamp, sizeof(stamp));
+                replayget(pos, &c->data[c->len + sizeof(stamp)], stamp[2]);
+                c->len += sizeof(stamp) + stamp[2];
+            }
+            else
+            {
+                if(cur)
+                {
+                    queuedemochunk(cur);
+                    cur = nullptr;
+                }
+                demochunk *k = newdemokeyframe(job, stamp[0], stamp[2]);
+                replayget(pos, k->data, stamp[2]);
+                queuedemochunk(k);
+            }
+            pos += stamp[2];
+        }
+        if(cur)
+        {
+            queuedemochunk(cur);
+        }
+        queuedemochunk(new demochunk(job, 0, DemoChunk_End));
+    }
+    COMMAND(savereplay, "i");
 }
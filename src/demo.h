@@ -1,3 +1,4 @@
+struct demoreader;
 
 namespace server
 {
@@ -6,21 +7,22 @@ namespace server
     extern int maxdemos, maxdemosize, restrictdemos;
 
     extern bool demonextmatch;
-    extern stream *demotmp,
-                  *demorecord,
-                  *demoplayback;
+    extern stream *demorecord;
+    extern demoreader *demoplayback;
 
     extern void listdemos(int cn);
     extern void cleardemos(int n);
-    extern void freegetmap(ENetPacket *packet);
     extern void senddemo(clientinfo *ci, int num);
     extern void enddemoplayback();
     extern void setupdemoplayback();
     extern void readdemo();
     extern void prunedemos(int extra = 0);
-    extern void adddemo();
+    extern void loaddemos();
+    extern void updatedemos();
     extern void enddemorecord();
     extern void stopdemo();
     extern void writedemo(int chan, void *data, int len);
     extern void setupdemorecord();
+    extern void writereplay(int chan, void *data, int len);
+    extern void replaymapchange();
 }
@@ -0,0 +1,279 @@
+// demoreader.cpp: reading recorded demos and their seek index
+//
+// uncompressed demos can be mapped instead of read; records are then used in
+// place, and the byte in front of each record's data (the reserved top byte of
+// its length) can be overwritten with a packet prefix, which is why the
+// mapping is private and writable
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+
+#ifndef WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+#endif
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "game.h"
+#include "demoreader.h"
+
+void demomapping::release()
+{
+    if(--refs > 0)
+    {
+        return;
+    }
+#ifndef WIN32
+    munmap(data, size);
+#endif
+    delete this;
+}
+
+void demoreader::close()
+{
+    if(body != file)
+    {
+        DELETEP(body);
+    }
+    body = nullptr;
+    DELETEP(file);
+    if(map)
+    {
+        map->release();
+        map = nullptr;
+    }
+    mappos = 0;
+    bodyend = 0;
+    keyframes.clear();
+}
+
+//reads the seek index from the end of f, if there is one
+bool demoreader::loadindex(stream *f)
+{
+    demoindexfooter footer;
+    stream::offset size = f->size();
+    if(size <= static_cast<stream::offset>(sizeof(footer)) ||
+       !f->seek(size - sizeof(footer), SEEK_SET) ||
+       f->read(&footer, sizeof(footer)) != sizeof(footer) ||
+       memcmp(footer.magic, DEMOINDEX_MAGIC, sizeof(footer.magic)) ||
+       footer.bodyend >= size ||
+       !f->seek(footer.bodyend, SEEK_SET))
+    {
+        return false;
+    }
+    for(int i = 0; i < footer.numkeyframes; ++i)
+    {
+        demoseekframe k;
+        if(f->read(&k.pos, sizeof(k.pos)) != sizeof(k.pos) || k.pos.snaplen > (1<<20))
+        {
+            break;
+        }
+        k.snapshot.resize(k.pos.snaplen);
+        if(f->read(k.snapshot.data(), k.pos.snaplen) != k.pos.snaplen)
+        {
+            break;
+        }
+        keyframes.push_back(std::move(k));
+    }
+    bodyend = footer.bodyend;
+    return true;
+}
+
+bool demoreader::mapfile(const char *filename)
+{
+#ifdef WIN32
+    return false;
+#else
+    //records are only usable in place when they were written in this byte order
+    uint one = 1;
+    if(*reinterpret_cast<uchar *>(&one) != 1)
+    {
+        return false;
+    }
+    const char *found = findfile(filename, "rb");
+    int fd = found ? ::open(found, O_RDONLY) : -1;
+    if(fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    uchar magic[2];
+    if(fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(demoheader)) ||
+       pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+       (magic[0] == 0x1F && magic[1] == 0x8B)) //gzip compressed
+    {
+        ::close(fd);
+        return false;
+    }
+    void *mem = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(mem == MAP_FAILED)
+    {
+        return false;
+    }
+    map = new demomapping(static_cast<uchar *>(mem), st.st_size);
+    return true;
+#endif
+}
+
+bool demoreader::checkheader(const char *filename)
+{
+    error[0] = '\0';
+    if(memcmp(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic)))
+    {
+        formatstring(error, "\"%s\" is not a demo file", filename);
+    }
+    else if(hdr.version!=DEMO_VERSION)
+    {
+        formatstring(error, "demo \"%s\" requires an %s version of Tesseract", filename, hdr.version<DEMO_VERSION ? "older" : "newer");
+    }
+    else if(hdr.protocol<DEMO_MINPROTOCOL || hdr.protocol>PROTOCOL_VERSION)
+    {
+        formatstring(error, "demo \"%s\" requires an %s version of Tesseract", filename, hdr.protocol<DEMO_MINPROTOCOL ? "older" : "newer");
+    }
+    if(error[0])
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+//opens a demo, mapping it if mapped is set and the demo is uncompressed; on failure error is set
+bool demoreader::open(const char *filename, bool mapped)
+{
+    close();
+    file = openfile(filename, "rb");
+    if(!file)
+    {
+        formatstring(error, "could not read demo \"%s\"", filename);
+        return false;
+    }
+    loadindex(file);
+    memset(&hdr, 0, sizeof(hdr));
+    if(mapped && mapfile(filename))
+    {
+        DELETEP(file);
+        memcpy(&hdr, map->data, sizeof(hdr));
+        mappos = sizeof(hdr);
+    }
+    else
+    {
+        file->seek(0, SEEK_SET);
+        body = opengzfile(nullptr, "rb", file);
+        if(!body) //demos recorded with democompress 0
+        {
+            file->seek(0, SEEK_SET);
+            body = file;
+        }
+        if(body->read(&hdr, sizeof(hdr)) != sizeof(hdr))
+        {
+            memset(&hdr, 0, sizeof(hdr));
+        }
+    }
+    return checkheader(filename);
+}
+
+bool demoreader::readmillis(int &millis)
+{
+    if(map)
+    {
+        if(mappos + sizeof(millis) > mapend())
+        {
+            return false;
+        }
+        memcpy(&millis, &map->data[mappos], sizeof(millis));
+        mappos += sizeof(millis);
+        return true;
+    }
+    if(!body || (bodyend && body == file && body->tell() >= bodyend))
+    {
+        return false;
+    }
+    return body->read(&millis, sizeof(millis)) == sizeof(millis);
+}
+
+bool demoreader::readrecord(int &chan, int &len)
+{
+    int stamp[2];
+    if(map)
+    {
+        if(mappos + sizeof(stamp) > mapend())
+        {
+            return false;
+        }
+        memcpy(stamp, &map->data[mappos], sizeof(stamp));
+        mappos += sizeof(stamp);
+    }
+    else if(!body || body->read(stamp, sizeof(stamp)) != sizeof(stamp))
+    {
+        return false;
+    }
+    chan = stamp[0];
+    len = stamp[1] & DEMO_MAXPACKET;
+    return true;
+}
+
+bool demoreader::readdata(void *buf, int len)
+{
+    if(map)
+    {
+        uchar *data = mapdata(len);
+        if(!data)
+        {
+            return false;
+        }
+        memcpy(buf, data, len);
+        return true;
+    }
+    return body && body->read(buf, len) == size_t(len);
+}
+
+//returns the next len bytes of a mapped demo in place; the byte before them may be overwritten
+uchar *demoreader::mapdata(int len)
+{
+    if(!map || mappos + len > mapend())
+    {
+        return nullptr;
+    }
+    uchar *data = &map->data[mappos];
+    mappos += len;
+    return data;
+}
+
+bool demoreader::skipdata(int len)
+{
+    if(map)
+    {
+        return mapdata(len) != nullptr;
+    }
+    return body && body->seek(len, SEEK_CUR);
+}
+
+bool demoreader::seek(const demoseekframe &k)
+{
+    if(map)
+    {
+        if(k.pos.offset > mapend())
+        {
+            return false;
+        }
+        mappos = k.pos.offset;
+        return true;
+    }
+    return body && body->seekflushed(k.pos.rawoffset, k.pos.offset);
+}
@@ -0,0 +1,82 @@
+#ifndef DEMOREADER_H_
+#define DEMOREADER_H_
+
+// a demo is a demoheader followed by records of { int millis, chan, len; uchar data[len]; }
+// stored in host byte order, optionally gzip compressed as a whole
+//
+// demos end with a seek index after the (possibly compressed) body: one
+// demoseekpoint per seek point, each followed by a welcomepacket snapshot of
+// the game at that time, then a demoindexfooter locating the index.
+// compressed demos are fully flushed at each seek point, so inflating can
+// restart at its raw offset
+
+static const char DEMOINDEX_MAGIC[8] = "DEMOIDX";
+
+// the top byte of a record's length is reserved so that a mapped demo can place
+// the NetMsg_DemoPacket prefix of a packet directly in front of its data
+constexpr int DEMO_MAXPACKET = 0xFFFFFF;
+
+struct demoseekpoint
+{
+    int millis;
+    uint rawoffset, //offset in the file
+         offset,    //offset in the uncompressed demo
+         snaplen;
+};
+
+struct demoindexfooter
+{
+    char magic[8];
+    uint bodyend;
+    int numkeyframes;
+};
+
+struct demoseekframe
+{
+    demoseekpoint pos;
+    std::vector<uchar> snapshot;
+};
+
+// a private writable mapping of an uncompressed demo, released once the reader
+// and every packet still pointing into it are done with it
+struct demomapping
+{
+    uchar *data;
+    size_t size;
+    int refs;
+
+    demomapping(uchar *data, size_t size) : data(data), size(size), refs(1) {}
+
+    void release();
+};
+
+struct demoreader
+{
+    stream *file,           //raw demo file
+           *body;           //stream the records are read from, file or a gzip stream over it
+    demomapping *map;       //set instead of file and body when the demo is mapped
+    size_t mappos;
+    uint bodyend;           //end of the records, 0 if the demo has no seek index
+    demoheader hdr;
+    std::vector<demoseekframe> keyframes;
+    string error;
+
+    demoreader() : file(nullptr), body(nullptr), map(nullptr), mappos(0), bodyend(0) { error[0] = '\0'; }
+    ~demoreader() { close(); }
+
+    bool open(const char *filename, bool mapped = false);
+    void close();
+    bool readmillis(int &millis);
+    bool readrecord(int &chan, int &len);
+    bool readdata(void *buf, int len);
+    uchar *mapdata(int len);
+    bool skipdata(int len);
+    bool seek(const demoseekframe &k);
+
+    bool loadindex(stream *f);
+    bool mapfile(const char *filename);
+    bool checkheader(const char *filename);
+    size_t mapend() const { return bodyend ? bodyend : map->size; }
+};
+
+#endif
@@ -146,8 +146,9 @@ enum
     NetMsg_DemoPacket,
     NetMsg_GetScore,
     NetMsg_GetRoundTimer,
+    NetMsg_SendChunk,
 
-    NetMsg_NumMsgs //95
+    NetMsg_NumMsgs //96
 };
 
 static const int msgsizes[] =               // size inclusive message token, 0 for variable or not-checked sizes
@@ -254,6 +255,7 @@ static const int msgsizes[] =               // size inclusive message token, 0 f
 
     NetMsg_GetScore, 0,
     NetMsg_GetRoundTimer, 1,
+    NetMsg_SendChunk, 0,
 
     -1
 };
@@ -261,7 +263,8 @@ static const int msgsizes[] =               // size inclusive message token, 0 f
 constexpr int TESSERACT_SERVER_PORT  = 42069;
 constexpr int TESSERACT_LANINFO_PORT = 42067;
 constexpr int  TESSERACT_MASTER_PORT = 42068;
-constexpr int  PROTOCOL_VERSION = 2;              // bump when protocol changes
+constexpr int  PROTOCOL_VERSION = 3;              // bump when protocol changes
+constexpr int  DEMO_MINPROTOCOL = 2;              // oldest protocol whose demos still play; 3 only added NetMsg_SendChunk
 constexpr int  DEMO_VERSION = 1;                  // bump when demo format changes
 constexpr const char * DEMO_MAGIC = "TESSERACT_DEMO\0\0";
 
@@ -297,6 +300,8 @@ namespace server
     extern void stopdemo();
     extern void forcemap(const char *map, int mode);
     extern int msgsizelookup(int msg);
+    extern int msgfilterlookup(int msg);
+    extern int connectfilterlookup(int msg);
 }
 
 #endif
@@ -64,7 +64,6 @@ enum
 extern void *getclientinfo(int i);
 extern ENetPeer *getclientpeer(int i);
 extern ENetPacket *sendf(int cn, int chan, const char *format, ...);
-extern ENetPacket *sendfile(int cn, int chan, stream *file, const char *format = "", ...);
 extern void sendpacket(int cn, int chan, ENetPacket *packet, int exclude = -1);
 extern void flushserver(bool force);
 extern int getservermtu();
@@ -76,3 +75,11 @@ extern bool hasnonlocalclients();
 extern void sendserverinforeply(ucharbuf &p);
 extern bool requestmaster(const char *req);
 extern bool requestmasterf(const char *fmt, ...) PRINTFARGS(1, 2);
+extern void initserver(bool listen);
+extern void updateserver(int millis);
+
+// virtual clients, for running the game without a network
+extern void setvirtualtransport(void (*send)(int cn, int chan, ENetPacket *packet));
+extern int connectvirtualclient(uint ip = 0);
+extern void receivevirtual(int cn, int chan, ENetPacket *packet);
+extern void disconnectvirtualclient(int cn);
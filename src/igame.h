@@ -23,5 +23,6 @@ namespace server
     extern void masterconnected();
     extern bool ispaused();
     extern int scaletime(int t);
+    extern void cleanupdemos();
 }
 
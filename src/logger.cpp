@@ -0,0 +1,547 @@
+// logger.cpp: asynchronous leveled log
+//
+// logoutf does not format anything on the game thread: it copies the format
+// pointer and the raw arguments, strings included, into a fixed-size record and
+// pushes it onto a lock-free queue. a writer thread walks the format again to
+// print each record, so a slow stdout (a pipe, journald) only ever delays the
+// writer. when the queue is full records are dropped and counted, never waited
+// on. calls from other threads, or before initlog, are printed directly
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+
+#include "ringbuffer.h"
+#include "logger.h"
+
+VAR(loglevel, 0, 1, 3);    //least severe level printed: 0 debug, 1 info, 2 warnings, 3 errors
+VAR(logcategories, 0, (1<<Log_NumCategories)-1, (1<<Log_NumCategories)-1); //bitmask of the categories printed
+
+constexpr int LOGARGSIZE = 2*(MAXSTRLEN + sizeof(ushort)) + 4*sizeof(long long); //a full chat line, a decorated player name and a few numbers
+constexpr uint LOGQUEUESIZE = 4096;
+
+static const char * const loglevelnames[LogLevel_NumLevels] = { "debug: ", "", "warning: ", "error: " };
+static const char * const logcategorynames[Log_NumCategories] = { "server", "net", "chat", "game", "bots", "master", "demo", "perf" };
+
+struct logrecord
+{
+    long long time;         //wall clock in ms
+    const char *fmt;
+    uchar level, category, truncated;
+    ushort len;             //bytes of args used
+    uchar args[LOGARGSIZE];
+};
+
+enum
+{
+    LogArg_Int = 0,
+    LogArg_Long,
+    LogArg_LongLong,
+    LogArg_Size,
+    LogArg_IntMax,
+    LogArg_PtrDiff,
+    LogArg_LongDouble
+};
+
+//one conversion of a printf format
+struct logspec
+{
+    char conv;
+    int length, stars;
+};
+
+//parses the conversion after a '%', returning where the format continues
+static const char *parselogspec(const char *fmt, logspec &s)
+{
+    s.stars = 0;
+    s.length = LogArg_Int;
+    while(*fmt && strchr("-+ #0'", *fmt))
+    {
+        fmt++;
+    }
+    if(*fmt == '*')
+    {
+        s.stars++;
+        fmt++;
+    }
+    while(isdigit(*fmt))
+    {
+        fmt++;
+    }
+    if(*fmt == '.')
+    {
+        fmt++;
+        if(*fmt == '*')
+        {
+            s.stars++;
+            fmt++;
+        }
+        while(isdigit(*fmt))
+        {
+            fmt++;
+        }
+    }
+    switch(*fmt)
+    {
+        case 'h':
+        {
+            fmt += fmt[1] == 'h' ? 2 : 1; //promoted to int when passed
+            break;
+        }
+        case 'l':
+        {
+            if(fmt[1] == 'l')
+            {
+                s.length = LogArg_LongLong;
+                fmt += 2;
+            }
+            else
+            {
+                s.length = LogArg_Long;
+                fmt++;
+            }
+            break;
+        }
+        case 'z':
+        {
+            s.length = LogArg_Size;
+            fmt++;
+            break;
+        }
+        case 'j':
+        {
+            s.length = LogArg_IntMax;
+            fmt++;
+            break;
+        }
+        case 't':
+        {
+            s.length = LogArg_PtrDiff;
+            fmt++;
+            break;
+        }
+        case 'L':
+        {
+            s.length = LogArg_LongDouble;
+            fmt++;
+            break;
+        }
+    }
+    s.conv = *fmt;
+    return *fmt ? fmt+1 : fmt;
+}
+
+static bool putlogarg(logrecord &r, const void *data, int len)
+{
+    if(r.len + len > LOGARGSIZE)
+    {
+        r.truncated = 1;
+        return false;
+    }
+    memcpy(&r.args[r.len], data, len);
+    r.len += len;
+    return true;
+}
+
+//copies the arguments of every conversion into the record, as long long,
+//unsigned long long, double or a length-prefixed string
+static void encodelogargs(logrecord &r, const char *fmt, va_list args)
+{
+    while(*fmt)
+    {
+        if(*fmt++ != '%')
+        {
+            continue;
+        }
+        logspec s;
+        fmt = parselogspec(fmt, s);
+        for(int i = 0; i < s.stars; ++i)
+        {
+            int star = va_arg(args, int);
+            if(!putlogarg(r, &star, sizeof(star)))
+            {
+                return;
+            }
+        }
+        bool fits = true;
+        switch(s.conv)
+        {
+            case '%':
+            {
+                break;
+            }
+            case 'd':
+            case 'i':
+            {
+                long long v;
+                switch(s.length)
+                {
+                    case LogArg_Long: v = va_arg(args, long); break;
+                    case LogArg_LongLong: v = va_arg(args, long long); break;
+                    case LogArg_Size: v = va_arg(args, ptrdiff_t); break;
+                    case LogArg_IntMax: v = va_arg(args, intmax_t); break;
+                    case LogArg_PtrDiff: v = va_arg(args, ptrdiff_t); break;
+                    default: v = va_arg(args, int); break;
+                }
+                fits = putlogarg(r, &v, sizeof(v));
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+            case 'c':
+            {
+                unsigned long long v;
+                switch(s.length)
+                {
+                    case LogArg_Long: v = va_arg(args, unsigned long); break;
+                    case LogArg_LongLong: v = va_arg(args, unsigned long long); break;
+                    case LogArg_Size: v = va_arg(args, size_t); break;
+                    case LogArg_IntMax: v = va_arg(args, uintmax_t); break;
+                    case LogArg_PtrDiff: v = va_arg(args, ptrdiff_t); break;
+                    default: v = va_arg(args, uint); break;
+                }
+                fits = putlogarg(r, &v, sizeof(v));
+                break;
+            }
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+            {
+                double v = s.length == LogArg_LongDouble ? static_cast<double>(va_arg(args, long double)) : va_arg(args, double);
+                fits = putlogarg(r, &v, sizeof(v));
+                break;
+            }
+            case 's':
+            {
+                const char *str = va_arg(args, const char *);
+                if(!str)
+                {
+                    str = "(null)";
+                }
+                ushort len = static_cast<ushort>(std::min(strlen(str), static_cast<size_t>(LOGARGSIZE)));
+                int room = LOGARGSIZE - r.len - static_cast<int>(sizeof(len));
+                if(room < 0)
+                {
+                    r.truncated = 1;
+                    return;
+                }
+                if(len > room)
+                {
+                    len = room;
+                    r.truncated = 1;
+                }
+                putlogarg(r, &len, sizeof(len));
+                putlogarg(r, str, len);
+                break;
+            }
+            case 'p':
+            {
+                unsigned long long v = reinterpret_cast<uintptr_t>(va_arg(args, void *));
+                fits = putlogarg(r, &v, sizeof(v));
+                break;
+            }
+            default: //%n and anything unknown end the encoding
+            {
+                r.truncated = 1;
+                return;
+            }
+        }
+        if(!fits)
+        {
+            return;
+        }
+    }
+}
+
+template<class T>
+static bool getlogarg(const logrecord &r, int &pos, T &v)
+{
+    if(pos + static_cast<int>(sizeof(T)) > r.len)
+    {
+        return false;
+    }
+    memcpy(&v, &r.args[pos], sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+//appends one conversion to the line, with its length modifier replaced by the encoded type
+template<class T>
+static int formatlogarg(char *buf, size_t size, const char *spec, int nstars, const int *stars, T v)
+{
+    switch(nstars)
+    {
+        case 0: return snprintf(buf, size, spec, v);
+        case 1: return snprintf(buf, size, spec, stars[0], v);
+        default: return snprintf(buf, size, spec, stars[0], stars[1], v);
+    }
+}
+
+static void formatlogrecord(const logrecord &r, char *line, size_t size)
+{
+    size_t len = 0;
+    int pos = 0;
+    const char *fmt = r.fmt;
+    while(*fmt && len < size - 1)
+    {
+        if(*fmt != '%')
+        {
+            line[len++] = *fmt++;
+            continue;
+        }
+        const char *start = fmt++;
+        logspec s;
+        fmt = parselogspec(fmt, s);
+        if(s.conv == '%')
+        {
+            line[len++] = '%';
+            continue;
+        }
+        //rebuild the conversion without its length modifier
+        char spec[32];
+        int speclen = 0;
+        for(const char *c = start; c < fmt-1 && speclen < static_cast<int>(sizeof(spec)) - 4; ++c)
+        {
+            if(!strchr("hlzjtL", *c))
+            {
+                spec[speclen++] = *c;
+            }
+        }
+        if(strchr("diuoxX", s.conv))
+        {
+            spec[speclen++] = 'l';
+            spec[speclen++] = 'l';
+        }
+        spec[speclen++] = s.conv;
+        spec[speclen] = '\0';
+        int stars[2] = { 0, 0 };
+        bool ok = true;
+        for(int i = 0; i < s.stars && ok; ++i)
+        {
+            ok = getlogarg(r, pos, stars[i]);
+        }
+        int n = 0;
+        switch(s.conv)
+        {
+            case 'd':
+            case 'i':
+            {
+                long long v;
+                ok = ok && getlogarg(r, pos, v);
+                if(ok)
+                {
+                    n = formatlogarg(&line[len], size - len, spec, s.stars, stars, v);
+                }
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+            {
+                unsigned long long v;
+                ok = ok && getlogarg(r, pos, v);
+                if(ok)
+                {
+                    n = formatlogarg(&line[len], size - len, spec, s.stars, stars, v);
+                }
+                break;
+            }
+            case 'c':
+            {
+                unsigned long long v;
+                ok = ok && getlogarg(r, pos, v);
+                if(ok)
+                {
+                    n = formatlogarg(&line[len], size - len, spec, s.stars, stars, static_cast<int>(v));
+                }
+                break;
+            }
+            case 'p':
+            {
+                unsigned long long v;
+                ok = ok && getlogarg(r, pos, v);
+                if(ok)
+                {
+                    n = formatlogarg(&line[len], size - len, spec, s.stars, stars, reinterpret_cast<void *>(static_cast<uintptr_t>(v)));
+                }
+                break;
+            }
+            case 's':
+            {
+                ushort slen;
+                char str[LOGARGSIZE+1];
+                ok = ok && getlogarg(r, pos, slen) && pos + slen <= r.len;
+                if(ok)
+                {
+                    memcpy(str, &r.args[pos], slen);
+                    str[slen] = '\0';
+                    pos += slen;
+                    n = formatlogarg(&line[len], size - len, spec, s.stars, stars, static_cast<const char *>(str));
+                }
+                break;
+            }
+            default:
+            {
+                double v;
+                ok = ok && strchr("fFeEgGaA", s.conv) && getlogarg(r, pos, v);
+                if(ok)
+                {
+                    n = formatlogarg(&line[len], size - len, spec, s.stars, stars, v);
+                }
+                break;
+            }
+        }
+        if(!ok)
+        {
+            break;
+        }
+        len = std::min(len + std::max(n, 0), size - 1);
+    }
+    if(r.truncated && len + 3 < size)
+    {
+        memcpy(&line[len], "...", 3);
+        len += 3;
+    }
+    line[len] = '\0';
+}
+
+static spscring<logrecord, LOGQUEUESIZE> logqueue;
+static std::thread logwriter;
+static std::atomic<bool> logrunning(false);
+static std::atomic<uint> logdropped(0);
+static std::thread::id loggamethread;
+
+static void printlogline(long long time, int level, int category, const char *msg)
+{
+    time_t secs = static_cast<time_t>(time/1000);
+    char stamp[32] = "";
+    struct tm t;
+#ifdef WIN32
+    bool local = !localtime_s(&t, &secs);
+#else
+    bool local = localtime_r(&secs, &t) != nullptr;
+#endif
+    if(local)
+    {
+        strftime(stamp, sizeof(stamp), "%H:%M:%S", &t);
+    }
+    //the message keeps its own trailing newline, if any, like the printf calls it replaces
+    size_t len = strlen(msg);
+    printf("%s [%s] %s%.*s\n", stamp, logcategorynames[category], loglevelnames[level], static_cast<int>(len && msg[len-1] == '\n' ? len-1 : len), msg);
+}
+
+static long long logclock()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void logwriterloop()
+{
+    char line[1024];
+    for(;;)
+    {
+        logrecord r;
+        if(logqueue.pop(r))
+        {
+            formatlogrecord(r, line, sizeof(line));
+            printlogline(r.time, r.level, r.category, line);
+            continue;
+        }
+        uint dropped = logdropped.exchange(0);
+        if(dropped)
+        {
+            snprintf(line, sizeof(line), "log queue full, %u records dropped", dropped);
+            printlogline(logclock(), LogLevel_Warn, Log_Server, line);
+        }
+        fflush(stdout);
+        if(!logrunning.load(std::memory_order_acquire))
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+}
+
+static void stoplog()
+{
+    if(logrunning.load())
+    {
+        logrunning.store(false, std::memory_order_release);
+        logwriter.join();
+    }
+}
+
+//starts the writer; the calling thread becomes the one whose records are queued
+void initlog()
+{
+    if(logrunning.load())
+    {
+        return;
+    }
+    loggamethread = std::this_thread::get_id();
+    logrunning.store(true);
+    logwriter = std::thread(logwriterloop);
+    atexit(stoplog);
+}
+
+void logoutf(int category, int level, const char *fmt, ...)
+{
+    if(level < loglevel || !(logcategories&(1<<category)))
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    if(!logrunning.load(std::memory_order_relaxed) || std::this_thread::get_id() != loggamethread)
+    {
+        char line[1024];
+        vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+        printlogline(logclock(), level, category, line);
+        return;
+    }
+    logrecord r;
+    r.time = logclock();
+    r.fmt = fmt;
+    r.level = level;
+    r.category = category;
+    r.truncated = 0;
+    r.len = 0;
+    encodelogargs(r, fmt, args);
+    va_end(args);
+    if(!logqueue.push(r))
+    {
+        logdropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
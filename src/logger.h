@@ -0,0 +1,33 @@
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+// leveled, categorized server log; the game thread only encodes a record and
+// queues it, a writer thread formats and prints it
+
+enum
+{
+    LogLevel_Debug = 0,
+    LogLevel_Info,
+    LogLevel_Warn,
+    LogLevel_Error,
+    LogLevel_NumLevels
+};
+
+enum
+{
+    Log_Server = 0,     // startup, status and anything without a better home
+    Log_Net,            // connects, disconnects and rate limits
+    Log_Chat,
+    Log_Game,           // rounds, scores and teams
+    Log_Bots,
+    Log_Master,         // master server registration
+    Log_Demo,           // demos, replays and the map cache
+    Log_Perf,           // watchdog reports
+    Log_NumCategories
+};
+
+extern void initlog();
+// fmt must be a string literal: records keep the pointer and are formatted later
+extern void logoutf(int category, int level, const char *fmt, ...) PRINTFARGS(3, 4);
+
+#endif
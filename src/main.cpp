@@ -0,0 +1,33 @@
+// main.cpp: dedicated server entry point
+// kept apart from server.cpp so tools can link the server without it
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <vector>
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+
+#include "iengine.h"
+
+int main(int argc, char **argv)
+{
+    if(enet_initialize()<0)
+    {
+        fatal("Unable to initialise network module");
+    }
+    atexit(enet_deinitialize);
+    enet_time_set(0);
+
+    initserver(true);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,285 @@
+// mapcache.cpp: maps uploaded to the server, kept by name and crc
+//
+// every uploaded map is framed into chunk packets once and kept in memory; the
+// last version uploaded of a map is written to mapcachedir as
+// <name>_<crc>.chunks when the server moves on to another map, so an upload
+// costs no disk write and players uploading map after map leave at most one
+// file per round. the files are kept up to mapcachedisk MB, the least recently
+// used removed first. a map change clears the map being sent: a cached copy is
+// only sent again once its crc is the one taken as the real map, so an upload
+// cannot stand in for the map in later rounds. the most recently used maps are
+// kept mapped, up to mapcachesize MB, and sent straight from the mapping
+// however many clients ask for them
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+
+#include <enet/enet.h>
+#include <zlib.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+#include "igame.h"
+
+#include "game.h"
+#include "cserver.h"
+#include "transfer.h"
+#include "mapcache.h"
+#include "logger.h"
+
+namespace server
+{
+    SVAR(mapcachedir, "mapcache"); //directory uploaded maps are kept in
+    VAR(mapcachesize, 0, 32, 1024); //MB of framed maps kept mapped
+    VAR(mapcachedisk, 0, 256, 65536); //MB of framed maps kept in mapcachedir, 0 for no limit
+
+    struct cachedmap
+    {
+        string name, file;          //name is the map name as used in file names
+        uint crc;
+        uint lastused;
+        size_t size;                //bytes of its file, 0 until it is written
+        transferbuffer *buf;        //framed map while it is in memory; always set until it is written
+    };
+
+    static std::vector<cachedmap> cachedmaps; //every map in mapcachedir
+    static bool mapcacheloaded = false;
+    static uint mapcacheuse = 0;
+
+    static void cachedmapname(string &name, const char *map)
+    {
+        copystring(name, map[0] ? map : "untitled");
+        for(char *c = name; *c; c++)
+        {
+            if(!iscubealnum(*c) && *c != '-')
+            {
+                *c = '_';
+            }
+        }
+    }
+
+    static void loadmapcache()
+    {
+        mapcacheloaded = true;
+        std::vector<char *> files;
+        listdir(mapcachedir, "chunks", files);
+        for(char *file : files)
+        {
+            char *sep = strrchr(file, '_');
+            if(sep && sep > file && strlen(sep+1) == 8)
+            {
+                cachedmap m;
+                copystring(m.name, file, sep - file + 1);
+                m.crc = static_cast<uint>(strtoul(sep+1, nullptr, 16));
+                formatstring(m.file, "%s%c%s.chunks", mapcachedir, PATHDIV, file);
+                m.lastused = 0;
+                m.buf = nullptr;
+                stream *f = openrawfile(m.file, "rb");
+                m.size = f ? static_cast<size_t>(std::max(f->size(), stream::offset(1))) : 1;
+                delete f;
+                cachedmaps.push_back(m);
+            }
+            delete[] file;
+        }
+        if(cachedmaps.size())
+        {
+            logoutf(Log_Demo, LogLevel_Info, "found %d cached maps in %s", static_cast<int>(cachedmaps.size()), mapcachedir);
+        }
+    }
+
+    //drops the least recently used framed maps other than keep from memory, once they are on disk; transfers still sending them keep them alive until done
+    static void trimmapcache(const cachedmap &keep)
+    {
+        size_t limit = static_cast<size_t>(mapcachesize)<<20;
+        for(;;)
+        {
+            size_t total = 0;
+            cachedmap *oldest = nullptr;
+            for(cachedmap &m : cachedmaps)
+            {
+                if(m.buf)
+                {
+                    total += m.buf->size();
+                    if(&m != &keep && m.size && (!oldest || m.lastused < oldest->lastused))
+                    {
+                        oldest = &m;
+                    }
+                }
+            }
+            if(total <= limit || !oldest)
+            {
+                break;
+            }
+            oldest->buf->release();
+            oldest->buf = nullptr;
+        }
+    }
+
+    static transferbuffer *usecachedmap(cachedmap &m)
+    {
+        if(!m.buf)
+        {
+            m.buf = loadtransfer(m.file);
+            if(!m.buf)
+            {
+                return nullptr;
+            }
+        }
+        m.lastused = ++mapcacheuse;
+        trimmapcache(m);
+        return m.buf;
+    }
+
+    //removes the least recently used files until those in mapcachedir fit in mapcachedisk
+    static void prunemapcache()
+    {
+        if(!mapcachedisk)
+        {
+            return;
+        }
+        size_t limit = static_cast<size_t>(mapcachedisk)<<20;
+        for(;;)
+        {
+            size_t total = 0;
+            int oldest = -1;
+            for(uint i = 0; i < cachedmaps.size(); i++)
+            {
+                const cachedmap &m = cachedmaps[i];
+                if(m.size)
+                {
+                    total += m.size;
+                    if(oldest < 0 || m.lastused < cachedmaps[oldest].lastused)
+                    {
+                        oldest = i;
+                    }
+                }
+            }
+            if(total <= limit || oldest < 0)
+            {
+                break;
+            }
+            cachedmap &m = cachedmaps[oldest];
+            remove(m.file);
+            if(m.buf)
+            {
+                m.buf->release();
+            }
+            cachedmaps.erase(cachedmaps.begin() + oldest);
+        }
+    }
+
+    //writes the maps uploaded since the last call to mapcachedir; called when the server moves on to another map
+    void savecachedmaps()
+    {
+        bool saved = false;
+        for(uint i = 0; i < cachedmaps.size();)
+        {
+            cachedmap &m = cachedmaps[i];
+            if(m.size)
+            {
+                i++;
+                continue;
+            }
+            if(!fileexists(mapcachedir, "d"))
+            {
+                createdir(mapcachedir);
+            }
+            if(!savetransfer(m.file, *m.buf))
+            {
+                logoutf(Log_Demo, LogLevel_Warn, "could not write %s to the map cache", m.file);
+                m.buf->release();
+                cachedmaps.erase(cachedmaps.begin() + i);
+                continue;
+            }
+            m.size = sizeof(transferheader) + m.buf->chunks.size()*sizeof(uint) + m.buf->size();
+            saved = true;
+            i++;
+        }
+        if(saved)
+        {
+            prunemapcache();
+        }
+    }
+
+    //stores an uploaded map in memory and returns it framed for sending; the cache keeps the reference
+    transferbuffer *cachemap(const char *map, const uchar *data, int len)
+    {
+        if(!mapcacheloaded)
+        {
+            loadmapcache();
+        }
+        string name;
+        cachedmapname(name, map);
+        uint crc = crc32(0, data, len);
+        for(uint i = 0; i < cachedmaps.size(); i++)
+        {
+            cachedmap &m = cachedmaps[i];
+            if(m.crc == crc && !strcmp(m.name, name))
+            {
+                transferbuffer *buf = usecachedmap(m);
+                if(buf)
+                {
+                    return buf;
+                }
+                cachedmaps.erase(cachedmaps.begin() + i); //the cached file went missing, store it again
+                break;
+            }
+        }
+        transferbuffer *buf = frametransfer(NetMsg_SendMap, static_cast<int>(crc), data, len);
+        if(!buf)
+        {
+            return nullptr;
+        }
+        //an earlier upload of this map that was never written is superseded by this one
+        for(uint i = 0; i < cachedmaps.size(); i++)
+        {
+            cachedmap &m = cachedmaps[i];
+            if(!m.size && !strcmp(m.name, name))
+            {
+                m.buf->release();
+                cachedmaps.erase(cachedmaps.begin() + i);
+                break;
+            }
+        }
+        cachedmaps.emplace_back();
+        cachedmap &m = cachedmaps.back();
+        copystring(m.name, name);
+        m.crc = crc;
+        m.lastused = 0;
+        m.size = 0;
+        m.buf = buf;
+        formatstring(m.file, "%s%c%s_%08x.chunks", mapcachedir, PATHDIV, name, crc);
+        return usecachedmap(m);
+    }
+
+    //returns the cached version of a map with the given crc, framed for sending, or null
+    transferbuffer *findcachedmap(const char *map, uint crc)
+    {
+        if(!mapcacheloaded)
+        {
+            loadmapcache();
+        }
+        string name;
+        cachedmapname(name, map);
+        for(cachedmap &m : cachedmaps)
+        {
+            if(m.crc == crc && !strcmp(m.name, name))
+            {
+                return usecachedmap(m);
+            }
+        }
+        return nullptr;
+    }
+}
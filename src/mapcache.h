@@ -0,0 +1,11 @@
+#ifndef MAPCACHE_H_
+#define MAPCACHE_H_
+
+namespace server
+{
+    extern transferbuffer *cachemap(const char *name, const uchar *data, int len);
+    extern transferbuffer *findcachedmap(const char *name, uint crc);
+    extern void savecachedmaps();
+}
+
+#endif
@@ -22,6 +22,8 @@
 
 #include "game.h"
 #include "cserver.h"
+#include "trace.h"
+#include "logger.h"
 
 //location for the spawns
 vec spawn1 = vec(0,0,0),
@@ -68,7 +70,7 @@ void calcscores()
         {
             server::clients[i]->state.respawn();
             server::sendspawn(server::clients[i]);
-            printf("player health: %d\n", server::clients[i]->state.health);
+            logoutf(Log_Game, LogLevel_Debug, "player health: %d", server::clients[i]->state.health);
         }
     }
 
@@ -136,7 +138,7 @@ void calcscores()
     //so now we check if either team is all dead
     if(team1size == team1dead || totalsecs - lastround >= maxgametime) //team 1 is all dead, or timer has run out
     {
-        printf("Team 1 has died\n");
+        logoutf(Log_Game, LogLevel_Info, "Team 1 has died");
         server::teaminfos[1].score += 1; //add score to team 2
         //now award all alive players on other team 1 point for living
         for(int j = 0; j < server::clients.size(); ++j)
@@ -154,7 +156,7 @@ void calcscores()
     //so now we check if either team is all dead
     if(team2size == team2dead) //team 1 is all dead
     {
-        printf("Team 2 has died\n");
+        logoutf(Log_Game, LogLevel_Info, "Team 2 has died");
         server::teaminfos[0].score += 1; //add score to team 1
 
         //now award all alive players on other team 1 point for living
@@ -178,9 +180,9 @@ void calcscores()
         {
             server::clients[i]->state.respawn();
             server::sendspawn(server::clients[i]);
-            printf("player health: %d\n", server::clients[i]->state.health);
+            logoutf(Log_Game, LogLevel_Debug, "player health: %d", server::clients[i]->state.health);
         }
-            printf("time: %d\n", server::gamemillis + 1000*maxgametime);
+            logoutf(Log_Game, LogLevel_Debug, "time: %d", server::gamemillis + 1000*maxgametime);
         server::pausegame(true);
         sendf(-1, 1, "rii", NetMsg_GetRoundTimer, 1000*betweenroundtime); //send the time the next round will end at
     }
@@ -199,5 +201,6 @@ void sendscore()
 }
 void updatescores()
 {
+    TRACE_SPAN("updatescores");
     calcscores();
 }
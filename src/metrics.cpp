@@ -0,0 +1,490 @@
+// metrics.cpp: runtime telemetry exported in prometheus text format
+//
+// all values are plain atomics written only by the game thread with relaxed
+// stores, so updating them costs about as much as an ordinary increment. a
+// separate thread accepts connections on metricsport, formats a snapshot and
+// answers with it as an http response, so a slow scraper never stalls a tick
+//
+// the phase timings of the current tick are also summed for the slow tick
+// watchdog, which logs where the time went whenever a tick's busy time, all
+// but the idle wait for packets, goes over slowtick milliseconds
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+#include "igame.h"
+
+#include "game.h"
+#include "metrics.h"
+#include "logger.h"
+
+typedef std::atomic<unsigned long long> metriccounter;
+
+constexpr int METRICS_CHANNELS = 3,
+              METRICS_BUCKETS  = 11;
+
+// upper bounds of the tick phase histogram buckets in microseconds, plus +Inf
+static const uint phasebuckets[METRICS_BUCKETS] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000 };
+static const char * const phasenames[TickPhase_NumPhases] = { "update", "scores", "sockets", "network", "flush", "idle", "masterconnect", "demo", "checkmaps", "autoteam", "changemap" };
+static const char * const dirnames[Metrics_NumDirs] = { "in", "out" };
+static const char * const worldstatenames[Worldstate_NumKinds] = { "positions", "messages" };
+
+struct metricshistogram
+{
+    metriccounter buckets[METRICS_BUCKETS+1], sum, count;
+};
+
+struct peermetrics
+{
+    std::atomic<bool> active;
+    std::atomic<uint> rtt, rttvar, loss;
+};
+
+static metricshistogram phases[TickPhase_NumPhases];
+static metriccounter ticks,
+                     channelpackets[Metrics_NumDirs][METRICS_CHANNELS],
+                     channelbytes[Metrics_NumDirs][METRICS_CHANNELS],
+                     messages[Metrics_NumDirs][NetMsg_NumMsgs],
+                     messagebytes[Metrics_NumDirs][NetMsg_NumMsgs],
+                     hostbytes[Metrics_NumDirs],
+                     hostpackets[Metrics_NumDirs],
+                     events,
+                     worldstatebytes[Worldstate_NumKinds],
+                     slowticks;
+static std::atomic<uint> numpeers(0);
+static peermetrics peers[MAXCLIENTS];
+
+VAR(slowtick, 0, 50, 10000);    //busy ms after which a tick is broken down in the log, 0 disables
+
+//the current tick, for the watchdog; only the game thread touches these
+static uint tickstart = 0,
+            tickphases[TickPhase_NumPhases],
+            tickphasecounts[TickPhase_NumPhases],
+            tickmessages = 0,
+            tickpackets[Metrics_NumDirs];
+
+//only the game thread writes, so a relaxed load and store is enough
+static inline void bump(metriccounter &c, unsigned long long n = 1)
+{
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+uint metricsmicros()
+{
+    return static_cast<uint>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//adds the time since start, from metricsmicros, to a tick phase
+void metricsphase(int phase, uint start)
+{
+    uint micros = metricsmicros() - start;
+    metricshistogram &h = phases[phase];
+    int bucket = 0;
+    while(bucket < METRICS_BUCKETS && micros > phasebuckets[bucket])
+    {
+        bucket++;
+    }
+    bump(h.buckets[bucket]);
+    bump(h.sum, micros);
+    bump(h.count);
+    tickphases[phase] += micros;
+    tickphasecounts[phase]++;
+    if(phase == TickPhase_Update)
+    {
+        bump(ticks);
+    }
+}
+
+void metricspacket(int dir, int chan, int len)
+{
+    tickpackets[dir]++;
+    if(chan >= 0 && chan < METRICS_CHANNELS)
+    {
+        bump(channelpackets[dir][chan]);
+        bump(channelbytes[dir][chan], len);
+    }
+}
+
+void metricsmessage(int dir, int type, int len)
+{
+    if(dir == Metrics_In)
+    {
+        tickmessages++;
+    }
+    if(type >= 0 && type < NetMsg_NumMsgs)
+    {
+        bump(messages[dir][type]);
+        bump(messagebytes[dir][type], len);
+    }
+}
+
+void metricstickstart()
+{
+    tickstart = metricsmicros();
+    memset(tickphases, 0, sizeof(tickphases));
+    memset(tickphasecounts, 0, sizeof(tickphasecounts));
+    memset(tickpackets, 0, sizeof(tickpackets));
+    tickmessages = 0;
+}
+
+//checks the tick against the slowtick budget and logs its breakdown if it went over;
+//returns the tick's busy time in microseconds
+uint metricstickend(int clients)
+{
+    static int lastreport = 0,
+               suppressed = 0;
+    uint total = metricsmicros() - tickstart,
+         busy = total - std::min(total, tickphases[TickPhase_Idle]);
+    if(!slowtick || busy <= static_cast<uint>(slowtick)*1000)
+    {
+        return busy;
+    }
+    bump(slowticks);
+    //a server that is slow every tick gets one report a second
+    if(lastreport && totalmillis - lastreport < 1000)
+    {
+        suppressed++;
+        return busy;
+    }
+    lastreport = totalmillis ? totalmillis : 1;
+    string more = "";
+    if(suppressed)
+    {
+        formatstring(more, ", %d more slow ticks since the last report", suppressed);
+        suppressed = 0;
+    }
+    logoutf(Log_Perf, LogLevel_Warn, "slow tick: %.1f ms busy of %.1f ms, %d clients, %u messages in, %u packets in, %u packets out%s",
+            busy/1000.0f, total/1000.0f, clients, tickmessages, tickpackets[Metrics_In], tickpackets[Metrics_Out], more);
+    string breakdown = "";
+    size_t len = 0;
+    for(int i = 0; i < TickPhase_NumPhases && len < sizeof(breakdown); ++i)
+    {
+        if(tickphasecounts[i])
+        {
+            len += snprintf(&breakdown[len], sizeof(breakdown) - len, tickphasecounts[i] > 1 ? " %s %.2f ms (x%u)" : " %s %.2f ms", phasenames[i], tickphases[i]/1000.0f, tickphasecounts[i]);
+        }
+    }
+    logoutf(Log_Perf, LogLevel_Warn, "slow tick phases:%s", breakdown);
+    return busy;
+}
+
+void metricsevent()
+{
+    bump(events);
+}
+
+void metricsworldstate(int kind, int len)
+{
+    bump(worldstatebytes[kind], len);
+}
+
+//called once per tick to pick up enet's own totals and the state of every peer
+void updatemetrics(ENetHost *host)
+{
+    static uint lastsent = 0,
+                lastreceived = 0,
+                lastsentpackets = 0,
+                lastreceivedpackets = 0;
+    static int lastpeers = 0;
+    if(!host)
+    {
+        return;
+    }
+    //enet's totals are 32 bit and wrap, so only their differences are used
+    bump(hostbytes[Metrics_Out], host->totalSentData - lastsent);
+    bump(hostbytes[Metrics_In], host->totalReceivedData - lastreceived);
+    bump(hostpackets[Metrics_Out], host->totalSentPackets - lastsentpackets);
+    bump(hostpackets[Metrics_In], host->totalReceivedPackets - lastreceivedpackets);
+    lastsent = host->totalSentData;
+    lastreceived = host->totalReceivedData;
+    lastsentpackets = host->totalSentPackets;
+    lastreceivedpackets = host->totalReceivedPackets;
+
+    if(totalmillis - lastpeers < 1000)
+    {
+        return;
+    }
+    lastpeers = totalmillis;
+    uint n = 0;
+    for(int i = 0; i < MAXCLIENTS; ++i)
+    {
+        ENetPeer *peer = getclientpeer(i);
+        peermetrics &p = peers[i];
+        if(!peer)
+        {
+            p.active.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        n++;
+        p.rtt.store(peer->roundTripTime, std::memory_order_relaxed);
+        p.rttvar.store(peer->roundTripTimeVariance, std::memory_order_relaxed);
+        p.loss.store(peer->packetLoss, std::memory_order_relaxed);
+        p.active.store(true, std::memory_order_relaxed);
+    }
+    numpeers.store(n, std::memory_order_relaxed);
+}
+
+static void metricf(std::vector<char> &out, const char *fmt, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if(len > 0)
+    {
+        out.insert(out.end(), line, line + std::min(len, static_cast<int>(sizeof(line)) - 1));
+    }
+}
+
+static void metricheader(std::vector<char> &out, const char *name, const char *type, const char *help)
+{
+    metricf(out, "# HELP imprimis_%s %s\n# TYPE imprimis_%s %s\n", name, help, name, type);
+}
+
+static inline unsigned long long value(const metriccounter &c)
+{
+    return c.load(std::memory_order_relaxed);
+}
+
+static void formatmetrics(std::vector<char> &out)
+{
+    metricheader(out, "tick_phase_microseconds", "histogram", "Time spent in each phase of a server tick.");
+    for(int i = 0; i < TickPhase_NumPhases; ++i)
+    {
+        const metricshistogram &h = phases[i];
+        unsigned long long total = 0;
+        for(int j = 0; j < METRICS_BUCKETS; ++j)
+        {
+            total += value(h.buckets[j]);
+            metricf(out, "imprimis_tick_phase_microseconds_bucket{phase=\"%s\",le=\"%u\"} %llu\n", phasenames[i], phasebuckets[j], total);
+        }
+        total += value(h.buckets[METRICS_BUCKETS]);
+        metricf(out, "imprimis_tick_phase_microseconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phasenames[i], total);
+        metricf(out, "imprimis_tick_phase_microseconds_sum{phase=\"%s\"} %llu\n", phasenames[i], value(h.sum));
+        metricf(out, "imprimis_tick_phase_microseconds_count{phase=\"%s\"} %llu\n", phasenames[i], value(h.count));
+    }
+    metricheader(out, "ticks_total", "counter", "Server ticks run.");
+    metricf(out, "imprimis_ticks_total %llu\n", value(ticks));
+    metricheader(out, "slow_ticks_total", "counter", "Ticks whose busy time went over slowtick.");
+    metricf(out, "imprimis_slow_ticks_total %llu\n", value(slowticks));
+
+    metricheader(out, "channel_packets_total", "counter", "Game packets by direction and channel.");
+    for(int i = 0; i < Metrics_NumDirs; ++i)
+    {
+        for(int j = 0; j < METRICS_CHANNELS; ++j)
+        {
+            metricf(out, "imprimis_channel_packets_total{dir=\"%s\",channel=\"%d\"} %llu\n", dirnames[i], j, value(channelpackets[i][j]));
+        }
+    }
+    metricheader(out, "channel_bytes_total", "counter", "Game packet payload bytes by direction and channel.");
+    for(int i = 0; i < Metrics_NumDirs; ++i)
+    {
+        for(int j = 0; j < METRICS_CHANNELS; ++j)
+        {
+            metricf(out, "imprimis_channel_bytes_total{dir=\"%s\",channel=\"%d\"} %llu\n", dirnames[i], j, value(channelbytes[i][j]));
+        }
+    }
+    metricheader(out, "messages_total", "counter", "Messages by direction and NetMsg type, only types seen so far.");
+    for(int i = 0; i < Metrics_NumDirs; ++i)
+    {
+        for(int j = 0; j < NetMsg_NumMsgs; ++j)
+        {
+            if(value(messages[i][j]))
+            {
+                metricf(out, "imprimis_messages_total{dir=\"%s\",type=\"%d\"} %llu\n", dirnames[i], j, value(messages[i][j]));
+            }
+        }
+    }
+    metricheader(out, "message_bytes_total", "counter", "Message bytes by direction and NetMsg type, only types seen so far.");
+    for(int i = 0; i < Metrics_NumDirs; ++i)
+    {
+        for(int j = 0; j < NetMsg_NumMsgs; ++j)
+        {
+            if(value(messages[i][j]))
+            {
+                metricf(out, "imprimis_message_bytes_total{dir=\"%s\",type=\"%d\"} %llu\n", dirnames[i], j, value(messagebytes[i][j]));
+            }
+        }
+    }
+    metricheader(out, "host_bytes_total", "counter", "Bytes on the wire as counted by enet, protocol overhead included.");
+    for(int i = 0; i < Metrics_NumDirs; ++i)
+    {
+        metricf(out, "imprimis_host_bytes_total{dir=\"%s\"} %llu\n", dirnames[i], value(hostbytes[i]));
+    }
+    metricheader(out, "host_packets_total", "counter", "Datagrams as counted by enet.");
+    for(int i = 0; i < Metrics_NumDirs; ++i)
+    {
+        metricf(out, "imprimis_host_packets_total{dir=\"%s\"} %llu\n", dirnames[i], value(hostpackets[i]));
+    }
+    metricheader(out, "events_total", "counter", "Timed game events processed.");
+    metricf(out, "imprimis_events_total %llu\n", value(events));
+    metricheader(out, "worldstate_bytes_total", "counter", "Bytes of worldstate built for broadcast, before per client copies.");
+    for(int i = 0; i < Worldstate_NumKinds; ++i)
+    {
+        metricf(out, "imprimis_worldstate_bytes_total{kind=\"%s\"} %llu\n", worldstatenames[i], value(worldstatebytes[i]));
+    }
+
+    metricheader(out, "peers", "gauge", "Connected remote peers.");
+    metricf(out, "imprimis_peers %u\n", numpeers.load(std::memory_order_relaxed));
+    metricheader(out, "peer_rtt_milliseconds", "gauge", "Smoothed round trip time of each peer.");
+    for(int i = 0; i < MAXCLIENTS; ++i)
+    {
+        if(peers[i].active.load(std::memory_order_relaxed))
+        {
+            metricf(out, "imprimis_peer_rtt_milliseconds{cn=\"%d\"} %u\n", i, peers[i].rtt.load(std::memory_order_relaxed));
+        }
+    }
+    metricheader(out, "peer_rtt_variance_milliseconds", "gauge", "Round trip time variance of each peer.");
+    for(int i = 0; i < MAXCLIENTS; ++i)
+    {
+        if(peers[i].active.load(std::memory_order_relaxed))
+        {
+            metricf(out, "imprimis_peer_rtt_variance_milliseconds{cn=\"%d\"} %u\n", i, peers[i].rttvar.load(std::memory_order_relaxed));
+        }
+    }
+    metricheader(out, "peer_packet_loss_ratio", "gauge", "Reliable packet loss of each peer.");
+    for(int i = 0; i < MAXCLIENTS; ++i)
+    {
+        if(peers[i].active.load(std::memory_order_relaxed))
+        {
+            metricf(out, "imprimis_peer_packet_loss_ratio{cn=\"%d\"} %.4f\n", i, peers[i].loss.load(std::memory_order_relaxed)/static_cast<double>(ENET_PEER_PACKET_LOSS_SCALE));
+        }
+    }
+}
+
+static std::thread metricsthread;
+static std::atomic<bool> metricsrunning(false);
+
+static bool sendall(ENetSocket sock, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        ENetBuffer buf;
+        buf.data = const_cast<char *>(data);
+        buf.dataLength = len;
+        int sent = enet_socket_send(sock, nullptr, &buf, 1);
+        if(sent <= 0)
+        {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static void servemetrics(ENetSocket sock, std::vector<char> &body)
+{
+    //every request gets the metrics, but it is read first so closing does not reset it
+    char req[2048];
+    ENetBuffer buf;
+    buf.data = req;
+    buf.dataLength = sizeof(req);
+    enet_uint32 wait = ENET_SOCKET_WAIT_RECEIVE;
+    if(enet_socket_wait(sock, &wait, 1000) >= 0 && wait&ENET_SOCKET_WAIT_RECEIVE)
+    {
+        enet_socket_receive(sock, nullptr, &buf, 1);
+    }
+    body.clear();
+    formatmetrics(body);
+    char header[256];
+    int len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", static_cast<int>(body.size()));
+    if(sendall(sock, header, len))
+    {
+        sendall(sock, body.data(), body.size());
+    }
+    enet_socket_shutdown(sock, ENET_SOCKET_SHUTDOWN_READ_WRITE);
+}
+
+static void metricsloop(ENetSocket listener)
+{
+    std::vector<char> body;
+    while(metricsrunning.load())
+    {
+        enet_uint32 wait = ENET_SOCKET_WAIT_RECEIVE;
+        if(enet_socket_wait(listener, &wait, 250) < 0 || !(wait&ENET_SOCKET_WAIT_RECEIVE))
+        {
+            continue;
+        }
+        ENetSocket sock = enet_socket_accept(listener, nullptr);
+        if(sock == ENET_SOCKET_NULL)
+        {
+            continue;
+        }
+        enet_socket_set_option(sock, ENET_SOCKOPT_SNDTIMEO, 1000);
+        servemetrics(sock, body);
+        enet_socket_destroy(sock);
+    }
+    enet_socket_destroy(listener);
+}
+
+static void stopmetrics()
+{
+    if(metricsrunning.load())
+    {
+        metricsrunning.store(false);
+        metricsthread.join();
+    }
+}
+
+static void startmetrics();
+
+//address the metrics listener binds to; loopback keeps it off the public interface
+SVARF(metricsip, "127.0.0.1", startmetrics());
+//tcp port metrics are served on in prometheus text format, 0 disables
+VARF(metricsport, 0, 0, 0xFFFF, startmetrics());
+
+static void startmetrics()
+{
+    stopmetrics();
+    if(!metricsport)
+    {
+        return;
+    }
+    ENetAddress address = { ENET_HOST_ANY, enet_uint16(metricsport) };
+    if(metricsip[0] && enet_address_set_host(&address, metricsip) < 0)
+    {
+        logoutf(Log_Perf, LogLevel_Warn, "metrics ip not resolved");
+        return;
+    }
+    ENetSocket listener = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
+    if(listener == ENET_SOCKET_NULL)
+    {
+        logoutf(Log_Perf, LogLevel_Warn, "could not create metrics socket");
+        return;
+    }
+    if(enet_socket_set_option(listener, ENET_SOCKOPT_REUSEADDR, 1) < 0 || enet_socket_bind(listener, &address) < 0 || enet_socket_listen(listener, 4) < 0)
+    {
+        logoutf(Log_Perf, LogLevel_Warn, "could not listen for metrics on port %d", metricsport);
+        enet_socket_destroy(listener);
+        return;
+    }
+    metricsrunning.store(true);
+    metricsthread = std::thread(metricsloop, listener);
+    static bool stopatexit = false;
+    if(!stopatexit)
+    {
+        atexit(stopmetrics); //a joinable thread left at exit would abort the server
+        stopatexit = true;
+    }
+}
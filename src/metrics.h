@@ -0,0 +1,62 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+// runtime telemetry: counters, gauges and histograms updated on the game thread
+// and served in prometheus text format on metricsport, plus a watchdog that
+// breaks down any tick slower than slowtick
+
+enum
+{
+    TickPhase_Update = 0,   // game logic and worldstate, server::serverupdate
+    TickPhase_Scores,       // once a second score tallies
+    TickPhase_Sockets,      // master server and server info sockets
+    TickPhase_Network,      // enet service and packet parsing
+    TickPhase_Flush,        // sending the worldstate
+    TickPhase_Idle,         // enet waiting for packets that did not come
+    // parts of the phases above that are known to stall
+    TickPhase_MasterConnect,// master server lookup and connect
+    TickPhase_Demo,         // starting or finishing a demo recording
+    TickPhase_CheckMaps,
+    TickPhase_AutoTeam,
+    TickPhase_ChangeMap,
+    TickPhase_NumPhases
+};
+
+enum
+{
+    Metrics_In = 0,
+    Metrics_Out,
+    Metrics_NumDirs
+};
+
+enum
+{
+    Worldstate_Positions = 0,
+    Worldstate_Messages,
+    Worldstate_NumKinds
+};
+
+extern uint metricsmicros();
+extern void metricsphase(int phase, uint start);
+extern void metricstickstart();
+extern uint metricstickend(int clients);
+extern void metricspacket(int dir, int chan, int len);
+extern void metricsmessage(int dir, int type, int len);
+extern void metricsevent();
+extern void metricsworldstate(int kind, int len);
+extern void updatemetrics(ENetHost *host);
+
+// times the enclosing scope as a tick phase
+struct metricsscope
+{
+    int phase;
+    uint start;
+
+    metricsscope(int phase) : phase(phase), start(metricsmicros()) {}
+    ~metricsscope()
+    {
+        metricsphase(phase, start);
+    }
+};
+
+#endif
@@ -0,0 +1,148 @@
+// msgprofile.cpp: per message type profiling of parsing, sending and queueing
+//
+// every message is counted with its size; one in msgprofilerate also has its
+// cost measured with the cycle counter, so the profile can stay on in real
+// matches. costs are inclusive: a parsed message that sends replies is charged
+// for building them too
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+#include "igame.h"
+
+#include "game.h"
+#include "msgprofile.h"
+#include "logger.h"
+
+VAR(msgprofile, 0, 1, 1);
+VAR(msgprofilerate, 1, 64, 65536);  //one message in this many has its cost measured
+VAR(msgprofiledump, 0, 0, 1);       //print and reset the profile at every intermission
+
+struct msgstats
+{
+    unsigned long long count, bytes, samples, cycles;
+
+    //estimated cost of every message of the type, from the sampled ones
+    double totalcycles() const
+    {
+        return samples ? static_cast<double>(cycles)/samples*count : 0;
+    }
+};
+
+struct msgrank
+{
+    int type;
+    double cycles;
+
+    bool operator<(const msgrank &o) const
+    {
+        return cycles > o.cycles;
+    }
+};
+
+static const char * const msgprofilenames[MsgProfile_NumKinds] = { "parsed", "sent", "queued" };
+
+static msgstats msgprofiles[MsgProfile_NumKinds][NetMsg_NumMsgs];
+static int samplecountdown = 0,
+           profilemillis = 0;
+
+unsigned long long msgprofilestart()
+{
+    if(!msgprofile || --samplecountdown > 0)
+    {
+        return 0;
+    }
+    samplecountdown = msgprofilerate;
+    return std::max(msgprofileclock(), 1ULL);
+}
+
+void msgprofileend(int kind, int type, int len, unsigned long long start)
+{
+    if(!msgprofile || type < 0 || type >= NetMsg_NumMsgs)
+    {
+        return;
+    }
+    msgstats &s = msgprofiles[kind][type];
+    s.count++;
+    s.bytes += len;
+    if(start)
+    {
+        s.samples++;
+        s.cycles += msgprofileclock() - start;
+    }
+}
+
+static void printmsgprofile(int top)
+{
+    logoutf(Log_Perf, LogLevel_Info, "message profile over %.1f s, 1 in %d sampled (cycles are estimates)", (totalmillis - profilemillis)/1000.0f, msgprofilerate);
+    for(int kind = 0; kind < MsgProfile_NumKinds; ++kind)
+    {
+        std::vector<msgrank> types;
+        double total = 0;
+        for(int i = 0; i < NetMsg_NumMsgs; ++i)
+        {
+            if(msgprofiles[kind][i].count)
+            {
+                msgrank r = { i, msgprofiles[kind][i].totalcycles() };
+                types.push_back(r);
+                total += r.cycles;
+            }
+        }
+        if(types.empty())
+        {
+            continue;
+        }
+        std::sort(types.begin(), types.end());
+        logoutf(Log_Perf, LogLevel_Info, "%-6s %5s %10s %12s %10s %14s %6s", msgprofilenames[kind], "type", "count", "bytes", "cycles/msg", "cycles", "share");
+        for(int i = 0; i < types.size() && (top <= 0 || i < top); ++i)
+        {
+            const msgstats &s = msgprofiles[kind][types[i].type];
+            logoutf(Log_Perf, LogLevel_Info, "%-6s %5d %10llu %12llu %10.0f %14.0f %5.1f%%", "", types[i].type, s.count, s.bytes,
+                   s.samples ? static_cast<double>(s.cycles)/s.samples : 0.0, s.totalcycles(), total > 0 ? 100*s.totalcycles()/total : 0.0);
+        }
+    }
+}
+
+static void resetmsgprofile()
+{
+    memset(msgprofiles, 0, sizeof(msgprofiles));
+    profilemillis = totalmillis;
+}
+
+void msgprofileintermission()
+{
+    if(msgprofile && msgprofiledump)
+    {
+        printmsgprofile(0);
+        resetmsgprofile();
+    }
+}
+
+//prints the most expensive message types of each kind, all of them if top is 0
+void msgprofilestats(int *top)
+{
+    printmsgprofile(*top);
+}
+COMMAND(msgprofilestats, "i");
+
+void msgprofilereset()
+{
+    resetmsgprofile();
+}
+COMMAND(msgprofilereset, "");
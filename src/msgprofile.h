@@ -0,0 +1,40 @@
+#ifndef MSGPROFILE_H_
+#define MSGPROFILE_H_
+
+// per NetMsg type counts, bytes and sampled cycle costs of messages parsed,
+// sent with sendf and queued into the worldstate
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+    #include <x86intrin.h>
+#else
+    #include <chrono>
+#endif
+
+enum
+{
+    MsgProfile_Parsed = 0,  // handled by parsepacket
+    MsgProfile_Sent,        // built and sent by sendf
+    MsgProfile_Queued,      // copied into a client's worldstate messages
+    MsgProfile_NumKinds
+};
+
+extern int msgprofile;
+
+// cycle counter on x86, nanoseconds elsewhere; only differences are meaningful
+inline unsigned long long msgprofileclock()
+{
+#if defined(_MSC_VER) || defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// start of a message: the clock if this one is sampled, 0 if it is only counted
+extern unsigned long long msgprofilestart();
+extern void msgprofileend(int kind, int type, int len, unsigned long long start);
+extern void msgprofileintermission();
+
+#endif
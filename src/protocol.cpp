@@ -0,0 +1,81 @@
+// protocol.cpp: message size and filter tables
+//
+// kept apart from the game server so that tools and benchmarks can use the
+// same tables the server checks incoming messages against
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "game.h"
+
+namespace server
+{
+    int msgsizelookup(int msg)
+    {
+        static int sizetable[NetMsg_NumMsgs] = { -1 };
+        if(sizetable[0] < 0)
+        {
+            memset(sizetable, -1, sizeof(sizetable));
+            for(const int *p = msgsizes; *p >= 0; p += 2)
+            {
+                sizetable[p[0]] = p[1];
+            }
+        }
+        return msg >= 0 && msg < NetMsg_NumMsgs ? sizetable[msg] : -1;
+    }
+
+    static const struct msgfilter
+    {
+        uchar msgmask[NetMsg_NumMsgs];
+
+        msgfilter(int msg, ...)
+        {
+            memset(msgmask, 0, sizeof(msgmask));
+            va_list msgs;
+            va_start(msgs, msg);
+            for(uchar val = 1; msg < NetMsg_NumMsgs; msg = va_arg(msgs, int))
+            {
+                if(msg < 0)
+                {
+                    val = uchar(-msg);
+                }
+                else
+                {
+                    msgmask[msg] = val;
+                }
+            }
+            va_end(msgs);
+        }
+
+        uchar operator[](int msg) const
+        {
+            return msg >= 0 && msg < NetMsg_NumMsgs ? msgmask[msg] : 0;
+        }
+    } msgfilter(-1, NetMsg_Connect, NetMsg_ServerInfo, NetMsg_InitClient, NetMsg_Welcome, NetMsg_MapChange, NetMsg_ServerMsg, NetMsg_Damage, NetMsg_Hitpush, NetMsg_ShotFX, NetMsg_ExplodeFX, NetMsg_Died, NetMsg_SpawnState, NetMsg_ForceDeath, NetMsg_TeamInfo, NetMsg_ItemAcceptance, NetMsg_ItemSpawn, NetMsg_TimeUp, NetMsg_ClientDiscon, NetMsg_CurrentMaster, NetMsg_Pong, NetMsg_Resume, NetMsg_SendDemoList, NetMsg_SendDemo, NetMsg_DemoPlayback, NetMsg_SendMap, NetMsg_Client, NetMsg_AuthChallenge, NetMsg_InitAI, NetMsg_DemoPacket, NetMsg_GetScore, NetMsg_SendChunk,
+                -2, NetMsg_CalcLight, NetMsg_Remip, NetMsg_Newmap, NetMsg_GetMap, NetMsg_SendMap, NetMsg_Clipboard,
+                -3, NetMsg_EditEnt, NetMsg_EditFace, NetMsg_EditTex, NetMsg_EditMat, NetMsg_EditFlip, NetMsg_Copy, NetMsg_Paste, NetMsg_Rotate, NetMsg_Replace, NetMsg_EditVar, NetMsg_EditVSlot, NetMsg_Undo, NetMsg_Redo,
+                -4, NetMsg_AddCube, NetMsg_DelCube, NetMsg_EditFace, NetMsg_Pos, NetMsg_NumMsgs,  NetMsg_GetMap, NetMsg_SendMap),
+      connectfilter(-1, NetMsg_Connect, -2, NetMsg_AuthAnswer, -3, NetMsg_Ping, NetMsg_NumMsgs);
+
+    //how a message from a connected client is checked, see checktype
+    int msgfilterlookup(int msg)
+    {
+        return msgfilter[msg];
+    }
+
+    //which messages a client may send before it is connected, see checktype
+    int connectfilterlookup(int msg)
+    {
+        return connectfilter[msg];
+    }
+}
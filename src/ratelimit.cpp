@@ -0,0 +1,183 @@
+// ratelimit.cpp: per-source-ip token buckets for unauthenticated traffic
+//
+// info queries and connection attempts arrive before any client state exists,
+// so they are checked against a fixed-size open addressing table of token
+// buckets keyed on the source address before any reply is built or any client
+// slot is allocated; a flood costs one hash lookup per datagram
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "command.h"
+
+#include "iengine.h"
+#include "ratelimit.h"
+#include "logger.h"
+
+// rates are in requests per second, bursts in requests; a rate of 0 disables the limit
+VAR(inforate, 0, 10, 1000);
+VAR(infoburst, 1, 20, 1000);
+VAR(extinforate, 0, 2, 1000);
+VAR(extinfoburst, 1, 5, 1000);
+VAR(connectrate, 0, 2, 1000);
+VAR(connectburst, 1, 16, 1000); //enough for a lan party behind one address reconnecting at once
+
+constexpr int RATELIMITBITS  = 12,
+              RATELIMITSIZE  = 1<<RATELIMITBITS,
+              RATELIMITPROBE = 8;                // max slots inspected per lookup
+
+struct ratebucket
+{
+    int tokens,         // in thousandths of a request
+        lastrefill;
+};
+
+struct rateentry
+{
+    uint ip;            // 0 for an empty slot
+    int lastseen;
+    ratebucket buckets[RateLimit_NumLimits];
+};
+
+static rateentry ratetable[RATELIMITSIZE];
+
+static uint ratedrops[RateLimit_NumLimits],
+            ratetotaldrops[RateLimit_NumLimits];
+
+static const char * const ratelimitnames[RateLimit_NumLimits] = { "info", "extinfo", "connect" };
+
+static inline uint ratehash(uint ip)
+{
+    return (ip * 0x9E3779B1U) >> (32 - RATELIMITBITS);
+}
+
+static void getlimit(int type, int &rate, int &burst)
+{
+    switch(type)
+    {
+        case RateLimit_Info:
+        {
+            rate = inforate;
+            burst = infoburst;
+            break;
+        }
+        case RateLimit_ExtInfo:
+        {
+            rate = extinforate;
+            burst = extinfoburst;
+            break;
+        }
+        case RateLimit_Connect:
+        default:
+        {
+            rate = connectrate;
+            burst = connectburst;
+            break;
+        }
+    }
+}
+
+// finds the entry for an ip, reusing the stalest slot in the probe window if it is not present
+static rateentry &findentry(uint ip)
+{
+    uint h = ratehash(ip);
+    rateentry *stalest = nullptr;
+    for(int i = 0; i < RATELIMITPROBE; ++i)
+    {
+        rateentry &e = ratetable[(h + i) & (RATELIMITSIZE-1)];
+        if(e.ip == ip)
+        {
+            return e;
+        }
+        if(!e.ip)
+        {
+            stalest = &e;
+            break;
+        }
+        if(!stalest || totalmillis - e.lastseen > totalmillis - stalest->lastseen)
+        {
+            stalest = &e;
+        }
+    }
+    stalest->ip = ip;
+    for(int i = 0; i < RateLimit_NumLimits; ++i)
+    {
+        int rate, burst;
+        getlimit(i, rate, burst);
+        stalest->buckets[i].tokens = burst*1000;
+        stalest->buckets[i].lastrefill = totalmillis;
+    }
+    return *stalest;
+}
+
+//returns true if a request of the given type from ip may be answered
+bool ratelimit(uint ip, int type)
+{
+    int rate, burst;
+    getlimit(type, rate, burst);
+    if(!rate || !ip)
+    {
+        return true;
+    }
+    rateentry &e = findentry(ip);
+    e.lastseen = totalmillis;
+    ratebucket &b = e.buckets[type];
+    int elapsed = totalmillis - b.lastrefill;
+    if(elapsed > 0)
+    {
+        // rate requests/sec == rate thousandths/ms; clamp elapsed so the product cannot overflow
+        b.tokens = std::min(b.tokens + std::min(elapsed, 1000*1000) * rate, burst*1000);
+        b.lastrefill = totalmillis;
+    }
+    if(b.tokens < 1000)
+    {
+        ratedrops[type]++;
+        return false;
+    }
+    b.tokens -= 1000;
+    return true;
+}
+
+//prints and resets the drop counters since the last status report
+void ratelimitstatus()
+{
+    bool dropped = false;
+    for(int i = 0; i < RateLimit_NumLimits; ++i)
+    {
+        if(ratedrops[i])
+        {
+            dropped = true;
+            break;
+        }
+    }
+    if(dropped)
+    {
+        logoutf(Log_Net, LogLevel_Warn, "rate limit: %u info, %u extinfo, %u connect requests dropped", ratedrops[RateLimit_Info], ratedrops[RateLimit_ExtInfo], ratedrops[RateLimit_Connect]);
+    }
+    for(int i = 0; i < RateLimit_NumLimits; ++i)
+    {
+        ratetotaldrops[i] += ratedrops[i];
+        ratedrops[i] = 0;
+    }
+}
+
+void ratelimitstats()
+{
+    for(int i = 0; i < RateLimit_NumLimits; ++i)
+    {
+        printf("%s: %u dropped\n", ratelimitnames[i], ratetotaldrops[i] + ratedrops[i]);
+    }
+}
+COMMAND(ratelimitstats, "");
@@ -0,0 +1,15 @@
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+enum
+{
+    RateLimit_Info = 0,     // server browser/lan info queries
+    RateLimit_ExtInfo,      // extinfo queries (player stats etc.)
+    RateLimit_Connect,      // enet connection attempts
+    RateLimit_NumLimits
+};
+
+extern bool ratelimit(uint ip, int type);
+extern void ratelimitstatus();
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef RINGBUFFER_H_
+#define RINGBUFFER_H_
+
+#include <atomic>
+
+// bounded lock-free queue for exactly one producer thread and one consumer thread
+// N must be a power of two; push fails instead of blocking when the queue is full
+template<class T, uint N>
+struct spscring
+{
+    static_assert(N && !(N & (N-1)), "spscring size must be a power of two");
+
+    std::atomic<uint> head, tail; // head is only written by the consumer, tail by the producer
+    T items[N];
+
+    spscring() : head(0), tail(0) {}
+
+    bool push(const T &v)
+    {
+        uint t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) >= N)
+        {
+            return false;
+        }
+        items[t & (N-1)] = v;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &v)
+    {
+        uint h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        v = items[h & (N-1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
+
+#endif
@@ -0,0 +1,190 @@
+// scoretable.cpp: saved scores of disconnected players
+//
+// scores are kept in a fixed-size open addressing table keyed on (ip, name) so
+// that a reconnect costs a hash and a short probe instead of a scan of every
+// player who has left this match; the table is plain data, so when scorefile
+// is set it is mapped directly from disk and survives a server restart. the
+// file also records which match the scores belong to and how far it ran: a
+// match interrupted by a restart is resumed with its scores, while the scores
+// of a match that had ended are discarded
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+
+#ifndef WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+#endif
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+#include "igame.h"
+
+#include "game.h"
+#include "cserver.h"
+#include "scoretable.h"
+#include "logger.h"
+
+namespace server
+{
+    //file that saved scores are mapped from; read when the server starts
+    SVAR(scorefile, "");
+
+    constexpr int SCORETABLESIZE = 1024; //must be a power of two
+
+    static const char SCOREFILE_MAGIC[] = "SCOR";
+    constexpr int SCOREFILE_VERSION = 2;
+
+    struct scorestore
+    {
+        char magic[4];
+        int version;
+        int mode;
+        int numscores;
+        uint matchid;
+        int gamemillis;         // -1 once the match has ended
+        string map;
+        savedscore scores[SCORETABLESIZE];
+    };
+
+    static scorestore heapstore;
+    static scorestore *store = &heapstore;
+
+    static uint scorehash(uint ip, const char *name)
+    {
+        uint h = ip * 0x9E3779B1U;
+        for(int i = 0; i <= MAXNAMELEN && name[i]; ++i)
+        {
+            h = ((h<<5) + h) ^ static_cast<uchar>(name[i]);
+        }
+        return h ? h : 1;
+    }
+
+    savedscore *findsavedscore(uint ip, const char *name, bool insert)
+    {
+        uint h = scorehash(ip, name);
+        for(int i = 0; i < SCORETABLESIZE; ++i)
+        {
+            savedscore &sc = store->scores[(h + i) & (SCORETABLESIZE-1)];
+            if(!sc.hash)
+            {
+                if(!insert)
+                {
+                    return nullptr;
+                }
+                memset(&sc, 0, sizeof(sc));
+                sc.ip = ip;
+                sc.hash = h;
+                copystring(sc.name, name);
+                store->numscores++;
+                return &sc;
+            }
+            if(sc.hash == h && sc.ip == ip && !strncmp(sc.name, name, MAXNAMELEN+1))
+            {
+                return &sc;
+            }
+        }
+        return nullptr; //table is full
+    }
+
+    static void resetstore(scorestore *s, const char *map, int mode, uint matchid)
+    {
+        memset(s, 0, sizeof(scorestore));
+        memcpy(s->magic, SCOREFILE_MAGIC, sizeof(s->magic));
+        s->version = SCOREFILE_VERSION;
+        s->mode = mode;
+        s->matchid = matchid;
+        copystring(s->map, map);
+    }
+
+    //starts the scores of a new match; resume is the id loadscores() returned
+    //when this match continues the one the saved scores belong to
+    void clearscores(const char *map, int mode, uint resume)
+    {
+        if(resume && resume == store->matchid && store->mode == mode && !strcmp(store->map, map))
+        {
+            logoutf(Log_Game, LogLevel_Info, "restoring %d saved scores for %s", store->numscores, map);
+            return;
+        }
+        uint matchid = store->matchid + 1;
+        resetstore(store, map, mode, matchid ? matchid : 1);
+    }
+
+    //records how far the match has run, -1 once it has ended
+    void setscoreclock(int gamemillis)
+    {
+        store->gamemillis = gamemillis;
+    }
+
+    //maps scorefile if set; called before the first map is set up. returns true
+    //and fills in m if the file holds the scores of a match that was interrupted
+    bool loadscores(scorematch &m)
+    {
+        if(!scorefile[0] || store != &heapstore)
+        {
+            return false;
+        }
+#ifdef WIN32
+        logoutf(Log_Game, LogLevel_Warn, "scorefile is not supported on this platform");
+        return false;
+#else
+        int fd = open(scorefile, O_RDWR | O_CREAT, 0644);
+        if(fd < 0)
+        {
+            logoutf(Log_Game, LogLevel_Warn, "could not open score file %s", scorefile);
+            return false;
+        }
+        struct stat st;
+        bool valid = !fstat(fd, &st) && st.st_size == static_cast<off_t>(sizeof(scorestore));
+        if(!valid && ftruncate(fd, sizeof(scorestore)) < 0)
+        {
+            logoutf(Log_Game, LogLevel_Warn, "could not resize score file %s", scorefile);
+            close(fd);
+            return false;
+        }
+        void *mem = mmap(nullptr, sizeof(scorestore), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(mem == MAP_FAILED)
+        {
+            logoutf(Log_Game, LogLevel_Warn, "could not map score file %s", scorefile);
+            return false;
+        }
+        store = static_cast<scorestore *>(mem);
+        if(!valid || memcmp(store->magic, SCOREFILE_MAGIC, sizeof(store->magic)) || store->version != SCOREFILE_VERSION)
+        {
+            resetstore(store, "", 0, 0);
+            return false;
+        }
+        store->map[sizeof(store->map) - 1] = '\0';
+        if(!store->numscores || store->gamemillis <= 0 || !store->map[0] || modecheck(store->mode, Mode_Demo))
+        {
+            if(store->numscores)
+            {
+                logoutf(Log_Game, LogLevel_Info, "discarding %d saved scores of a match that had ended", store->numscores);
+            }
+            return false;
+        }
+        m.id = store->matchid;
+        m.mode = store->mode;
+        m.gamemillis = store->gamemillis;
+        copystring(m.map, store->map);
+        return true;
+#endif
+    }
+}
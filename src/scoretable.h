@@ -0,0 +1,55 @@
+#ifndef SCORETABLE_H_
+#define SCORETABLE_H_
+
+namespace server
+{
+    // plain old data so that the whole table can live in a mapped file
+    struct savedscore
+    {
+        uint ip;
+        uint hash;              // hash of (ip, name); 0 for an empty slot
+        char name[MAXNAMELEN+1];
+        int frags, score, deaths, teamkills, shotdamage, damage;
+        int timeplayed;
+        float effectiveness;
+
+        void save(servstate &gs)
+        {
+            frags = gs.frags;
+            score = gs.score;
+            deaths = gs.deaths;
+            teamkills = gs.teamkills;
+            shotdamage = gs.shotdamage;
+            damage = gs.damage;
+            timeplayed = gs.timeplayed;
+            effectiveness = gs.effectiveness;
+        }
+
+        void restore(servstate &gs)
+        {
+            gs.frags = frags;
+            gs.score = score;
+            gs.deaths = deaths;
+            gs.teamkills = teamkills;
+            gs.shotdamage = shotdamage;
+            gs.damage = damage;
+            gs.timeplayed = timeplayed;
+            gs.effectiveness = effectiveness;
+        }
+    };
+
+    // the match the scores in scorefile were saved in
+    struct scorematch
+    {
+        uint id;
+        int mode, gamemillis;
+        string map;
+    };
+
+    extern savedscore *findsavedscore(uint ip, const char *name, bool insert);
+    extern void clearscores(const char *map, int mode, uint resume = 0);
+    extern void setscoreclock(int gamemillis);
+    extern bool loadscores(scorematch &m);
+}
+
+#endif
@@ -25,6 +25,12 @@
 #include "igame.h"
 #include "game.h"
 #include "mapcontrol.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "msgprofile.h"
+#include "trace.h"
+#include "logger.h"
+#include "capture.h"
 
 constexpr int DEFAULTCLIENTS = 8;
 
@@ -32,7 +38,8 @@ enum
 {
     ServerClient_Empty,
     ServerClient_Local,
-    ServerClient_Remote
+    ServerClient_Remote,
+    ServerClient_Virtual    // remote to the game, but packets go to virtualsend instead of enet
 };
 
 struct client                   // server side version of "dynent" type
@@ -40,6 +47,7 @@ struct client                   // server side version of "dynent" type
     int type;
     int num;
     ENetPeer *peer;
+    uint ip;                    // address a virtual client is given
     string hostname;
     void *info;
 };
@@ -52,6 +60,8 @@ ENetSocket lansock = ENET_SOCKET_NULL;
 int localclients = 0,
     nonlocalclients = 0;
 
+static void (*virtualsend)(int cn, int chan, ENetPacket *packet) = nullptr;
+
 bool hasnonlocalclients()
 {
     return nonlocalclients!=0;
@@ -79,6 +89,7 @@ client &addclient(int type)
     switch(type)
     {
         case ServerClient_Remote:
+        case ServerClient_Virtual:
         {
             nonlocalclients++;
             break;
@@ -114,6 +125,11 @@ void delclient(client *c)
             localclients--;
             break;
         }
+        case ServerClient_Virtual:
+        {
+            nonlocalclients--;
+            break;
+        }
         case ServerClient_Empty:
         {
             return;
@@ -130,6 +146,7 @@ void delclient(client *c)
 
 void cleanupserver()
 {
+    server::cleanupdemos();
     enet_host_destroy(serverhost);
     serverhost = nullptr;
     if(lansock != ENET_SOCKET_NULL)
@@ -166,7 +183,7 @@ void process(ENetPacket *packet, int sender, int chan);
 
 int getservermtu()
 {
-    return serverhost->mtu;
+    return serverhost ? serverhost->mtu : ENET_HOST_DEFAULT_MTU; //virtual clients run without a host
 }
 
 void *getclientinfo(int i)
@@ -181,7 +198,25 @@ ENetPeer *getclientpeer(int i)
 
 uint getclientip(int n)
 {
-    return clients.size() > n && clients[n]->type==ServerClient_Remote ? clients[n]->peer->address.host : 0;
+    if(!(clients.size() > n))
+    {
+        return 0;
+    }
+    switch(clients[n]->type)
+    {
+        case ServerClient_Remote:
+        {
+            return clients[n]->peer->address.host;
+        }
+        case ServerClient_Virtual:
+        {
+            return clients[n]->ip;
+        }
+        default:
+        {
+            return 0;
+        }
+    }
 }
 
 void sendpacket(int n, int chan, ENetPacket *packet, int exclude)
@@ -203,6 +238,16 @@ void sendpacket(int n, int chan, ENetPacket *packet, int exclude)
         case ServerClient_Remote:
         {
             enet_peer_send(clients[n]->peer, chan, packet);
+            metricspacket(Metrics_Out, chan, packet->dataLength);
+            break;
+        }
+        case ServerClient_Virtual:
+        {
+            if(virtualsend)
+            {
+                virtualsend(n, chan, packet);
+            }
+            metricspacket(Metrics_Out, chan, packet->dataLength);
             break;
         }
     }
@@ -210,7 +255,7 @@ void sendpacket(int n, int chan, ENetPacket *packet, int exclude)
 
 ENetPacket *sendf(int cn, int chan, const char *format, ...)
 {
-    int exclude = -1;
+    unsigned long long msgcycles = msgprofilestart();
     bool reliable = false;
     if(*format=='r')
     {
@@ -220,114 +265,15 @@ ENetPacket *sendf(int cn, int chan, const char *format, ...)
     packetbuf p(MAXTRANS, reliable ? ENET_PACKET_FLAG_RELIABLE : 0);
     va_list args;
     va_start(args, format);
-    while(*format)
-    {
-        switch(*format++)
-        {
-            case 'x':
-            {
-                exclude = va_arg(args, int);
-                break;
-            }
-            case 'v':
-            {
-                int n = va_arg(args, int);
-                int *v = va_arg(args, int *);
-                for(int i = 0; i < n; ++i)
-                {
-                    putint(p, v[i]);
-                }
-                break;
-            }
-            case 'i':
-            {
-                int n = isdigit(*format) ? *format++-'0' : 1;
-                for(int i = 0; i < n; ++i)
-                {
-                    putint(p, va_arg(args, int));
-                }
-                break;
-            }
-            case 'f':
-            {
-                int n = isdigit(*format) ? *format++-'0' : 1;
-                for(int i = 0; i < n; ++i)
-                {
-                    putfloat(p, static_cast<float>(va_arg(args, double)));
-                }
-                break;
-            }
-            case 's':
-            {
-                sendstring(va_arg(args, const char *), p);
-                break;
-            }
-            case 'm':
-            {
-                int n = va_arg(args, int);
-                p.put(va_arg(args, uchar *), n);
-                break;
-            }
-        }
-    }
+    int exclude = putformat(p, format, args);
     va_end(args);
+    ucharbuf q(p.buf, p.length());
+    int type = getint(q),
+        len = p.length();
+    metricsmessage(Metrics_Out, type, len);
     ENetPacket *packet = p.finalize();
     sendpacket(cn, chan, packet, exclude);
-    return packet->referenceCount > 0 ? packet : nullptr;
-}
-
-ENetPacket *sendfile(int cn, int chan, stream *file, const char *format, ...)
-{
-    if(cn < 0)
-    {
-        return nullptr;
-    }
-    else if(!(clients.size() > cn))
-    {
-        return nullptr;
-    }
-    int len = static_cast<int>(std::min(file->size(), stream::offset(INT_MAX)));
-    if(len <= 0 || len > 16<<20)
-    {
-        return nullptr;
-    }
-    packetbuf p(MAXTRANS+len, ENET_PACKET_FLAG_RELIABLE);
-    va_list args;
-    va_start(args, format);
-    while(*format)
-    {
-        switch(*format++)
-        {
-            case 'i':
-            {
-                int n = isdigit(*format) ? *format++-'0' : 1;
-                for(int i = 0; i < n; ++i)
-                {
-                    putint(p, va_arg(args, int));
-                }
-                break;
-            }
-            case 's':
-            {
-                sendstring(va_arg(args, const char *), p);
-                break;
-            }
-            case 'l':
-            {
-                putint(p, len); break;
-            }
-        }
-    }
-    va_end(args);
-
-    file->seek(0, SEEK_SET);
-    file->read(p.subbuf(len).buf, len);
-
-    ENetPacket *packet = p.finalize();
-    if(cn >= 0)
-    {
-        sendpacket(cn, chan, packet, -1);
-    }
+    msgprofileend(MsgProfile_Sent, type, len, msgcycles);
     return packet->referenceCount > 0 ? packet : nullptr;
 }
 
@@ -386,11 +332,14 @@ const char *disconnectreason(int reason)
 void disconnect_client(int n, int reason)
 {
     //don't drop local clients
-    if(!(clients.size() >n) || clients[n]->type!=ServerClient_Remote)
+    if(!(clients.size() >n) || (clients[n]->type!=ServerClient_Remote && clients[n]->type!=ServerClient_Virtual))
     {
         return;
     }
-    enet_peer_disconnect(clients[n]->peer, reason);
+    if(clients[n]->type==ServerClient_Remote)
+    {
+        enet_peer_disconnect(clients[n]->peer, reason);
+    }
     server::clientdisconnect(n);
     delclient(clients[n]);
     const char *msg = disconnectreason(reason);
@@ -403,7 +352,7 @@ void disconnect_client(int n, int reason)
     {
         formatstring(s, "client (%s) disconnected", clients[n]->hostname);
     }
-    printf("%s\n", s);
+    logoutf(Log_Net, LogLevel_Info, "%s", s);
     server::sendservmsg(s);
 }
 
@@ -411,7 +360,7 @@ void kicknonlocalclients(int reason)
 {
     for(uint i = 0; i < clients.size(); i++)
     {
-        if(clients[i]->type==ServerClient_Remote)
+        if(clients[i]->type==ServerClient_Remote || clients[i]->type==ServerClient_Virtual)
         {
             disconnect_client(i, reason);
         }
@@ -420,6 +369,8 @@ void kicknonlocalclients(int reason)
 
 void process(ENetPacket *packet, int sender, int chan)   // sender may be -1
 {
+    TRACE_SPAN("parsepacket");
+    metricspacket(Metrics_In, chan, packet->dataLength);
     packetbuf p(packet);
     server::parsepacket(sender, chan, p);
     if(p.overread())
@@ -473,13 +424,15 @@ VARF(masterport, 1, server::masterport(), 0xFFFF, disconnectmaster());
 
 ENetSocket connectmaster(bool wait)
 {
+    TRACE_SPAN("connectmaster");
+    metricsscope watch(TickPhase_MasterConnect);
     if(!mastername[0]) //if no master to look up
     {
         return ENET_SOCKET_NULL;
     }
     if(masteraddress.host == ENET_HOST_ANY)
     {
-        printf("looking up %s...\n", mastername);
+        logoutf(Log_Master, LogLevel_Info, "looking up %s...", mastername);
         masteraddress.port = masterport;
         if(!resolverwait(mastername, &masteraddress))
         {
@@ -489,7 +442,7 @@ ENetSocket connectmaster(bool wait)
     ENetSocket sock = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
     if(sock == ENET_SOCKET_NULL)
     {
-        printf("could not open master server socket\n");
+        logoutf(Log_Master, LogLevel_Warn, "could not open master server socket");
         return ENET_SOCKET_NULL;
     }
     if(wait || serveraddress.host == ENET_HOST_ANY || !enet_socket_bind(sock, &serveraddress))
@@ -508,7 +461,7 @@ ENetSocket connectmaster(bool wait)
         }
     }
     enet_socket_destroy(sock);
-    printf("could not connect to master server\n");
+    logoutf(Log_Master, LogLevel_Warn, "could not connect to master server");
 
     return ENET_SOCKET_NULL;
 }
@@ -564,11 +517,11 @@ void processmasterinput()
         }
         if(matchstring(input, cmdlen, "failreg"))
         {
-            printf("master server registration failed: %s\n", args);
+            logoutf(Log_Master, LogLevel_Warn, "master server registration failed: %s", args);
         }
         else if(matchstring(input, cmdlen, "succreg"))
         {
-            printf("master server registration succeeded\n");
+            logoutf(Log_Master, LogLevel_Info, "master server registration succeeded");
         }
         end++;
         masterinpos = end - masterin.data();
@@ -585,9 +538,10 @@ void processmasterinput()
 
 void flushmasteroutput()
 {
+    TRACE_SPAN("flushmasteroutput");
     if(masterconnecting && totalmillis - masterconnecting >= 60000)
     {
-        printf("could not connect to master server\n");
+        logoutf(Log_Master, LogLevel_Warn, "could not connect to master server");
         disconnectmaster();
     }
     if(masterout.empty() || !masterconnected)
@@ -615,6 +569,7 @@ void flushmasteroutput()
 
 void flushmasterinput()
 {
+    TRACE_SPAN("flushmasterinput");
     if(masterin.size() >= masterin.capacity())
     {
         masterin.reserve(4096);
@@ -649,6 +604,14 @@ void sendserverinforeply(ucharbuf &p)
 
 constexpr int MAXPINGDATA = 32;
 
+// the bucket an info query is charged to: a leading 0 argument selects extinfo,
+// decoded with getint as server::serverinforeply() does, escaped forms included
+static int infolimit(uchar *data, int len)
+{
+    ucharbuf req(data, len);
+    return req.remaining() && !getint(req) ? RateLimit_ExtInfo : RateLimit_Info;
+}
+
 void checkserversockets()        // reply all server info requests
 {
     static ENetSocketSet readset, writeset;
@@ -685,6 +648,10 @@ void checkserversockets()        // reply all server info requests
         {
             return;
         }
+        if(!ratelimit(serverinfoaddress.host, infolimit(data+2, len-2)))
+        {
+            return;
+        }
         ucharbuf req(data+2, len-2), p(data+2, sizeof(data)-2);
         p.len += len-2;
         server::serverinforeply(req, p);
@@ -699,7 +666,7 @@ void checkserversockets()        // reply all server info requests
                 int error = 0;
                 if(enet_socket_get_option(mastersock, ENET_SOCKOPT_ERROR, &error) < 0 || error)
                 {
-                    printf("could not connect to master server\n");
+                    logoutf(Log_Master, LogLevel_Warn, "could not connect to master server");
                     disconnectmaster();
                 }
                 else
@@ -723,6 +690,10 @@ static int serverinfointercept(ENetHost *host, ENetEvent *event)
     {
         return 0;
     }
+    if(!ratelimit(host->receivedAddress.host, infolimit(host->receivedData+2, host->receivedDataLength-2)))
+    {
+        return 1;
+    }
     serverinfoaddress = host->receivedAddress;
     ucharbuf req(host->receivedData+2, host->receivedDataLength-2), p(host->receivedData+2, sizeof(host->packetData[0])-2);
     p.len += host->receivedDataLength-2;
@@ -771,13 +742,10 @@ void updatetime()
     }
 }
 
-void serverslice(uint timeout)   // main server update, called from below in dedicated server
+//advances the clocks to millis and runs the game logic for one tick
+void updateserver(int millis)
 {
-    static int laststatus = 0;
     static int lastcheckscore = -1;
-
-    // below is network only
-    int millis = static_cast<int>(enet_time_get());
     elapsedtime = millis - totalmillis;
     static int timeerr = 0;
     int scaledtime = server::scaletime(elapsedtime) + timeerr;
@@ -790,14 +758,31 @@ void serverslice(uint timeout)   // main server update, called from below in ded
     lastmillis += curtime;
     totalmillis = millis;
     updatetime();
+    uint phase = metricsmicros();
     server::serverupdate(); //see game/server.cpp for meat of server update routine
+    metricsphase(TickPhase_Update, phase);
     if(totalsecs-lastcheckscore > 0) //check scores 1/sec
     {
+        phase = metricsmicros();
         lastcheckscore = totalsecs;
         updatescores(); //see game/mapcontrol.cpp for updating player scores
         sendscore(); //sends tallies of scores out to players
+        metricsphase(TickPhase_Scores, phase);
     }
+}
 
+void serverslice(uint timeout)   // main server update, called from below in dedicated server
+{
+    static int laststatus = 0;
+    unsigned long long slicestart = tracing ? tracemicros() : 0;
+    metricstickstart();
+
+    int millis = static_cast<int>(enet_time_get());
+    capturetick(millis);
+    updateserver(millis);
+
+    // below is network only
+    uint phase = metricsmicros();
     flushmasteroutput();
     checkserversockets();
 
@@ -808,21 +793,40 @@ void serverslice(uint timeout)   // main server update, called from below in ded
 
     if(totalmillis-laststatus>60*1000)   // display bandwidth stats, useful for server ops
     {
+        //enet's totals are left running for the metrics, so report the change since last time
+        static uint lastsent = 0,
+                    lastreceived = 0;
+        uint sent = serverhost->totalSentData - lastsent,
+             received = serverhost->totalReceivedData - lastreceived;
         laststatus = totalmillis;
-        if(nonlocalclients || serverhost->totalSentData || serverhost->totalReceivedData)
+        lastsent = serverhost->totalSentData;
+        lastreceived = serverhost->totalReceivedData;
+        if(nonlocalclients || sent || received)
         {
-            printf("status: %d remote clients, %.1f send, %.1f rec (K/sec)\n", nonlocalclients, serverhost->totalSentData/60.0f/1024, serverhost->totalReceivedData/60.0f/1024);
+            logoutf(Log_Server, LogLevel_Info, "status: %d remote clients, %.1f send, %.1f rec (K/sec)", nonlocalclients, sent/60.0f/1024, received/60.0f/1024);
         }
-        serverhost->totalSentData = serverhost->totalReceivedData = 0;
+        ratelimitstatus();
     }
+    metricsphase(TickPhase_Sockets, phase);
 
+    phase = metricsmicros();
     ENetEvent event;
     bool serviced = false;
     while(!serviced)
     {
         if(enet_host_check_events(serverhost, &event) <= 0)
         {
-            if(enet_host_service(serverhost, &event, timeout) <= 0)
+            int serviceresult;
+            {
+                TRACE_SPAN("enet_host_service");
+                uint wait = metricsmicros();
+                serviceresult = enet_host_service(serverhost, &event, timeout);
+                if(serviceresult <= 0)
+                {
+                    metricsphase(TickPhase_Idle, wait);
+                }
+            }
+            if(serviceresult <= 0)
             {
                 break;
             }
@@ -832,12 +836,18 @@ void serverslice(uint timeout)   // main server update, called from below in ded
         {
             case ENET_EVENT_TYPE_CONNECT:
             {
+                if(!ratelimit(event.peer->address.host, RateLimit_Connect))
+                {
+                    enet_peer_disconnect_now(event.peer, Discon_Kick);
+                    break;
+                }
                 client &c = addclient(ServerClient_Remote);
                 c.peer = event.peer;
                 c.peer->data = &c;
                 string hn;
                 copystring(c.hostname, (enet_address_get_host_ip(&c.peer->address, hn, sizeof(hn))==0) ? hn : "unknown");
-                printf("client connected (%s)\n", c.hostname);
+                logoutf(Log_Net, LogLevel_Info, "client connected (%s)", c.hostname);
+                captureconnect(c.num, c.peer->address.host);
                 int reason = server::clientconnect(c.num, c.peer->address.host);
                 if(reason)
                 {
@@ -850,6 +860,7 @@ void serverslice(uint timeout)   // main server update, called from below in ded
                 client *c = static_cast<client *>(event.peer->data);
                 if(c)
                 {
+                    capturepacket(c->num, event.channelID, event.packet);
                     process(event.packet, c->num, event.channelID);
                 }
                 if(event.packet->referenceCount==0)
@@ -865,7 +876,8 @@ void serverslice(uint timeout)   // main server update, called from below in ded
                 {
                     break;
                 }
-                printf("disconnected client (%s)\n", c->hostname);
+                logoutf(Log_Net, LogLevel_Info, "disconnected client (%s)", c->hostname);
+                capturedisconnect(c->num);
                 server::clientdisconnect(c->num);
                 delclient(c);
                 break;
@@ -876,10 +888,66 @@ void serverslice(uint timeout)   // main server update, called from below in ded
             }
         }
     }
+    metricsphase(TickPhase_Network, phase);
+    phase = metricsmicros();
     if(server::sendpackets())
     {
         enet_host_flush(serverhost);
     }
+    metricsphase(TickPhase_Flush, phase);
+    updatemetrics(serverhost);
+    uint busy = metricstickend(nonlocalclients);
+    if(slicestart)
+    {
+        tracespanend("serverslice", slicestart);
+        checkslowtick(busy);
+    }
+}
+
+//installs where packets for virtual clients go; utils/tickbench.cpp and utils/replaycapture.cpp
+//use these to run the game logic against simulated or captured clients without a network
+void setvirtualtransport(void (*send)(int cn, int chan, ENetPacket *packet))
+{
+    virtualsend = send;
+}
+
+//returns the new client's number, or -1 if the game refused it; without an
+//address the client gets one of 10.0.0.1 onwards, one per client number
+int connectvirtualclient(uint ip)
+{
+    client &c = addclient(ServerClient_Virtual);
+    c.peer = nullptr;
+    c.ip = ip ? ip : ENET_HOST_TO_NET_32(0x0A000001 + c.num);
+    copystring(c.hostname, "virtual");
+    int reason = server::clientconnect(c.num, getclientip(c.num));
+    if(reason)
+    {
+        disconnect_client(c.num, reason);
+        return -1;
+    }
+    return c.num;
+}
+
+//hands a packet from a virtual client to the game as if enet had received it
+void receivevirtual(int cn, int chan, ENetPacket *packet)
+{
+    if(clients.size() > cn && clients[cn]->type==ServerClient_Virtual)
+    {
+        process(packet, cn, chan);
+    }
+    if(packet->referenceCount==0)
+    {
+        enet_packet_destroy(packet);
+    }
+}
+
+void disconnectvirtualclient(int cn)
+{
+    if(clients.size() > cn && clients[cn]->type==ServerClient_Virtual)
+    {
+        server::clientdisconnect(cn);
+        delclient(clients[cn]);
+    }
 }
 
 void flushserver(bool force)
@@ -892,7 +960,8 @@ void flushserver(bool force)
 
 void rundedicatedserver()
 {
-    printf("dedicated server started, waiting for clients...\n");
+    logoutf(Log_Server, LogLevel_Info, "dedicated server started, waiting for clients...");
+    settracethread("game");
     for(;;)
     {
         serverslice(5);
@@ -912,7 +981,7 @@ bool setuplistenserver()
     {
         if(enet_address_set_host(&address, serverip)<0)
         {
-            printf("WARNING: server ip not resolved\n");
+            logoutf(Log_Server, LogLevel_Warn, "server ip not resolved");
         }
         else
         {
@@ -935,7 +1004,7 @@ bool setuplistenserver()
     }
     if(lansock == ENET_SOCKET_NULL)
     {
-        printf("WARNING: could not create LAN server info socket\n");
+        logoutf(Log_Server, LogLevel_Warn, "could not create LAN server info socket");
     }
     else
     {
@@ -946,6 +1015,7 @@ bool setuplistenserver()
 
 void initserver(bool listen)
 {
+    initlog();
     exec("../../config/server-init.cfg");
     if(listen)
     {
@@ -958,16 +1028,3 @@ void initserver(bool listen)
         rundedicatedserver(); // never returns
     }
 }
-
-int main(int argc, char **argv)
-{
-    if(enet_initialize()<0)
-    {
-        fatal("Unable to initialise network module");
-    }
-    atexit(enet_deinitialize);
-    enet_time_set(0);
-
-    initserver(true);
-    return EXIT_SUCCESS;
-}
@@ -0,0 +1,247 @@
+// statslog.cpp: append-only binary log of per-player statistics
+//
+// records are built on the game thread at round end and on disconnect and
+// pushed onto a lock-free queue; a writer thread drains the queue, appends the
+// records to statsfile and appends one index entry per batch, so the tick never
+// waits on disk. if the queue is full the record is dropped and counted
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#ifndef WIN32
+    #include <unistd.h>
+#endif
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+#include "igame.h"
+
+#include "game.h"
+#include "cserver.h"
+#include "ringbuffer.h"
+#include "statslog.h"
+#include "logger.h"
+
+namespace server
+{
+    //file that player statistics are appended to; empty disables the log
+    SVAR(statsfile, "");
+
+    constexpr uint STATSQUEUESIZE = 4096,
+                   STATSBATCHSIZE = 512;
+
+    static spscring<statsrecord, STATSQUEUESIZE> statsqueue;
+    static std::thread statswriter;
+    static std::atomic<bool> statsrunning(false);
+    static uint statsdropped = 0,
+                roundstart = 0;
+    static string statslogname = "";
+
+    static bool writebatch(stream *log, stream *index, uint &numrecords, const statsrecord *batch, uint count)
+    {
+        if(log->write(batch, count*sizeof(statsrecord)) != count*sizeof(statsrecord))
+        {
+            return false;
+        }
+        log->flush();
+        statsindex idx;
+        idx.first = numrecords;
+        idx.count = count;
+        idx.mintime = idx.maxtime = batch[0].time;
+        for(uint i = 1; i < count; ++i)
+        {
+            idx.mintime = std::min(idx.mintime, batch[i].time);
+            idx.maxtime = std::max(idx.maxtime, batch[i].time);
+        }
+        index->write(&idx, sizeof(idx));
+        index->flush();
+        numrecords += count;
+        return true;
+    }
+
+    static void statswriterloop(stream *log, stream *index, uint numrecords)
+    {
+        statsrecord batch[STATSBATCHSIZE];
+        for(;;)
+        {
+            uint count = 0;
+            while(count < STATSBATCHSIZE && statsqueue.pop(batch[count]))
+            {
+                count++;
+            }
+            if(count)
+            {
+                if(!writebatch(log, index, numrecords, batch, count))
+                {
+                    logoutf(Log_Game, LogLevel_Warn, "could not write to stats log");
+                }
+                continue;
+            }
+            if(!statsrunning.load(std::memory_order_acquire))
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        delete log;
+        delete index;
+    }
+
+    static void stopstatslog()
+    {
+        if(!statsrunning.load())
+        {
+            return;
+        }
+        statsrunning.store(false, std::memory_order_release);
+        statswriter.join();
+    }
+
+    //opens a file of fixed-size entries to append to, creating it if need be
+    static stream *openentries(const char *name)
+    {
+        stream *f = openfile(name, "r+b");
+        return f ? f : openfile(name, "w+b");
+    }
+
+    //cuts an entry torn by a crash off the end of a file and seeks to where the
+    //next one goes; returns the number of whole entries after the first skip bytes
+    static uint seekentries(stream *f, const char *name, stream::offset skip, stream::offset len, size_t entrysize)
+    {
+        uint count = (len - skip) / entrysize;
+        stream::offset end = skip + static_cast<stream::offset>(count)*entrysize;
+        if(end < len)
+        {
+            logoutf(Log_Game, LogLevel_Warn, "cutting %d torn bytes off %s", static_cast<int>(len - end), name);
+#ifndef WIN32
+            //elsewhere the next write overwrites them instead
+            if(truncate(findfile(name, "r+b"), end) < 0)
+            {
+                logoutf(Log_Game, LogLevel_Warn, "could not truncate %s", name);
+            }
+#endif
+        }
+        f->seek(end, SEEK_SET);
+        return count;
+    }
+
+    static bool startstatslog()
+    {
+        if(statsrunning.load())
+        {
+            return true;
+        }
+        if(!statsfile[0])
+        {
+            return false;
+        }
+        copystring(statslogname, statsfile);
+        stream *log = openentries(statslogname);
+        if(!log)
+        {
+            logoutf(Log_Game, LogLevel_Warn, "could not open stats log %s", statslogname);
+            statsfile[0] = '\0';
+            return false;
+        }
+        stream::offset len = log->size();
+        statsheader hdr;
+        if(len <= 0)
+        {
+            memcpy(hdr.magic, "ISTS", 4);
+            hdr.version = STATS_VERSION;
+            hdr.recordsize = sizeof(statsrecord);
+            hdr.reserved = 0;
+            log->write(&hdr, sizeof(hdr));
+            len = sizeof(hdr);
+        }
+        else if(log->read(&hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, "ISTS", 4) ||
+                hdr.version != STATS_VERSION || hdr.recordsize != static_cast<int>(sizeof(statsrecord)))
+        {
+            logoutf(Log_Game, LogLevel_Warn, "%s is not a version %d stats log, not appending to it", statslogname, STATS_VERSION);
+            delete log;
+            statsfile[0] = '\0';
+            return false;
+        }
+        DEF_FORMAT_STRING(indexname, "%s.idx", statslogname);
+        stream *index = openentries(indexname);
+        if(!index)
+        {
+            logoutf(Log_Game, LogLevel_Warn, "could not open stats index %s", indexname);
+            delete log;
+            statsfile[0] = '\0';
+            return false;
+        }
+        uint numrecords = seekentries(log, statslogname, sizeof(statsheader), len, sizeof(statsrecord));
+        seekentries(index, indexname, 0, std::max(index->size(), stream::offset(0)), sizeof(statsindex));
+        statsrunning.store(true);
+        statswriter = std::thread(statswriterloop, log, index, numrecords);
+        atexit(stopstatslog);
+        return true;
+    }
+
+    static void queuestats(clientinfo *ci, int kind, int timeplayed)
+    {
+        if(ci->state.aitype != AI_None || !startstatslog())
+        {
+            return;
+        }
+        statsrecord r;
+        memset(&r, 0, sizeof(r));
+        r.time = static_cast<uint>(time(nullptr));
+        r.round = roundstart;
+        r.ip = getclientip(ci->clientnum);
+        r.kind = kind;
+        r.team = ci->team;
+        r.mode = gamemode;
+        copystring(r.name, ci->name, sizeof(r.name));
+        copystring(r.map, smapname, sizeof(r.map));
+        const servstate &gs = ci->state;
+        r.frags = gs.frags;
+        r.score = gs.score;
+        r.deaths = gs.deaths;
+        r.teamkills = gs.teamkills;
+        r.shotdamage = gs.shotdamage;
+        r.damage = gs.damage;
+        r.timeplayed = timeplayed;
+        r.effectiveness = gs.effectiveness;
+        if(!statsqueue.push(r) && !(statsdropped++ & 0xFF))
+        {
+            logoutf(Log_Game, LogLevel_Warn, "stats queue full, %u records dropped", statsdropped);
+        }
+    }
+
+    //called before a map change resets player state
+    void logroundstats()
+    {
+        for(int i = 0; i < clients.size(); i++)
+        {
+            clientinfo *ci = clients[i];
+            queuestats(ci, StatsRecord_RoundEnd, ci->state.timeplayed + lastmillis - ci->state.lasttimeplayed);
+        }
+        roundstart = static_cast<uint>(time(nullptr));
+    }
+
+    //called once timeplayed has been brought up to date
+    void logdisconnectstats(clientinfo *ci)
+    {
+        queuestats(ci, StatsRecord_Disconnect, ci->state.timeplayed);
+    }
+}
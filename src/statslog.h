@@ -0,0 +1,53 @@
+#ifndef STATSLOG_H_
+#define STATSLOG_H_
+
+// on-disk layout of the player statistics log, shared with utils/statsreader
+// the log is a statsheader followed by fixed-size statsrecords in host byte order;
+// the index file (log name + ".idx") holds one statsindex per batch written
+
+constexpr int STATS_VERSION = 1,
+              STATS_NAMELEN = 16,   // MAXNAMELEN+1
+              STATS_MAPLEN  = 32;
+
+enum
+{
+    StatsRecord_RoundEnd = 0,       // player was connected when the map changed
+    StatsRecord_Disconnect,         // player left mid-round; superseded by any later record of the same round
+    StatsRecord_NumKinds
+};
+
+struct statsheader
+{
+    char magic[4];                  // "ISTS"
+    int version, recordsize, reserved;
+};
+
+struct statsrecord
+{
+    uint time,                      // unix time the record was made
+         round,                     // unix time the round started, identifies the round
+         ip;
+    uchar kind, team;
+    short mode;
+    char name[STATS_NAMELEN],
+         map[STATS_MAPLEN];
+    int frags, score, deaths, teamkills, shotdamage, damage, timeplayed;
+    float effectiveness;
+};
+static_assert(sizeof(statsrecord) == 96, "statsrecord layout changed; bump STATS_VERSION");
+
+struct statsindex
+{
+    uint first, count,              // record numbers covered by the batch
+         mintime, maxtime;
+};
+
+namespace server
+{
+    struct clientinfo;
+
+    extern void logroundstats();
+    extern void logdisconnectstats(clientinfo *ci);
+}
+
+#endif
@@ -144,6 +144,58 @@ bool createdir(const char *path)
 #endif
 }
 
+//lists files in dirname, with the extension stripped if ext is given
+bool listdir(const char *dirname, const char *ext, std::vector<char *> &files)
+{
+    size_t extsize = ext ? strlen(ext)+1 : 0;
+#ifdef WIN32
+    DEF_FORMAT_STRING(pathname, "%s\\*.%s", dirname, ext ? ext : "*");
+    WIN32_FIND_DATA FindFileData;
+    HANDLE Find = FindFirstFile(pathname, &FindFileData);
+    if(Find != INVALID_HANDLE_VALUE)
+    {
+        do {
+            if(!ext) files.push_back(newstring(FindFileData.cFileName));
+            else
+            {
+                size_t namelen = strlen(FindFileData.cFileName);
+                if(namelen > extsize)
+                {
+                    namelen -= extsize;
+                    if(FindFileData.cFileName[namelen] == '.' && strncmp(FindFileData.cFileName+namelen+1, ext, extsize-1)==0)
+                        files.push_back(newstring(FindFileData.cFileName, namelen));
+                }
+            }
+        } while(FindNextFile(Find, &FindFileData));
+        FindClose(Find);
+        return true;
+    }
+#else
+    DIR *d = opendir(dirname);
+    if(d)
+    {
+        struct dirent *de;
+        while((de = readdir(d)) != nullptr)
+        {
+            if(!ext) files.push_back(newstring(de->d_name));
+            else
+            {
+                size_t namelen = strlen(de->d_name);
+                if(namelen > extsize)
+                {
+                    namelen -= extsize;
+                    if(de->d_name[namelen] == '.' && strncmp(de->d_name+namelen+1, ext, extsize-1)==0)
+                        files.push_back(newstring(de->d_name, namelen));
+                }
+            }
+        }
+        closedir(d);
+        return true;
+    }
+#endif
+    else return false;
+}
+
 size_t fixpackagedir(char *dir)
 {
     path(dir);
@@ -336,6 +388,304 @@ stream *opentempfile(const char *name, const char *mode)
     return file;
 }
 
+struct gzstream : stream
+{
+    enum
+    {
+        MAGIC1   = 0x1F,
+        MAGIC2   = 0x8B,
+        BUFSIZE  = 16384,
+        OS_UNIX  = 0x03
+    };
+
+    enum
+    {
+        F_ASCII    = 0x01,
+        F_CRC      = 0x02,
+        F_EXTRA    = 0x04,
+        F_NAME     = 0x08,
+        F_COMMENT  = 0x10,
+        F_RESERVED = 0xE0
+    };
+
+    stream *file;
+    z_stream zfile;
+    uchar *buf;
+    bool reading, writing, autoclose;
+    uint crc;
+    size_t headersize;
+
+    gzstream() : file(nullptr), buf(nullptr), reading(false), writing(false), autoclose(false), crc(0), headersize(0)
+    {
+        zfile.zalloc = nullptr;
+        zfile.zfree = nullptr;
+        zfile.opaque = nullptr;
+        zfile.next_in = zfile.next_out = nullptr;
+        zfile.avail_in = zfile.avail_out = 0;
+    }
+
+    ~gzstream()
+    {
+        close();
+    }
+
+    void writeheader()
+    {
+        uchar header[] = { MAGIC1, MAGIC2, Z_DEFLATED, 0, 0, 0, 0, 0, 0, OS_UNIX };
+        file->write(header, sizeof(header));
+    }
+
+    void readbuf(size_t size = BUFSIZE)
+    {
+        if(!zfile.avail_in) zfile.next_in = (Bytef *)buf;
+        size = std::min(size, size_t(&buf[BUFSIZE] - &zfile.next_in[zfile.avail_in]));
+        size_t n = file->read(zfile.next_in + zfile.avail_in, size);
+        if(n > 0) zfile.avail_in += n;
+    }
+
+    uchar readbyte(size_t size = BUFSIZE)
+    {
+        if(!zfile.avail_in) readbuf(size);
+        if(!zfile.avail_in) return 0;
+        zfile.avail_in--;
+        return *(uchar *)zfile.next_in++;
+    }
+
+    void skipbytes(size_t n)
+    {
+        while(n > 0 && zfile.avail_in > 0)
+        {
+            size_t skipped = std::min(n, size_t(zfile.avail_in));
+            zfile.avail_in -= skipped;
+            zfile.next_in += skipped;
+            n -= skipped;
+        }
+        if(n <= 0) return;
+        file->seek(n, SEEK_CUR);
+    }
+
+    bool checkheader()
+    {
+        readbuf(10);
+        if(readbyte() != MAGIC1 || readbyte() != MAGIC2 || readbyte() != Z_DEFLATED) return false;
+        uchar flags = readbyte();
+        if(flags & F_RESERVED) return false;
+        skipbytes(6);
+        if(flags & F_EXTRA)
+        {
+            size_t len = readbyte(512);
+            len |= size_t(readbyte(512))<<8;
+            skipbytes(len);
+        }
+        if(flags & F_NAME) while(readbyte(512));
+        if(flags & F_COMMENT) while(readbyte(512));
+        if(flags & F_CRC) skipbytes(2);
+        headersize = size_t(file->tell() - zfile.avail_in);
+        return zfile.avail_in > 0 || !file->end();
+    }
+
+    bool open(stream *f, const char *mode, bool needclose, int level)
+    {
+        if(file) return false;
+        for(; *mode; mode++)
+        {
+            if(*mode=='r') { reading = true; break; }
+            else if(*mode=='w') { writing = true; break; }
+        }
+        if(reading)
+        {
+            if(inflateInit2(&zfile, -MAX_WBITS) != Z_OK) reading = false;
+        }
+        else if(writing && deflateInit2(&zfile, level, Z_DEFLATED, -MAX_WBITS, std::min(MAX_MEM_LEVEL, 8), Z_DEFAULT_STRATEGY) != Z_OK) writing = false;
+        if(!reading && !writing) return false;
+
+        file = f;
+        crc = crc32(0, nullptr, 0);
+        buf = new uchar[BUFSIZE];
+
+        if(reading)
+        {
+            if(!checkheader()) { stopreading(); return false; }
+        }
+        else if(writing) writeheader();
+
+        autoclose = needclose;
+        return true;
+    }
+
+    uint getcrc() { return crc; }
+
+    void stopreading()
+    {
+        if(!reading) return;
+        inflateEnd(&zfile);
+        reading = false;
+    }
+
+    void finishwriting()
+    {
+        if(!writing) return;
+        for(;;)
+        {
+            int err = zfile.avail_out > 0 ? deflate(&zfile, Z_FINISH) : Z_OK;
+            if(err != Z_OK && err != Z_STREAM_END) break;
+            flushbuf();
+            if(err == Z_STREAM_END) break;
+        }
+        uchar trailer[8] =
+        {
+            uchar(crc&0xFF), uchar((crc>>8)&0xFF), uchar((crc>>16)&0xFF), uchar((crc>>24)&0xFF),
+            uchar(zfile.total_in&0xFF), uchar((zfile.total_in>>8)&0xFF), uchar((zfile.total_in>>16)&0xFF), uchar((zfile.total_in>>24)&0xFF)
+        };
+        file->write(trailer, sizeof(trailer));
+    }
+
+    void stopwriting()
+    {
+        if(!writing) return;
+        deflateEnd(&zfile);
+        writing = false;
+    }
+
+    void close()
+    {
+        stopreading();
+        if(writing) finishwriting();
+        stopwriting();
+        DELETEA(buf);
+        if(autoclose) DELETEP(file);
+    }
+
+    bool end() { return !reading && !writing; }
+    offset tell() { return reading ? zfile.total_out : (writing ? zfile.total_in : offset(-1)); }
+    offset rawtell() { return file ? file->tell() : offset(-1); }
+
+    // the gzip trailer only gives the size of a file holding nothing but one
+    // member, and demos append a seek index after it, so the size is unknown
+    offset size() { return -1; }
+
+    offset rawsize() { return file ? file->size() : offset(-1); }
+
+    bool seekflushed(offset rawpos, offset pos)
+    {
+        if(!reading || !file->seek(rawpos, SEEK_SET)) return false;
+        zfile.avail_in = 0;
+        zfile.next_in = nullptr;
+        inflateReset(&zfile);
+        zfile.total_out = pos;
+        crc = crc32(0, nullptr, 0);
+        return true;
+    }
+
+    bool seek(offset pos, int whence)
+    {
+        if(writing || !reading) return false;
+
+        if(whence == SEEK_END)
+        {
+            uchar skip[512];
+            while(read(skip, sizeof(skip)) == sizeof(skip));
+            return !pos;
+        }
+        else if(whence == SEEK_CUR) pos += zfile.total_out;
+
+        if(pos >= (offset)zfile.total_out) pos -= zfile.total_out;
+        else if(pos < 0 || !file->seek(headersize, SEEK_SET)) return false;
+        else
+        {
+            if(zfile.next_in && zfile.total_in <= uint(zfile.next_in - buf))
+            {
+                zfile.avail_in += zfile.total_in;
+                zfile.next_in -= zfile.total_in;
+            }
+            else
+            {
+                zfile.avail_in = 0;
+                zfile.next_in = nullptr;
+            }
+            inflateReset(&zfile);
+            crc = crc32(0, nullptr, 0);
+        }
+
+        uchar skip[512];
+        while(pos > 0)
+        {
+            size_t skipped = (size_t)std::min(pos, (offset)sizeof(skip));
+            if(read(skip, skipped) != skipped) { stopreading(); return false; }
+            pos -= skipped;
+        }
+
+        return true;
+    }
+
+    size_t read(void *buf, size_t len)
+    {
+        if(!reading || !buf || !len) return 0;
+        zfile.next_out = (Bytef *)buf;
+        zfile.avail_out = len;
+        while(zfile.avail_out > 0)
+        {
+            if(!zfile.avail_in)
+            {
+                readbuf(BUFSIZE);
+                if(!zfile.avail_in) { stopreading(); break; }
+            }
+            int err = inflate(&zfile, Z_NO_FLUSH);
+            if(err == Z_STREAM_END) { crc = crc32(crc, (Bytef *)buf, len - zfile.avail_out); stopreading(); return len - zfile.avail_out; }
+            else if(err != Z_OK) { stopreading(); break; }
+        }
+        crc = crc32(crc, (Bytef *)buf, len - zfile.avail_out);
+        return len - zfile.avail_out;
+    }
+
+    bool flushbuf(bool full = false)
+    {
+        if(full)
+        {
+            // a full flush also resets the compressor, so that reading can restart at the following output
+            do
+            {
+                if(!zfile.avail_out && !flushbuf()) return false;
+                deflate(&zfile, Z_FULL_FLUSH);
+            } while(!zfile.avail_out);
+        }
+        if(zfile.next_out && zfile.avail_out < BUFSIZE)
+        {
+            if(file->write(buf, BUFSIZE - zfile.avail_out) != BUFSIZE - zfile.avail_out)
+                return false;
+        }
+        zfile.next_out = buf;
+        zfile.avail_out = BUFSIZE;
+        return true;
+    }
+
+    bool flush() { return flushbuf(true); }
+
+    size_t write(const void *buf, size_t len)
+    {
+        if(!writing || !buf || !len) return 0;
+        zfile.next_in = (Bytef *)buf;
+        zfile.avail_in = len;
+        while(zfile.avail_in > 0)
+        {
+            if(!zfile.avail_out && !flushbuf()) { stopwriting(); break; }
+            int err = deflate(&zfile, Z_NO_FLUSH);
+            if(err != Z_OK) { stopwriting(); break; }
+        }
+        crc = crc32(crc, (Bytef *)buf, len);
+        return len - zfile.avail_in;
+    }
+};
+
+stream *opengzfile(const char *filename, const char *mode, stream *file, int level)
+{
+    stream *source = file ? file : openfile(filename, mode);
+    if(!source) return nullptr;
+    gzstream *gz = new gzstream;
+    if(!gz->open(source, mode, !file, level)) { if(!file) delete source; delete gz; return nullptr; }
+    return gz;
+}
+
 char *loadfile(const char *fn, size_t *size)
 {
     stream *f = openfile(fn, "rb");
@@ -7,6 +7,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <algorithm>
 
 #include <enet/enet.h>
@@ -126,6 +127,65 @@ void sendstring(const char *t, ucharbuf &p) { sendstring_(t, p); }
 void sendstring(const char *t, packetbuf &p) { sendstring_(t, p); }
 void sendstring(const char *t, std::vector<uchar> &p) { sendstring_(t, p); }
 
+// encodes the arguments of a sendf format: 'x' names a client to exclude, 'v' a
+// count and an int array, 'i' and 'f' one to nine ints or floats, 's' a string
+// and 'm' a length and raw bytes; returns the excluded client or -1
+int putformat(packetbuf &p, const char *format, va_list args)
+{
+    int exclude = -1;
+    while(*format)
+    {
+        switch(*format++)
+        {
+            case 'x':
+            {
+                exclude = va_arg(args, int);
+                break;
+            }
+            case 'v':
+            {
+                int n = va_arg(args, int);
+                int *v = va_arg(args, int *);
+                for(int i = 0; i < n; ++i)
+                {
+                    putint(p, v[i]);
+                }
+                break;
+            }
+            case 'i':
+            {
+                int n = isdigit(*format) ? *format++-'0' : 1;
+                for(int i = 0; i < n; ++i)
+                {
+                    putint(p, va_arg(args, int));
+                }
+                break;
+            }
+            case 'f':
+            {
+                int n = isdigit(*format) ? *format++-'0' : 1;
+                for(int i = 0; i < n; ++i)
+                {
+                    putfloat(p, static_cast<float>(va_arg(args, double)));
+                }
+                break;
+            }
+            case 's':
+            {
+                sendstring(va_arg(args, const char *), p);
+                break;
+            }
+            case 'm':
+            {
+                int n = va_arg(args, int);
+                p.put(va_arg(args, uchar *), n);
+                break;
+            }
+        }
+    }
+    return exclude;
+}
+
 void getstring(char *text, ucharbuf &p, size_t len)
 {
     char *t = text;
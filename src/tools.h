@@ -323,6 +323,8 @@ struct stream
     virtual offset tell() { return -1; }
     virtual offset rawtell() { return tell(); }
     virtual bool seek(offset pos, int whence = SEEK_SET) { return false; }
+    // seeks to pos, a point at which the stream was flushed when written, found at rawpos in the underlying file
+    virtual bool seekflushed(offset rawpos, offset pos) { return seek(pos); }
     virtual offset size();
     virtual offset rawsize() { return size(); }
     virtual size_t read(void *buf, size_t len) { return 0; }
@@ -384,12 +386,14 @@ extern char *path(char *s);
 extern const char *parentdir(const char *directory);
 extern bool fileexists(const char *path, const char *mode);
 extern bool createdir(const char *path);
+extern bool listdir(const char *dirname, const char *ext, std::vector<char *> &files);
 extern size_t fixpackagedir(char *dir);
 extern const char *sethomedir(const char *dir);
 extern const char *findfile(const char *filename, const char *mode);
 extern stream *openrawfile(const char *filename, const char *mode);
 extern stream *openfile(const char *filename, const char *mode);
 extern stream *opentempfile(const char *filename, const char *mode);
+extern stream *opengzfile(const char *filename, const char *mode, stream *file = nullptr, int level = 9);
 extern char *loadfile(const char *fn, size_t *size);
 
 extern void putint(ucharbuf &p, int n);
@@ -404,6 +408,7 @@ extern void sendstring(const char *t, ucharbuf &p);
 extern void sendstring(const char *t, packetbuf &p);
 extern void sendstring(const char *t, std::vector<uchar> &p);
 extern void getstring(char *t, ucharbuf &p, size_t len);
+extern int putformat(packetbuf &p, const char *format, va_list args);
 
 template<size_t N>
 inline void getstring(char (&t)[N], ucharbuf &p) { getstring(t, p, N); }
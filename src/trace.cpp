@@ -0,0 +1,298 @@
+// trace.cpp: span tracing of the server loop
+//
+// each thread that records a span gets a ring of its own, so recording is a
+// plain store and a release of the ring head with no locks or shared writes.
+// a dump copies every ring on the game thread, keeping only the events that
+// can not have been overwritten while it was copying them, and a writer thread
+// writes them as chrome trace "complete" events
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+
+#include "trace.h"
+#include "logger.h"
+
+VAR(tracing, 0, 0, 1);
+SVAR(tracefile, "trace.json");
+VAR(traceslowtick, 0, 0, 10000);    //dump the rings when a tick is busy for longer than this many ms, as slowtick counts it, 0 disables
+
+constexpr uint TRACERINGSIZE = 1<<15;   //spans kept per thread, a power of two
+constexpr int MAXTRACETHREADS = 16,
+              TRACESLOWINTERVAL = 10000; //ms between automatic dumps
+
+struct traceevent
+{
+    const char *name;
+    unsigned long long start;
+    uint duration;
+};
+
+struct tracering
+{
+    traceevent events[TRACERINGSIZE];
+    std::atomic<uint> head;         //spans ever recorded, only the owning thread stores it
+    std::atomic<bool> inuse;
+    std::atomic<const char *> name;
+
+    tracering() : head(0), inuse(true), name(nullptr) {}
+};
+
+static std::atomic<tracering *> tracerings[MAXTRACETHREADS];
+
+//gives the ring back for reuse when its thread exits; its spans stay dumpable
+struct tracethread
+{
+    tracering *ring;
+    const char *name;
+
+    tracethread() : ring(nullptr), name(nullptr) {}
+    ~tracethread()
+    {
+        if(ring)
+        {
+            ring->inuse.store(false);
+        }
+    }
+};
+
+static thread_local tracethread curtracethread;
+
+static tracering *gettracering()
+{
+    tracethread &t = curtracethread;
+    if(t.ring)
+    {
+        return t.ring;
+    }
+    for(int i = 0; i < MAXTRACETHREADS; ++i)
+    {
+        tracering *ring = tracerings[i].load();
+        bool free = false;
+        if(ring)
+        {
+            free = ring->inuse.compare_exchange_strong(free, true);
+        }
+        else
+        {
+            ring = new tracering;
+            tracering *empty = nullptr;
+            if(!tracerings[i].compare_exchange_strong(empty, ring))
+            {
+                delete ring;
+                continue;
+            }
+            free = true;
+        }
+        if(free)
+        {
+            ring->name.store(t.name);
+            t.ring = ring;
+            return ring;
+        }
+    }
+    return nullptr;
+}
+
+unsigned long long tracemicros()
+{
+    return std::max(static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()), 1ULL);
+}
+
+void tracespanend(const char *name, unsigned long long start)
+{
+    tracering *ring = gettracering();
+    if(!ring)
+    {
+        return;
+    }
+    uint head = ring->head.load(std::memory_order_relaxed);
+    traceevent &e = ring->events[head&(TRACERINGSIZE-1)];
+    e.name = name;
+    e.start = start;
+    e.duration = static_cast<uint>(tracemicros() - start);
+    ring->head.store(head+1, std::memory_order_release);
+}
+
+//names the calling thread in dumps
+void settracethread(const char *name)
+{
+    curtracethread.name = name;
+    if(curtracethread.ring)
+    {
+        curtracethread.ring->name.store(name);
+    }
+}
+
+//the spans of one ring as copied for a dump
+struct tracethreaddump
+{
+    int tid;
+    const char *name;
+    std::vector<traceevent> events;
+};
+
+struct tracedumpjob
+{
+    string file;
+    std::vector<tracethreaddump> threads;
+};
+
+static std::mutex tracemutex;
+static std::condition_variable tracecond;
+static std::deque<tracedumpjob *> tracequeue;  //copied rings, game thread to writer
+static std::thread tracewriter;
+static bool tracewriting = false;
+
+//formats a dump as json on the writer thread
+static void writetrace(tracedumpjob *job)
+{
+    stream *f = openrawfile(path(job->file), "w");
+    if(!f)
+    {
+        logoutf(Log_Perf, LogLevel_Warn, "could not open %s for the trace", job->file);
+        return;
+    }
+    int numevents = 0;
+    f->printf("{\"traceEvents\":[\n");
+    for(const tracethreaddump &t : job->threads)
+    {
+        f->printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", numevents++ ? ",\n" : "", t.tid, t.name ? t.name : "thread");
+        for(const traceevent &e : t.events)
+        {
+            f->printf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%u}", e.name, t.tid, e.start, e.duration);
+            numevents++;
+        }
+    }
+    f->printf("\n]}\n");
+    delete f;
+    logoutf(Log_Perf, LogLevel_Info, "wrote %d trace events to %s", numevents, job->file);
+}
+
+static void tracewriterloop()
+{
+    std::unique_lock<std::mutex> lock(tracemutex);
+    for(;;)
+    {
+        if(tracequeue.empty())
+        {
+            if(!tracewriting)
+            {
+                break;
+            }
+            tracecond.wait(lock);
+            continue;
+        }
+        tracedumpjob *job = tracequeue.front();
+        tracequeue.pop_front();
+        lock.unlock();
+        writetrace(job);
+        delete job;
+        lock.lock();
+    }
+}
+
+//lets the writer finish every queued dump, then stops it
+static void stoptracewriter()
+{
+    if(!tracewriter.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(tracemutex);
+        tracewriting = false;
+    }
+    tracecond.notify_one();
+    tracewriter.join();
+}
+
+//copies every ring, keeping only the spans that can not have been overwritten
+//while copying, and queues them for the writer
+static void queuetrace(const char *filename)
+{
+    tracedumpjob *job = new tracedumpjob;
+    copystring(job->file, filename);
+    for(int i = 0; i < MAXTRACETHREADS; ++i)
+    {
+        tracering *ring = tracerings[i].load();
+        if(!ring)
+        {
+            continue;
+        }
+        job->threads.emplace_back();
+        tracethreaddump &t = job->threads.back();
+        t.tid = i;
+        t.name = ring->name.load();
+        uint end = ring->head.load(std::memory_order_acquire),
+             start = end > TRACERINGSIZE ? end - TRACERINGSIZE : 0;
+        t.events.reserve(end - start);
+        for(uint j = start; j < end; ++j)
+        {
+            t.events.push_back(ring->events[j&(TRACERINGSIZE-1)]);
+        }
+        //the owner may have lapped the oldest copied spans in the meantime, including
+        //the slot it is filling now
+        uint head = ring->head.load(std::memory_order_acquire),
+             oldest = head >= TRACERINGSIZE ? head - TRACERINGSIZE + 1 : 0,
+             skip = oldest > start ? std::min(oldest - start, static_cast<uint>(t.events.size())) : 0;
+        t.events.erase(t.events.begin(), t.events.begin() + skip);
+    }
+    if(!tracewriter.joinable())
+    {
+        tracewriting = true;
+        tracewriter = std::thread(tracewriterloop);
+        atexit(stoptracewriter);
+    }
+    {
+        std::lock_guard<std::mutex> lock(tracemutex);
+        tracequeue.push_back(job);
+    }
+    tracecond.notify_one();
+}
+
+//called at the end of each server tick with its busy time from metricstickend, as slowtick measures it
+void checkslowtick(uint busy)
+{
+    static int lastslowdump = 0;
+    if(!tracing || !traceslowtick || busy <= static_cast<uint>(traceslowtick)*1000)
+    {
+        return;
+    }
+    if(lastslowdump && totalmillis - lastslowdump < TRACESLOWINTERVAL)
+    {
+        return;
+    }
+    lastslowdump = totalmillis ? totalmillis : 1;
+    string filename;
+    formatstring(filename, "trace_slow_%d.json", totalmillis);
+    queuetrace(filename);
+}
+
+void tracedump(const char *filename)
+{
+    queuetrace(filename[0] ? filename : tracefile);
+}
+COMMAND(tracedump, "s");
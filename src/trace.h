@@ -0,0 +1,34 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// optional span tracing into per-thread rings, dumped as chrome trace json that
+// chrome://tracing or ui.perfetto.dev can show as a timeline
+
+extern int tracing;
+
+extern unsigned long long tracemicros();
+extern void tracespanend(const char *name, unsigned long long start);
+extern void settracethread(const char *name);
+extern void checkslowtick(uint busy);
+
+// records the enclosing scope as a span when tracing is on
+struct tracespan
+{
+    const char *name;
+    unsigned long long start;
+
+    tracespan(const char *name) : name(name), start(tracing ? tracemicros() : 0) {}
+    ~tracespan()
+    {
+        if(start)
+        {
+            tracespanend(name, start);
+        }
+    }
+};
+
+#define TRACE_SPANVAR(line) tracespan_##line
+#define TRACE_SPANLINE(name, line) tracespan TRACE_SPANVAR(line)(name)
+#define TRACE_SPAN(name) TRACE_SPANLINE(name, __LINE__)
+
+#endif
@@ -0,0 +1,456 @@
+// transfer.cpp: chunked, flow controlled file downloads
+//
+// rather than handing enet a whole demo or map as one reliable packet, files
+// are read and sent a chunk at a time. each transfer keeps at most a window of
+// unacknowledged bytes in flight, sized from the peer's round trip time and the
+// rate at which its chunks are being acknowledged, and all transfers draw on a
+// shared per-server byte budget so downloads can not crowd out game traffic
+
+#include "engine.h"
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+
+#ifndef WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+#endif
+
+#include <enet/enet.h>
+
+#include "tools.h"
+#include "geom.h"
+#include "command.h"
+
+#include "iengine.h"
+#include "igame.h"
+
+#include "game.h"
+#include "cserver.h"
+#include "transfer.h"
+
+namespace server
+{
+    //bytes of file data per chunk; kept below the mtu by default so chunks are never fragmented
+    VAR(transferchunk, 256, 1200, 65536);
+    //total upload rate shared by all downloads, in KB/s; 0 for no limit
+    VAR(transferrate, 0, 512, 1<<20);
+
+    constexpr int TRANSFER_MINWINDOW    = 4,        // in chunks
+                  TRANSFER_MAXWINDOW    = 1<<20,    // in bytes
+                  TRANSFER_SAMPLEMILLIS = 250;
+
+    struct transfer
+    {
+        int cn, type, id;               // cn is -1 once the transfer is cancelled
+        stream *file;
+        bool ownsfile;
+        transferbuffer *buf;            // sent instead of file when set
+        int len, sent,                  // in bytes of file data
+            inflight, window,           // in bytes of packet data
+            packets,                    // chunks still held by enet
+            rate,                       // acknowledged bytes per second
+            lastsample;
+        uint ackedbytes, sampleacked;   // packet bytes acknowledged
+
+        bool done() const { return cn < 0 || sent >= len; }
+
+        void close()
+        {
+            if(ownsfile)
+            {
+                DELETEP(file);
+            }
+            file = nullptr;
+        }
+
+        ~transfer()
+        {
+            close();
+            if(buf)
+            {
+                buf->release();
+            }
+        }
+    };
+
+    static std::vector<transfer *> transfers;
+    static int transferid = 0,
+               transferbudget = 0,
+               lastbudget = 0;
+    static uint nexttransfer = 0;
+
+    static void freechunk(ENetPacket *packet)
+    {
+        transfer *t = static_cast<transfer *>(packet->userData);
+        t->packets--;
+        t->inflight -= packet->dataLength;
+        t->ackedbytes += packet->dataLength;
+    }
+
+    transferbuffer::~transferbuffer()
+    {
+        if(!mapping)
+        {
+            delete[] data;
+        }
+#ifndef WIN32
+        else
+        {
+            munmap(mapping, mapsize);
+        }
+#endif
+    }
+
+    void transferbuffer::release()
+    {
+        if(--refs <= 0)
+        {
+            delete this;
+        }
+    }
+
+    transferbuffer *frametransfer(int type, int id, const uchar *data, int len)
+    {
+        if(len <= 0)
+        {
+            return nullptr;
+        }
+        transferbuffer *buf = new transferbuffer;
+        buf->len = len;
+        buf->chunklen = transferchunk;
+        int numchunks = (len + buf->chunklen - 1)/buf->chunklen;
+        size_t maxsize = len + static_cast<size_t>(numchunks)*5*5; //five ints of at most five bytes each per chunk
+        buf->data = new uchar[maxsize];
+        ucharbuf p(buf->data, maxsize);
+        for(int offset = 0; offset < len; offset += buf->chunklen)
+        {
+            buf->chunks.push_back(p.length());
+            putint(p, NetMsg_SendChunk);
+            putint(p, type);
+            putint(p, id);
+            putint(p, len);
+            putint(p, offset);
+            p.put(&data[offset], std::min(buf->chunklen, len - offset));
+        }
+        buf->chunks.push_back(p.length());
+        return buf;
+    }
+
+    bool savetransfer(const char *filename, const transferbuffer &buf)
+    {
+        stream *f = openrawfile(filename, "wb");
+        if(!f)
+        {
+            return false;
+        }
+        transferheader hdr;
+        memcpy(hdr.magic, "ITRF", 4);
+        hdr.version = TRANSFER_VERSION;
+        hdr.len = buf.len;
+        hdr.chunklen = buf.chunklen;
+        hdr.numchunks = static_cast<int>(buf.chunks.size()) - 1;
+        bool ok = f->write(&hdr, sizeof(hdr)) == sizeof(hdr) &&
+                  f->write(buf.chunks.data(), buf.chunks.size()*sizeof(uint)) == buf.chunks.size()*sizeof(uint) &&
+                  f->write(buf.data, buf.size()) == buf.size();
+        delete f;
+        if(!ok)
+        {
+            remove(filename);
+        }
+        return ok;
+    }
+
+    //maps a framed file where possible, so its pages are shared with the page cache rather than copied into each process
+    transferbuffer *loadtransfer(const char *filename)
+    {
+        stream *f = openrawfile(filename, "rb");
+        if(!f)
+        {
+            return nullptr;
+        }
+        transferheader hdr;
+        stream::offset filesize = f->size();
+        if(f->read(&hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, "ITRF", 4) || hdr.version != TRANSFER_VERSION ||
+           hdr.len <= 0 || hdr.chunklen <= 0 || hdr.numchunks != (hdr.len + hdr.chunklen - 1)/hdr.chunklen)
+        {
+            delete f;
+            return nullptr;
+        }
+        transferbuffer *buf = new transferbuffer;
+        buf->len = hdr.len;
+        buf->chunklen = hdr.chunklen;
+        buf->chunks.resize(hdr.numchunks + 1);
+        size_t offsetsize = buf->chunks.size()*sizeof(uint),
+               dataoffset = sizeof(hdr) + offsetsize;
+        bool valid = f->read(buf->chunks.data(), offsetsize) == offsetsize && filesize >= static_cast<stream::offset>(dataoffset + buf->size());
+        for(int i = 0; valid && i < hdr.numchunks; ++i)
+        {
+            valid = buf->chunks[i] < buf->chunks[i+1];
+        }
+        if(!valid)
+        {
+            delete f;
+            delete buf;
+            return nullptr;
+        }
+#ifndef WIN32
+        const char *found = findfile(filename, "rb");
+        int fd = found ? ::open(found, O_RDONLY) : -1;
+        if(fd >= 0)
+        {
+            void *mem = mmap(nullptr, dataoffset + buf->size(), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(mem != MAP_FAILED)
+            {
+                delete f;
+                buf->mapping = mem;
+                buf->mapsize = dataoffset + buf->size();
+                buf->data = static_cast<uchar *>(mem) + dataoffset;
+                return buf;
+            }
+        }
+#endif
+        buf->data = new uchar[buf->size()];
+        bool ok = f->read(buf->data, buf->size()) == buf->size();
+        delete f;
+        if(!ok)
+        {
+            delete buf;
+            return nullptr;
+        }
+        return buf;
+    }
+
+    static void canceltransfer(transfer *t)
+    {
+        t->cn = -1;
+        t->close();
+    }
+
+    bool hastransfer(clientinfo *ci, int type)
+    {
+        for(transfer *t : transfers)
+        {
+            if(t->cn == ci->clientnum && t->type == type)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static transfer *newtransfer(clientinfo *ci, int type, int len)
+    {
+        transfer *t = new transfer;
+        t->cn = ci->clientnum;
+        t->type = type;
+        t->id = ++transferid;
+        t->file = nullptr;
+        t->ownsfile = false;
+        t->buf = nullptr;
+        t->len = len;
+        t->sent = t->inflight = t->packets = t->rate = 0;
+        t->window = TRANSFER_MINWINDOW*transferchunk;
+        t->lastsample = totalmillis;
+        t->sampleacked = 0;
+        t->ackedbytes = 0;
+        transfers.push_back(t);
+        return t;
+    }
+
+    bool sendtransfer(clientinfo *ci, int type, stream *file, bool ownsfile)
+    {
+        stream::offset len = file->size();
+        if(len <= 0 || len > INT_MAX)
+        {
+            if(ownsfile)
+            {
+                delete file;
+            }
+            return false;
+        }
+        transfer *t = newtransfer(ci, type, static_cast<int>(len));
+        t->file = file;
+        t->ownsfile = ownsfile;
+        return true;
+    }
+
+    bool sendtransfer(clientinfo *ci, int type, transferbuffer *buf)
+    {
+        transfer *t = newtransfer(ci, type, buf->len);
+        t->buf = buf;
+        buf->refs++;
+        return true;
+    }
+
+    void canceltransfers(clientinfo *ci)
+    {
+        for(transfer *t : transfers)
+        {
+            if(t->cn == ci->clientnum)
+            {
+                canceltransfer(t);
+            }
+        }
+    }
+
+    //window is twice the bandwidth-delay product, so it doubles each round trip while the window is the limit
+    static void updatewindow(transfer &t)
+    {
+        int elapsed = totalmillis - t.lastsample;
+        if(elapsed < TRANSFER_SAMPLEMILLIS)
+        {
+            return;
+        }
+        int sample = static_cast<int>((static_cast<long long>(t.ackedbytes - t.sampleacked)*1000)/elapsed);
+        t.rate = t.rate ? (t.rate*3 + sample)/4 : sample;
+        t.lastsample = totalmillis;
+        t.sampleacked = t.ackedbytes;
+
+        int rtt = 100,
+            rate = t.rate;
+        ENetPeer *peer = getclientpeer(t.cn);
+        if(peer)
+        {
+            rtt = std::max(static_cast<int>(peer->roundTripTime + peer->roundTripTimeVariance), 1);
+            if(peer->incomingBandwidth)
+            {
+                rate = std::min(rate, static_cast<int>(std::min(peer->incomingBandwidth, enet_uint32(INT_MAX))));
+            }
+        }
+        long long window = (2LL*rate*rtt)/1000;
+        t.window = static_cast<int>(clamp(window, static_cast<long long>(TRANSFER_MINWINDOW*transferchunk), static_cast<long long>(TRANSFER_MAXWINDOW)));
+    }
+
+    //chunks of a framed buffer go out as packets pointing into it
+    static int sendframedchunk(transfer &t)
+    {
+        transferbuffer &buf = *t.buf;
+        uint chunk = t.sent/buf.chunklen,
+             start = buf.chunks[chunk];
+        ENetPacket *packet = enet_packet_create(&buf.data[start], buf.chunks[chunk+1] - start, ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_NO_ALLOCATE);
+        if(!packet)
+        {
+            canceltransfer(&t);
+            return 0;
+        }
+        sendpacket(t.cn, 2, packet);
+        if(!packet->referenceCount)
+        {
+            enet_packet_destroy(packet);
+            canceltransfer(&t);
+            return 0;
+        }
+        packet->userData = &t;
+        packet->freeCallback = freechunk;
+        t.packets++;
+        t.inflight += packet->dataLength;
+        t.sent = std::min(t.sent + buf.chunklen, t.len);
+        return packet->dataLength;
+    }
+
+    static int sendchunk(transfer &t)
+    {
+        if(t.buf)
+        {
+            return sendframedchunk(t);
+        }
+        int len = std::min(transferchunk, t.len - t.sent);
+        packetbuf p(MAXTRANS + len, ENET_PACKET_FLAG_RELIABLE);
+        putint(p, NetMsg_SendChunk);
+        putint(p, t.type);
+        putint(p, t.id);
+        putint(p, t.len);
+        putint(p, t.sent);
+        if(!t.file->seek(t.sent, SEEK_SET) || t.file->read(p.subbuf(len).buf, len) != size_t(len))
+        {
+            canceltransfer(&t);
+            return 0;
+        }
+        ENetPacket *packet = p.finalize();
+        sendpacket(t.cn, 2, packet);
+        if(!packet->referenceCount)
+        {
+            canceltransfer(&t);
+            return 0;
+        }
+        packet->userData = &t;
+        packet->freeCallback = freechunk;
+        t.packets++;
+        t.inflight += packet->dataLength;
+        t.sent += len;
+        if(t.sent >= t.len)
+        {
+            t.close();
+        }
+        return packet->dataLength;
+    }
+
+    //called every server tick
+    void updatetransfers()
+    {
+        for(uint i = 0; i < transfers.size(); i++)
+        {
+            transfer *t = transfers[i];
+            if(t->done() && !t->packets)
+            {
+                delete t;
+                transfers.erase(transfers.begin() + i--);
+            }
+        }
+        int elapsed = totalmillis - lastbudget;
+        lastbudget = totalmillis;
+        if(transfers.empty())
+        {
+            transferbudget = 0;
+            return;
+        }
+        if(transferrate)
+        {
+            //allow bursts of up to 100ms worth of data
+            int rate = transferrate*1024;
+            transferbudget = std::min(transferbudget + static_cast<int>((static_cast<long long>(rate)*elapsed)/1000), rate/10 + transferchunk);
+        }
+        else
+        {
+            transferbudget = INT_MAX;
+        }
+        for(transfer *t : transfers)
+        {
+            if(!t->done())
+            {
+                updatewindow(*t);
+            }
+        }
+        //one chunk per transfer per pass so that concurrent downloads share the budget evenly
+        uint start = nexttransfer++;
+        for(bool progress = true; progress && transferbudget > 0;)
+        {
+            progress = false;
+            for(uint i = 0; i < transfers.size() && transferbudget > 0; i++)
+            {
+                transfer &t = *transfers[(start + i) % transfers.size()];
+                if(t.done() || t.inflight >= t.window)
+                {
+                    continue;
+                }
+                int sent = sendchunk(t);
+                if(sent > 0)
+                {
+                    transferbudget -= sent;
+                    progress = true;
+                }
+            }
+        }
+    }
+}
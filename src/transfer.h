@@ -0,0 +1,52 @@
+#ifndef TRANSFER_H_
+#define TRANSFER_H_
+
+// demos and maps are sent on channel 2 as a series of
+// { NetMsg_SendChunk, type, id, total length, offset, data } packets, where type
+// is NetMsg_SendDemo or NetMsg_SendMap. the id identifies what is sent rather
+// than the transfer: a demo gets a new id each time it is sent, but a map's
+// chunks are framed once and carry its crc, so every transfer of one map, to
+// any client and at any time, uses the same id
+
+namespace server
+{
+    // a file framed once into chunk packets laid out back to back, so any number
+    // of transfers can send it without reading or copying it; the id of its chunks
+    // identifies the content rather than the transfer. released once its owners
+    // and every transfer sending it are done with it
+    struct transferbuffer
+    {
+        uchar *data;
+        int len, chunklen;          //length of the file and of the data in each chunk
+        std::vector<uint> chunks;   //offset of each chunk packet in data, then the end of the last
+        int refs;
+        void *mapping;              //set when data points into a mapped framed file
+        size_t mapsize;
+
+        transferbuffer() : data(nullptr), len(0), chunklen(0), refs(1), mapping(nullptr), mapsize(0) {}
+        ~transferbuffer();
+
+        void release();
+        size_t size() const { return chunks.size() ? chunks.back() : 0; }
+    };
+
+    // a framed file is a transferheader, numchunks+1 chunk offsets, then the framed data
+    struct transferheader
+    {
+        char magic[4];
+        int version, len, chunklen, numchunks;
+    };
+
+    constexpr int TRANSFER_VERSION = 1;
+
+    extern transferbuffer *frametransfer(int type, int id, const uchar *data, int len);
+    extern bool savetransfer(const char *filename, const transferbuffer &buf);
+    extern transferbuffer *loadtransfer(const char *filename);
+    extern bool sendtransfer(clientinfo *ci, int type, stream *file, bool ownsfile);
+    extern bool sendtransfer(clientinfo *ci, int type, transferbuffer *buf);
+    extern bool hastransfer(clientinfo *ci, int type);
+    extern void canceltransfers(clientinfo *ci);
+    extern void updatetransfers();
+}
+
+#endif
@@ -0,0 +1,151 @@
+// demobench.cpp: measures demo playback throughput
+//
+// usage: demobench [-n <passes>] <demo.dmo>
+//
+// plays a demo as fast as possible into a headless consumer, once reading each
+// record into a freshly allocated packet as the server does for compressed
+// demos and once dispatching records in place from a mapping, and reports
+// packets/s for each; the consumer only touches the packet data
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+
+#include <enet/enet.h>
+
+#include "../tools.h"
+#include "../geom.h"
+#include "../game.h"
+#include "../demoreader.h"
+
+struct benchresult
+{
+    unsigned long long packets, bytes;
+    uint checksum;
+    double seconds;
+};
+
+static void freemapped(ENetPacket *packet)
+{
+    static_cast<demomapping *>(packet->userData)->release();
+}
+
+static void consume(ENetPacket *packet, benchresult &r)
+{
+    r.packets++;
+    r.bytes += packet->dataLength;
+    r.checksum = r.checksum*31 + packet->data[0] + packet->data[packet->dataLength-1];
+    enet_packet_destroy(packet);
+}
+
+static bool playdemo(const char *filename, bool mapped, benchresult &r)
+{
+    demoreader d;
+    if(!d.open(filename, mapped))
+    {
+        fprintf(stderr, "%s\n", d.error);
+        return false;
+    }
+    if(mapped && !d.map)
+    {
+        fprintf(stderr, "%s can not be mapped (compressed or unsupported platform)\n", filename);
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    int millis, chan, len;
+    while(d.readmillis(millis) && d.readrecord(chan, len))
+    {
+        ENetPacket *packet;
+        if(mapped)
+        {
+            uchar *data = d.mapdata(len);
+            if(!data || !(packet = enet_packet_create(data-1, len+1, ENET_PACKET_FLAG_NO_ALLOCATE)))
+            {
+                break;
+            }
+            data[-1] = NetMsg_DemoPacket;
+            d.map->refs++;
+            packet->userData = d.map;
+            packet->freeCallback = freemapped;
+        }
+        else
+        {
+            packet = enet_packet_create(nullptr, len+1, 0);
+            if(!packet || !d.readdata(packet->data+1, len))
+            {
+                if(packet)
+                {
+                    enet_packet_destroy(packet);
+                }
+                break;
+            }
+            packet->data[0] = NetMsg_DemoPacket;
+        }
+        consume(packet, r);
+    }
+    r.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+static void report(const char *name, const benchresult &r)
+{
+    printf("%-8s %12llu packets %10.1f MB %9.3f s %14.0f packets/s %9.1f MB/s  (checksum %08x)\n",
+           name, r.packets, r.bytes/(1024.0*1024.0), r.seconds,
+           r.seconds > 0 ? r.packets/r.seconds : 0.0,
+           r.seconds > 0 ? r.bytes/(1024.0*1024.0)/r.seconds : 0.0,
+           r.checksum);
+}
+
+int main(int argc, char **argv)
+{
+    int passes = 5;
+    const char *filename = nullptr;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-n") && i+1 < argc)
+        {
+            passes = std::max(atoi(argv[++i]), 1);
+        }
+        else
+        {
+            filename = argv[i];
+        }
+    }
+    if(!filename)
+    {
+        fprintf(stderr, "usage: %s [-n <passes>] <demo.dmo>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(enet_initialize() < 0)
+    {
+        fprintf(stderr, "unable to initialise network module\n");
+        return EXIT_FAILURE;
+    }
+    benchresult copied = {0, 0, 0, 0}, mapped = {0, 0, 0, 0};
+    bool canmap = true;
+    for(int i = 0; i < passes; ++i)
+    {
+        if(!playdemo(filename, false, copied))
+        {
+            return EXIT_FAILURE;
+        }
+        if(canmap)
+        {
+            canmap = playdemo(filename, true, mapped);
+        }
+    }
+    report("read", copied);
+    if(canmap)
+    {
+        report("mapped", mapped);
+    }
+    enet_deinitialize();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,686 @@
+// demostats.cpp: extracts kill feeds, damage, accuracy and position heatmaps from demos
+//
+// usage: demostats [-j <threads>] [-cell <size>] [-o <prefix>] [-tsv] <demo.dmo>...
+//
+// demos are decoded with the server's own getint/getuint/ucharbuf and the
+// msgsizes table from game.h, straight from the file (mapped when uncompressed),
+// without starting the network layer. demos are handed out to worker threads
+// one at a time; each worker keeps the results of a demo to itself, and the
+// tables are written once every demo is done, in command line order, so the
+// output does not depend on the number of threads.
+//
+// each table is written to <prefix>.<table> column by column: a header
+// { "IDST", version, numcolumns, numrows }, one { name[16], type } per column,
+// then each column as numrows ints. string columns hold indices into
+// <prefix>.strings, which is { "IDSS", version, numstrings } followed by
+// { int len; char text[len]; } per string. -tsv prints the tables instead.
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <map>
+#include <atomic>
+#include <thread>
+
+#include <enet/enet.h>
+
+#include "../tools.h"
+#include "../geom.h"
+#include "../game.h"
+#include "../cserver.h"
+#include "../demoreader.h"
+
+constexpr int DEMOSTATS_VERSION = 1,
+              MAXDEMOCN = 0x10000;   // client numbers above this are treated as garbage
+
+struct demoplayer
+{
+    std::string name;
+    int team, frags, deaths, suicides, damage, damagetaken, shots, shotdamage;
+
+    demoplayer(const char *name, int team) : name(name), team(team), frags(0), deaths(0), suicides(0), damage(0), damagetaken(0), shots(0), shotdamage(0) {}
+};
+
+struct demokill
+{
+    int millis, actor, target; // actor and target index the players of the demo
+};
+
+struct demoresult
+{
+    std::string map, error;
+    int mode, duration;
+    unsigned long long packets, bytes, unparsed;
+    std::vector<demoplayer> players;
+    std::vector<demokill> kills;
+    std::unordered_map<unsigned long long, uint> heat; // samples per heatmap cell
+
+    demoresult() : mode(0), duration(0), packets(0), bytes(0), unparsed(0) {}
+};
+
+static int msgsizes_[NetMsg_NumMsgs];
+
+static void initmsgsizes()
+{
+    for(const int *p = msgsizes; *p >= 0; p += 2)
+    {
+        if(p[0] < NetMsg_NumMsgs)
+        {
+            msgsizes_[p[0]] = p[1];
+        }
+    }
+}
+
+static inline int msgsize(int type)
+{
+    return type >= 0 && type < NetMsg_NumMsgs ? msgsizes_[type] : 0;
+}
+
+struct demodecoder
+{
+    demoresult &r;
+    int cell,                   // heatmap cell size in world units
+        millis;
+    std::vector<int> slots;     // player index per client number, -1 if unused
+
+    demodecoder(demoresult &r, int cell) : r(r), cell(cell), millis(0) {}
+
+    demoplayer *player(int cn)
+    {
+        return cn >= 0 && cn < static_cast<int>(slots.size()) && slots[cn] >= 0 ? &r.players[slots[cn]] : nullptr;
+    }
+
+    // a client that reconnects under the same name keeps adding to its earlier row
+    void setplayer(int cn, const char *name, int team)
+    {
+        if(cn < 0 || cn >= MAXDEMOCN)
+        {
+            return;
+        }
+        if(cn >= static_cast<int>(slots.size()))
+        {
+            slots.resize(cn+1, -1);
+        }
+        for(uint i = 0; i < r.players.size(); ++i)
+        {
+            if(r.players[i].name == name)
+            {
+                r.players[i].team = team;
+                slots[cn] = i;
+                return;
+            }
+        }
+        slots[cn] = r.players.size();
+        r.players.emplace_back(name, team);
+    }
+
+    void parsepositions(ucharbuf &p)
+    {
+        while(p.remaining() > 0)
+        {
+            if(getint(p) != NetMsg_Pos)
+            {
+                r.unparsed++;
+                return;
+            }
+            getuint(p);
+            p.get();
+            uint flags = getuint(p);
+            int o[3];
+            for(int k = 0; k < 3; ++k)
+            {
+                int n = p.get();
+                n |= p.get()<<8;
+                if(flags&(1<<k))
+                {
+                    n |= p.get()<<16;
+                    if(n&0x800000)
+                    {
+                        n |= ~0U<<24;
+                    }
+                }
+                o[k] = n;
+            }
+            for(int k = 0; k < 3; ++k) //yaw, pitch, roll
+            {
+                p.get();
+            }
+            p.get();
+            if(flags&(1<<3))
+            {
+                p.get();
+            }
+            p.get();
+            p.get();
+            if(flags&(1<<4))
+            {
+                p.get();
+                if(flags&(1<<5))
+                {
+                    p.get();
+                }
+                if(flags&(1<<6))
+                {
+                    p.get();
+                    p.get();
+                }
+            }
+            if(p.overread())
+            {
+                r.unparsed++;
+                return;
+            }
+            int size = static_cast<int>(cell*DMF),
+                cx = static_cast<int>(floor(o[0]/static_cast<float>(size))),
+                cy = static_cast<int>(floor(o[1]/static_cast<float>(size)));
+            r.heat[(static_cast<unsigned long long>(static_cast<uint>(cx))<<32) | static_cast<uint>(cy)]++;
+        }
+    }
+
+    // stops at the first message whose length can not be told, as the rest of
+    // the packet can not be found again
+    void parsemessages(ucharbuf &p, int sender)
+    {
+        string text;
+        while(p.remaining() > 0 && !p.overread())
+        {
+            int type = getint(p);
+            switch(type)
+            {
+                case NetMsg_Client:
+                {
+                    int cn = getint(p),
+                        len = getuint(p);
+                    ucharbuf q = p.subbuf(len);
+                    parsemessages(q, cn);
+                    break;
+                }
+                case NetMsg_InitClient:
+                {
+                    int cn = getint(p);
+                    getstring(text, p);
+                    int team = getint(p);
+                    getint(p);
+                    getint(p);
+                    setplayer(cn, text, team);
+                    break;
+                }
+                case NetMsg_InitAI:
+                {
+                    int cn = getint(p);
+                    for(int i = 0; i < 5; ++i) //owner, aitype, skill, model, color
+                    {
+                        getint(p);
+                    }
+                    int team = getint(p);
+                    getstring(text, p);
+                    setplayer(cn, text, team);
+                    break;
+                }
+                case NetMsg_SwitchName:
+                {
+                    getstring(text, p);
+                    demoplayer *d = player(sender);
+                    setplayer(sender, text, d ? d->team : 0);
+                    break;
+                }
+                case NetMsg_SetTeam:
+                {
+                    demoplayer *d = player(getint(p));
+                    int team = getint(p);
+                    getint(p);
+                    if(d)
+                    {
+                        d->team = team;
+                    }
+                    break;
+                }
+                case NetMsg_ClientDiscon:
+                {
+                    int cn = getint(p);
+                    if(player(cn))
+                    {
+                        slots[cn] = -1;
+                    }
+                    break;
+                }
+                case NetMsg_Died:
+                {
+                    int target = getint(p),
+                        actor = getint(p),
+                        frags = getint(p);
+                    getint(p);
+                    demoplayer *t = player(target),
+                               *a = player(actor);
+                    if(!t || !a)
+                    {
+                        break;
+                    }
+                    t->deaths++;
+                    a->frags = frags;
+                    if(t == a)
+                    {
+                        a->suicides++;
+                    }
+                    demokill k = { millis, slots[actor], slots[target] };
+                    r.kills.push_back(k);
+                    break;
+                }
+                case NetMsg_Damage:
+                {
+                    demoplayer *t = player(getint(p)),
+                               *a = player(getint(p));
+                    int damage = getint(p);
+                    getint(p);
+                    if(t && a && t != a)
+                    {
+                        t->damagetaken += damage;
+                        a->damage += damage;
+                    }
+                    break;
+                }
+                case NetMsg_ShotFX:
+                {
+                    demoplayer *d = player(getint(p));
+                    int atk = getint(p);
+                    for(int i = 0; i < 7; ++i) //id, from, to
+                    {
+                        getint(p);
+                    }
+                    if(d && VALID_ATTACK(atk))
+                    {
+                        d->shots++;
+                        d->shotdamage += attacks[atk].damage*attacks[atk].rays;
+                    }
+                    break;
+                }
+                case NetMsg_MapChange:
+                {
+                    getstring(text, p);
+                    int mode = getint(p);
+                    getint(p);
+                    if(r.map.empty())
+                    {
+                        r.map = text;
+                        r.mode = mode;
+                    }
+                    break;
+                }
+                case NetMsg_Text:
+                case NetMsg_SayTeam:
+                case NetMsg_ServerMsg:
+                {
+                    getstring(text, p);
+                    break;
+                }
+                case NetMsg_ItemList:
+                {
+                    while(getint(p) >= 0 && !p.overread())
+                    {
+                        getint(p);
+                    }
+                    break;
+                }
+                case NetMsg_CurrentMaster:
+                {
+                    getint(p);
+                    while(getint(p) >= 0 && !p.overread())
+                    {
+                        getint(p);
+                    }
+                    break;
+                }
+                case NetMsg_PauseGame:
+                case NetMsg_GameSpeed:
+                {
+                    getint(p);
+                    getint(p);
+                    break;
+                }
+                case NetMsg_TeamInfo:
+                {
+                    for(int i = 0; i < MAXTEAMS; ++i)
+                    {
+                        getint(p);
+                    }
+                    break;
+                }
+                case NetMsg_Resume:
+                {
+                    while(getint(p) >= 0 && !p.overread())
+                    {
+                        for(int i = 0; i < 8 + Gun_NumGuns; ++i) //state, frags, score, deaths, lifesequence, health, maxhealth, gunselect, ammo
+                        {
+                            getint(p);
+                        }
+                    }
+                    break;
+                }
+                default:
+                {
+                    int size = msgsize(type);
+                    if(size <= 0)
+                    {
+                        r.unparsed++;
+                        return;
+                    }
+                    for(int i = 1; i < size; ++i)
+                    {
+                        getint(p);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    void decode(const char *filename)
+    {
+        demoreader d;
+        if(!d.open(filename, true))
+        {
+            r.error = d.error;
+            return;
+        }
+        std::vector<uchar> buf;
+        int chan, len;
+        while(d.readmillis(millis) && d.readrecord(chan, len))
+        {
+            uchar *data;
+            if(d.map)
+            {
+                data = d.mapdata(len);
+            }
+            else
+            {
+                if(static_cast<int>(buf.size()) < len)
+                {
+                    buf.resize(len);
+                }
+                data = d.readdata(buf.data(), len) ? buf.data() : nullptr;
+            }
+            if(!data)
+            {
+                r.error = "truncated demo";
+                break;
+            }
+            r.packets++;
+            r.bytes += len;
+            r.duration = millis;
+            ucharbuf p(data, len);
+            if(chan == 0)
+            {
+                parsepositions(p);
+            }
+            else if(chan == 1)
+            {
+                parsemessages(p, -1);
+            }
+        }
+    }
+};
+
+struct demotable
+{
+    struct column
+    {
+        const char *name;
+        bool isstring;
+        std::vector<int> data;
+    };
+    const char *name;
+    std::vector<column> columns;
+
+    demotable(const char *name, std::initializer_list<const char *> names) : name(name)
+    {
+        for(const char *n : names)
+        {
+            bool isstring = n[0] == '$';
+            columns.push_back({ isstring ? n+1 : n, isstring, {} });
+        }
+    }
+
+    void add(std::initializer_list<int> row)
+    {
+        int i = 0;
+        for(int v : row)
+        {
+            columns[i++].data.push_back(v);
+        }
+    }
+
+    int numrows() const { return columns[0].data.size(); }
+};
+
+struct stringtable
+{
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, int> ids;
+
+    int add(const std::string &s)
+    {
+        auto it = ids.find(s);
+        if(it != ids.end())
+        {
+            return it->second;
+        }
+        ids[s] = strings.size();
+        strings.push_back(s);
+        return strings.size()-1;
+    }
+};
+
+static bool writetable(const char *prefix, const demotable &t)
+{
+    DEF_FORMAT_STRING(filename, "%s.%s", prefix, t.name);
+    FILE *f = fopen(filename, "wb");
+    if(!f)
+    {
+        fprintf(stderr, "could not write %s\n", filename);
+        return false;
+    }
+    int hdr[3] = { DEMOSTATS_VERSION, static_cast<int>(t.columns.size()), t.numrows() };
+    fwrite("IDST", 1, 4, f);
+    fwrite(hdr, sizeof(int), 3, f);
+    for(const demotable::column &c : t.columns)
+    {
+        char name[16];
+        memset(name, 0, sizeof(name));
+        copystring(name, c.name, sizeof(name));
+        int type = c.isstring ? 1 : 0;
+        fwrite(name, 1, sizeof(name), f);
+        fwrite(&type, sizeof(int), 1, f);
+    }
+    for(const demotable::column &c : t.columns)
+    {
+        fwrite(c.data.data(), sizeof(int), c.data.size(), f);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+static bool writestrings(const char *prefix, const stringtable &s)
+{
+    DEF_FORMAT_STRING(filename, "%s.strings", prefix);
+    FILE *f = fopen(filename, "wb");
+    if(!f)
+    {
+        fprintf(stderr, "could not write %s\n", filename);
+        return false;
+    }
+    int hdr[2] = { DEMOSTATS_VERSION, static_cast<int>(s.strings.size()) };
+    fwrite("IDSS", 1, 4, f);
+    fwrite(hdr, sizeof(int), 2, f);
+    for(const std::string &str : s.strings)
+    {
+        int len = str.size();
+        fwrite(&len, sizeof(int), 1, f);
+        fwrite(str.data(), 1, len, f);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+static void printtable(const demotable &t, const stringtable &s)
+{
+    printf("# %s\n", t.name);
+    for(uint i = 0; i < t.columns.size(); ++i)
+    {
+        printf("%s%s", i ? "\t" : "", t.columns[i].name);
+    }
+    printf("\n");
+    for(int row = 0; row < t.numrows(); ++row)
+    {
+        for(uint i = 0; i < t.columns.size(); ++i)
+        {
+            const demotable::column &c = t.columns[i];
+            if(c.isstring)
+            {
+                printf("%s%s", i ? "\t" : "", s.strings[c.data[row]].c_str());
+            }
+            else
+            {
+                printf("%s%d", i ? "\t" : "", c.data[row]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int numthreads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1),
+        cell = 64;
+    const char *prefix = "demostats";
+    bool tsv = false;
+    std::vector<const char *> files;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-j") && i+1 < argc)
+        {
+            numthreads = std::max(atoi(argv[++i]), 1);
+        }
+        else if(!strcmp(argv[i], "-cell") && i+1 < argc)
+        {
+            cell = std::max(atoi(argv[++i]), 1);
+        }
+        else if(!strcmp(argv[i], "-o") && i+1 < argc)
+        {
+            prefix = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-tsv"))
+        {
+            tsv = true;
+        }
+        else
+        {
+            files.push_back(argv[i]);
+        }
+    }
+    if(files.empty())
+    {
+        fprintf(stderr, "usage: %s [-j <threads>] [-cell <size>] [-o <prefix>] [-tsv] <demo.dmo>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    initmsgsizes();
+
+    std::vector<demoresult> results(files.size());
+    std::atomic<uint> next(0);
+    auto worker = [&] ()
+    {
+        for(uint i; (i = next.fetch_add(1)) < files.size();)
+        {
+            demodecoder(results[i], cell).decode(files[i]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for(int i = 1; i < std::min(numthreads, static_cast<int>(files.size())); ++i)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for(std::thread &t : threads)
+    {
+        t.join();
+    }
+
+    stringtable strings;
+    demotable demos("demos", { "demo", "$file", "$map", "mode", "millis", "packets", "kbytes", "unparsed" }),
+              kills("kills", { "demo", "millis", "$actor", "$target" }),
+              players("players", { "demo", "$name", "team", "frags", "deaths", "suicides", "damage", "taken", "shots", "shotdamage", "accuracy" }),
+              heatmap("heatmap", { "$map", "x", "y", "samples" });
+    std::map<std::string, std::unordered_map<unsigned long long, uint>> heat; // merged per map
+    unsigned long long totalbytes = 0;
+    int failed = 0;
+    for(uint i = 0; i < results.size(); ++i)
+    {
+        const demoresult &r = results[i];
+        if(!r.error.empty())
+        {
+            fprintf(stderr, "%s: %s\n", files[i], r.error.c_str());
+            failed++;
+        }
+        totalbytes += r.bytes;
+        int demo = i;
+        demos.add({ demo, strings.add(files[i]), strings.add(r.map), r.mode, r.duration, static_cast<int>(r.packets), static_cast<int>(r.bytes>>10), static_cast<int>(r.unparsed) });
+        for(const demokill &k : r.kills)
+        {
+            kills.add({ demo, k.millis, strings.add(r.players[k.actor].name), strings.add(r.players[k.target].name) });
+        }
+        for(const demoplayer &d : r.players)
+        {
+            int accuracy = d.shotdamage > 0 ? (d.damage*100 + d.shotdamage/2)/d.shotdamage : 0;
+            players.add({ demo, strings.add(d.name), d.team, d.frags, d.deaths, d.suicides, d.damage, d.damagetaken, d.shots, d.shotdamage, accuracy });
+        }
+        std::unordered_map<unsigned long long, uint> &mapheat = heat[r.map];
+        for(auto &c : r.heat)
+        {
+            mapheat[c.first] += c.second;
+        }
+    }
+    for(auto &m : heat)
+    {
+        std::vector<std::pair<unsigned long long, uint>> cells(m.second.begin(), m.second.end());
+        std::sort(cells.begin(), cells.end());
+        int map = strings.add(m.first);
+        for(auto &c : cells)
+        {
+            heatmap.add({ map, static_cast<int>(c.first>>32)*cell, static_cast<int>(c.first&0xFFFFFFFFU)*cell, static_cast<int>(c.second) });
+        }
+    }
+
+    if(tsv)
+    {
+        for(const demotable *t : { &demos, &kills, &players, &heatmap })
+        {
+            printtable(*t, strings);
+        }
+    }
+    else
+    {
+        for(const demotable *t : { &demos, &kills, &players, &heatmap })
+        {
+            if(!writetable(prefix, *t))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        if(!writestrings(prefix, strings))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    fprintf(stderr, "%d demos (%d failed), %.1f MB decoded, %d kills, %d player rows, %d heatmap cells\n",
+            static_cast<int>(files.size()), failed, totalbytes/(1024.0*1024.0), kills.numrows(), players.numrows(), heatmap.numrows());
+    return failed == static_cast<int>(files.size()) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,743 @@
+// loadgen.cpp: drives a running server with simulated players over enet
+//
+// usage: loadgen [-s <host>] [-p <port>] [-c <clients>] [-m <profile>[:<weight>][,...]]
+//                [-r <connects per second>] [-d <seconds>] [-i <report seconds>]
+//
+// every simulated player is a peer of one enet host, so hundreds of them cost
+// one socket. each answers ServerInfo with Connect and its SpawnState with
+// Spawn, pings once a second and reports the result with ClientPing as a real
+// client does, and then sends whatever its behavior profile asks for:
+// positions, shots and pulse explosions, or chat. shots hit other simulated
+// players, whose positions and life sequences this process already knows.
+//
+// incoming messages are followed only as far as the few this needs; the rest
+// of a packet is skipped at the first message of a kind it does not read.
+//
+// reports, every interval and for the whole run, the players connected and
+// alive, bytes per second each way, the position updates (channel 0 packets)
+// each player received per second and the longest gap between two of them,
+// and the round trip times of the pings and of enet itself.
+//
+// the server limits connects per address; run it with "connectrate 0", or
+// ramp the connects with -r, when starting more than connectburst players
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+
+#include <enet/enet.h>
+
+#include "../tools.h"
+#include "../geom.h"
+#include "../iengine.h"
+#include "../igame.h"
+#include "../game.h"
+#include "../cserver.h"
+
+static uint loadseed = 0x10ad;
+
+static uint loadrand(uint n)
+{
+    loadseed = loadseed*1664525 + 1013904223;
+    return (loadseed>>8)%n;
+}
+
+constexpr int PINGMILLIS = 1000,
+              SPAWNMILLIS = 2000,   //wait after dying before asking to respawn
+              EXPLODEMILLIS = 400;  //flight time of a pulse shot
+
+//what a player sends besides pings and spawns; 0 disables a kind of message
+static const struct loadprofile
+{
+    const char *name;
+    int posmillis, shotmillis, chatmillis;
+} profiles[] =
+{
+    { "idle",       0,    0,     0 },
+    { "walker",    33,    0,     0 },
+    { "fighter",   33,  500,     0 },
+    { "chatter",   33,    0,  2000 },
+    { "heavy",     16,    1,  1000 }, //shoots as fast as each attack allows
+};
+
+constexpr int NUMPROFILES = sizeof(profiles)/sizeof(profiles[0]);
+
+enum
+{
+    Load_Connecting = 0,    //waiting for enet to connect
+    Load_Handshake,         //connected, waiting for ServerInfo and Welcome
+    Load_Playing,
+    Load_Gone
+};
+
+struct loadclient
+{
+    ENetPeer *peer;
+    int profile, state;
+    int cn, ls;
+    bool alive;
+    int nextpos, nextshot, nextchat, nextping, nextspawn;
+    int pulseid, pulsemillis;
+    int lastupdate, rtt;
+    vec o;
+    string map;
+};
+
+static std::vector<loadclient> loadclients;
+static loadclient *bycn[MAXCLIENTS];
+
+//counters over one report interval
+struct loadstats
+{
+    unsigned long long bytesin, bytesout, updates;
+    int maxgap;
+    std::vector<int> rtts;
+};
+
+static loadstats interval, total;
+static int refused = 0,
+           dropped = 0;
+
+static int loadmillis()
+{
+    static std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+static void send(loadclient &c, int chan, const ucharbuf &p, int flags)
+{
+    if(p.length() && c.peer)
+    {
+        enet_peer_send(c.peer, chan, enet_packet_create(p.buf, p.length(), flags));
+        interval.bytesout += p.length();
+    }
+}
+
+static void putpos(ucharbuf &p, int cn, const vec &o)
+{
+    putint(p, NetMsg_Pos);
+    putuint(p, cn);
+    p.put(0);           //physics state
+    putuint(p, 0);      //flags: no 24 bit coordinates, 8 bit velocity
+    for(int k = 0; k < 3; ++k)
+    {
+        int n = static_cast<int>(o[k]*DMF);
+        p.put(n&0xFF);
+        p.put((n>>8)&0xFF);
+    }
+    p.put(loadrand(256)); //yaw, pitch and roll
+    p.put(loadrand(256));
+    p.put(0);
+    p.put(40);          //speed
+    int dir = loadrand(360) + 90*360;
+    p.put(dir&0xFF);
+    p.put(dir>>8);
+}
+
+//another living simulated player, or nullptr
+static loadclient *picktarget(loadclient &c)
+{
+    for(int tries = 0; tries < 4; ++tries)
+    {
+        loadclient *t = bycn[loadrand(MAXCLIENTS)];
+        if(t && t != &c && t->alive)
+        {
+            return t;
+        }
+    }
+    return nullptr;
+}
+
+static void puthits(ucharbuf &p, loadclient *target, float dist)
+{
+    if(!target)
+    {
+        putint(p, 0);
+        return;
+    }
+    putint(p, 1);
+    putint(p, target->cn);
+    putint(p, target->ls);
+    putint(p, static_cast<int>(dist*DMF));
+    putint(p, 1);
+    putint(p, 0);
+    putint(p, 0);
+    putint(p, static_cast<int>(DNF));
+}
+
+static void connected(loadclient &c, int cn, int protocol)
+{
+    if(protocol != PROTOCOL_VERSION)
+    {
+        fprintf(stderr, "server speaks protocol %d, not %d\n", protocol, PROTOCOL_VERSION);
+    }
+    c.cn = cn;
+    if(cn >= 0 && cn < MAXCLIENTS)
+    {
+        bycn[cn] = &c;
+    }
+    uchar buf[MAXTRANS];
+    ucharbuf p(buf, sizeof(buf));
+    putint(p, NetMsg_Connect);
+    sendstring(tempformatstring("load%d", static_cast<int>(&c - loadclients.data())), p);
+    putint(p, 0);   //model
+    putint(p, 0);   //color
+    sendstring("", p);
+    sendstring("", p);
+    sendstring("", p);
+    send(c, 1, p, ENET_PACKET_FLAG_RELIABLE);
+}
+
+static void spawned(loadclient &c, int ls)
+{
+    c.ls = ls;
+    c.alive = true;
+    c.o = vec(256 + loadrand(3584), 256 + loadrand(3584), 64 + loadrand(512));
+    uchar buf[32];
+    ucharbuf p(buf, sizeof(buf));
+    putint(p, NetMsg_Spawn);
+    putint(p, ls);
+    putint(p, Gun_Pulse);
+    putint(p, 0);
+    send(c, 1, p, ENET_PACKET_FLAG_RELIABLE);
+}
+
+//reads the messages a simulated player acts on, stopping at the first it does not know
+static void parsemessages(loadclient &c, ucharbuf &p, int millis)
+{
+    char text[MAXTRANS];
+    while(p.remaining() > 0 && !p.overread())
+    {
+        switch(getint(p))
+        {
+            case NetMsg_ServerInfo:
+            {
+                int cn = getint(p),
+                    protocol = getint(p);
+                getint(p);  //session id
+                getint(p);  //has password
+                getstring(text, p);
+                getstring(text, p);
+                connected(c, cn, protocol);
+                break;
+            }
+            case NetMsg_Welcome:
+            {
+                c.state = Load_Playing;
+                break;
+            }
+            case NetMsg_MapChange:
+            {
+                getstring(text, p);
+                copystring(c.map, text);
+                getint(p);  //mode
+                getint(p);  //items
+                uchar buf[MAXTRANS];
+                ucharbuf q(buf, sizeof(buf));
+                putint(q, NetMsg_MapCRC);
+                sendstring(c.map, q);
+                putint(q, 0);
+                send(c, 1, q, ENET_PACKET_FLAG_RELIABLE);
+                c.alive = false;
+                break;
+            }
+            case NetMsg_TimeUp:
+            {
+                getint(p);
+                break;
+            }
+            case NetMsg_ItemList:
+            {
+                while(getint(p) >= 0 && !p.overread())
+                {
+                    getint(p);
+                }
+                break;
+            }
+            case NetMsg_CurrentMaster:
+            {
+                getint(p);  //master mode
+                while(getint(p) >= 0 && !p.overread())
+                {
+                    getint(p);
+                }
+                break;
+            }
+            case NetMsg_PauseGame:
+            case NetMsg_GameSpeed:
+            {
+                getint(p);
+                getint(p);
+                break;
+            }
+            case NetMsg_TeamInfo:
+            {
+                for(int i = 0; i < MAXTEAMS; ++i)
+                {
+                    getint(p);
+                }
+                break;
+            }
+            case NetMsg_SetTeam:
+            case NetMsg_Spectator:
+            {
+                getint(p);
+                getint(p);
+                getint(p);
+                break;
+            }
+            case NetMsg_SpawnState:
+            {
+                int cn = getint(p),
+                    ls = getint(p);
+                for(int i = 0; i < 3 + Gun_NumGuns; ++i)
+                {
+                    getint(p);
+                }
+                if(cn == c.cn && !p.overread())
+                {
+                    spawned(c, ls);
+                }
+                break;
+            }
+            case NetMsg_ForceDeath:
+            {
+                if(getint(p) == c.cn)
+                {
+                    c.alive = false;
+                    c.nextspawn = millis + SPAWNMILLIS;
+                }
+                break;
+            }
+            case NetMsg_Died:
+            {
+                int victim = getint(p);
+                getint(p);
+                getint(p);
+                getint(p);
+                if(victim == c.cn)
+                {
+                    c.alive = false;
+                    c.nextspawn = millis + SPAWNMILLIS;
+                }
+                break;
+            }
+            case NetMsg_Pong:
+            {
+                c.rtt = std::max(millis - getint(p), 0);
+                interval.rtts.push_back(c.rtt);
+                break;
+            }
+            default:
+            {
+                return;
+            }
+        }
+    }
+}
+
+static void received(loadclient &c, int chan, ENetPacket *packet, int millis)
+{
+    interval.bytesin += packet->dataLength;
+    if(chan == 0)
+    {
+        interval.updates++;
+        if(c.lastupdate >= 0)
+        {
+            interval.maxgap = std::max(interval.maxgap, millis - c.lastupdate);
+        }
+        c.lastupdate = millis;
+    }
+    else if(chan == 1)
+    {
+        ucharbuf p(packet->data, packet->dataLength);
+        parsemessages(c, p, millis);
+    }
+}
+
+static void simulate(loadclient &c, int millis)
+{
+    if(c.state != Load_Playing)
+    {
+        return;
+    }
+    const loadprofile &prof = profiles[c.profile];
+    uchar msgs[MAXTRANS];
+    ucharbuf m(msgs, sizeof(msgs));
+    if(millis >= c.nextping)
+    {
+        c.nextping = millis + PINGMILLIS;
+        putint(m, NetMsg_Ping);
+        putint(m, millis);
+        putint(m, NetMsg_ClientPing);
+        putint(m, c.rtt);
+    }
+    if(!c.alive)
+    {
+        if(c.nextspawn && millis >= c.nextspawn)
+        {
+            c.nextspawn = millis + SPAWNMILLIS;
+            putint(m, NetMsg_TrySpawn);
+        }
+    }
+    else
+    {
+        if(prof.posmillis && millis >= c.nextpos)
+        {
+            c.nextpos = millis + prof.posmillis;
+            uchar pos[64];
+            ucharbuf p(pos, sizeof(pos));
+            c.o.add(vec(loadrand(9) - 4.0f, loadrand(9) - 4.0f, 0.0f)).clamp(16.0f, 4000.0f);
+            putpos(p, c.cn, c.o);
+            send(c, 0, p, 0);
+        }
+        if(prof.shotmillis && millis >= c.nextshot)
+        {
+            int atk = loadrand(Attack_NumAttacks);
+            if(atk == Attack_PulseShoot && c.pulseid)
+            {
+                atk = Attack_RailShot;
+            }
+            c.nextshot = millis + std::max(attacks[atk].attackdelay, prof.shotmillis) + loadrand(100);
+            loadclient *target = loadrand(2) ? picktarget(c) : nullptr;
+            vec to = target ? target->o : vec(c.o).add(vec(loadrand(512), loadrand(512), 0.0f));
+            putint(m, NetMsg_Shoot);
+            putint(m, millis);
+            putint(m, atk);
+            for(int k = 0; k < 3; ++k)
+            {
+                putint(m, static_cast<int>(c.o[k]*DMF));
+            }
+            for(int k = 0; k < 3; ++k)
+            {
+                putint(m, static_cast<int>(to[k]*DMF));
+            }
+            puthits(m, atk != Attack_PulseShoot ? target : nullptr, c.o.dist(to));
+            if(atk == Attack_PulseShoot)
+            {
+                c.pulseid = millis;
+                c.pulsemillis = millis + EXPLODEMILLIS;
+            }
+        }
+        if(c.pulseid && millis >= c.pulsemillis)
+        {
+            loadclient *target = loadrand(2) ? picktarget(c) : nullptr;
+            putint(m, NetMsg_Explode);
+            putint(m, millis);
+            putint(m, Attack_PulseShoot);
+            putint(m, c.pulseid);
+            puthits(m, target, loadrand(attacks[Attack_PulseShoot].exprad));
+            c.pulseid = 0;
+        }
+    }
+    if(prof.chatmillis && millis >= c.nextchat)
+    {
+        c.nextchat = millis + prof.chatmillis/2 + loadrand(prof.chatmillis);
+        putint(m, NetMsg_Text);
+        sendstring(tempformatstring("load chat from %d at %d", c.cn, millis), m);
+    }
+    send(c, 1, m, ENET_PACKET_FLAG_RELIABLE);
+}
+
+static void gone(loadclient &c, bool wasplaying)
+{
+    if(c.cn >= 0 && c.cn < MAXCLIENTS && bycn[c.cn] == &c)
+    {
+        bycn[c.cn] = nullptr;
+    }
+    c.peer = nullptr;
+    c.state = Load_Gone;
+    c.alive = false;
+    if(wasplaying)
+    {
+        dropped++;
+    }
+    else
+    {
+        refused++;
+    }
+}
+
+//profile mix as name[:weight],...; every player gets a profile drawn by weight
+static bool parseprofiles(char *spec, std::vector<int> &weights)
+{
+    weights.assign(NUMPROFILES, 0);
+    for(char *s = strtok(spec, ","); s; s = strtok(nullptr, ","))
+    {
+        char *w = strchr(s, ':');
+        if(w)
+        {
+            *w++ = '\0';
+        }
+        int i = 0;
+        while(i < NUMPROFILES && strcmp(profiles[i].name, s))
+        {
+            i++;
+        }
+        if(i >= NUMPROFILES)
+        {
+            return false;
+        }
+        weights[i] += w ? std::max(atoi(w), 0) : 1;
+    }
+    int sum = 0;
+    for(int w : weights)
+    {
+        sum += w;
+    }
+    return sum > 0;
+}
+
+static int pickprofile(const std::vector<int> &weights)
+{
+    int sum = 0;
+    for(int w : weights)
+    {
+        sum += w;
+    }
+    int n = loadrand(sum);
+    for(int i = 0; i < NUMPROFILES; ++i)
+    {
+        if(n < weights[i])
+        {
+            return i;
+        }
+        n -= weights[i];
+    }
+    return 0;
+}
+
+static void report(const char *label, loadstats &s, double seconds)
+{
+    int connected = 0,
+        alive = 0;
+    double enetrtt = 0;
+    for(const loadclient &c : loadclients)
+    {
+        if(c.state == Load_Playing)
+        {
+            connected++;
+            alive += c.alive ? 1 : 0;
+            enetrtt += c.peer->roundTripTime;
+        }
+    }
+    std::vector<int> &rtts = s.rtts;
+    std::sort(rtts.begin(), rtts.end());
+    double avg = 0;
+    for(int r : rtts)
+    {
+        avg += r;
+    }
+    int n = rtts.size();
+    printf("%7s %7d %7d %9.1f %9.1f %7.1f %7d %6d %6.1f %6d %6d %8.1f\n",
+           label, connected, alive,
+           s.bytesout/seconds/1024, s.bytesin/seconds/1024,
+           connected ? s.updates/seconds/connected : 0.0, s.maxgap,
+           n ? rtts[0] : 0, n ? avg/n : 0.0, n ? rtts[std::min(n*99/100, n-1)] : 0, n ? rtts[n-1] : 0,
+           connected ? enetrtt/connected : 0.0);
+}
+
+static void accumulate()
+{
+    total.bytesin += interval.bytesin;
+    total.bytesout += interval.bytesout;
+    total.updates += interval.updates;
+    total.maxgap = std::max(total.maxgap, interval.maxgap);
+    total.rtts.insert(total.rtts.end(), interval.rtts.begin(), interval.rtts.end());
+    interval.bytesin = interval.bytesout = interval.updates = 0;
+    interval.maxgap = 0;
+    interval.rtts.clear();
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s <host>] [-p <port>] [-c <clients>] [-m <profile>[:<weight>][,...]]\n"
+                    "       [-r <connects per second>] [-d <seconds>] [-i <report seconds>]\n"
+                    "profiles:", name);
+    for(int i = 0; i < NUMPROFILES; ++i)
+    {
+        fprintf(stderr, " %s", profiles[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *hostname = "localhost";
+    int port = TESSERACT_SERVER_PORT,
+        numclients = 64,
+        connectrate = 0,
+        duration = 60,
+        reportsecs = 5;
+    std::vector<int> weights;
+    char defaultmix[] = "fighter:6,walker:3,chatter:1";
+    parseprofiles(defaultmix, weights);
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-s") && i+1 < argc)
+        {
+            hostname = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-p") && i+1 < argc)
+        {
+            port = std::clamp(atoi(argv[++i]), 1, 0xFFFF);
+        }
+        else if(!strcmp(argv[i], "-c") && i+1 < argc)
+        {
+            numclients = std::clamp(atoi(argv[++i]), 1, 4095);
+        }
+        else if(!strcmp(argv[i], "-m") && i+1 < argc)
+        {
+            if(!parseprofiles(argv[++i], weights))
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if(!strcmp(argv[i], "-r") && i+1 < argc)
+        {
+            connectrate = std::max(atoi(argv[++i]), 0);
+        }
+        else if(!strcmp(argv[i], "-d") && i+1 < argc)
+        {
+            duration = std::max(atoi(argv[++i]), 1);
+        }
+        else if(!strcmp(argv[i], "-i") && i+1 < argc)
+        {
+            reportsecs = std::max(atoi(argv[++i]), 1);
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(enet_initialize() < 0)
+    {
+        fprintf(stderr, "unable to initialise network module\n");
+        return EXIT_FAILURE;
+    }
+    ENetAddress address;
+    if(enet_address_set_host(&address, hostname) < 0)
+    {
+        fprintf(stderr, "could not resolve %s\n", hostname);
+        return EXIT_FAILURE;
+    }
+    address.port = port;
+    ENetHost *host = enet_host_create(nullptr, numclients, 3, 0, 0);
+    if(!host)
+    {
+        fprintf(stderr, "could not create an enet host for %d peers\n", numclients);
+        return EXIT_FAILURE;
+    }
+    loadclients.resize(numclients);
+    for(loadclient &c : loadclients)
+    {
+        c.peer = nullptr;
+        c.profile = pickprofile(weights);
+        c.state = Load_Connecting;
+        c.cn = -1;
+        c.ls = 0;
+        c.alive = false;
+        c.nextpos = c.nextshot = c.nextchat = c.nextping = c.nextspawn = 0;
+        c.pulseid = c.pulsemillis = 0;
+        c.lastupdate = -1;
+        c.rtt = 0;
+        c.o = vec(0.0f);
+        c.map[0] = '\0';
+    }
+
+    printf("%d players on %s:%d for %d s\n", numclients, hostname, port, duration);
+    printf("%7s %7s %7s %9s %9s %7s %7s %6s %6s %6s %6s %8s\n",
+           "time", "players", "alive", "out kB/s", "in kB/s", "upd/s", "max gap", "rtt lo", "avg", "p99", "max", "enet rtt");
+    int started = 0,
+        start = loadmillis(),
+        lastreport = start,
+        end = start + duration*1000;
+    for(int millis = start; millis < end; millis = loadmillis())
+    {
+        //connect everyone at once, or at the rate asked for
+        int due = connectrate ? std::min(static_cast<int>(static_cast<long long>(millis - start)*connectrate/1000) + 1, numclients) : numclients;
+        for(; started < due; ++started)
+        {
+            loadclient &c = loadclients[started];
+            c.peer = enet_host_connect(host, &address, 3, 0);
+            if(!c.peer)
+            {
+                gone(c, false);
+                continue;
+            }
+            c.peer->data = &c;
+            c.nextping = c.nextpos = c.nextshot = c.nextchat = millis + loadrand(1000);
+        }
+        ENetEvent event;
+        for(int timeout = 1; enet_host_service(host, &event, timeout) > 0; timeout = 0)
+        {
+            loadclient *c = static_cast<loadclient *>(event.peer->data);
+            if(!c)
+            {
+                if(event.type == ENET_EVENT_TYPE_RECEIVE)
+                {
+                    enet_packet_destroy(event.packet);
+                }
+                continue;
+            }
+            switch(event.type)
+            {
+                case ENET_EVENT_TYPE_CONNECT:
+                {
+                    c->state = Load_Handshake;
+                    break;
+                }
+                case ENET_EVENT_TYPE_RECEIVE:
+                {
+                    received(*c, event.channelID, event.packet, millis);
+                    enet_packet_destroy(event.packet);
+                    break;
+                }
+                case ENET_EVENT_TYPE_DISCONNECT:
+                {
+                    event.peer->data = nullptr;
+                    gone(*c, c->state == Load_Playing);
+                    break;
+                }
+                default:
+                {
+                    break;
+                }
+            }
+        }
+        for(loadclient &c : loadclients)
+        {
+            simulate(c, millis);
+        }
+        enet_host_flush(host);
+        if(millis - lastreport >= reportsecs*1000)
+        {
+            report(tempformatstring("%d", (millis - start)/1000), interval, (millis - lastreport)/1000.0);
+            accumulate();
+            lastreport = millis;
+        }
+    }
+    accumulate();
+    report("total", total, duration);
+    printf("%d refused, %d dropped\n", refused, dropped);
+    for(loadclient &c : loadclients)
+    {
+        if(c.peer)
+        {
+            enet_peer_disconnect(c.peer, Discon_None);
+        }
+    }
+    enet_host_flush(host);
+    enet_host_destroy(host);
+    enet_deinitialize();
+    return EXIT_SUCCESS;
+}
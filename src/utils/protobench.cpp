@@ -0,0 +1,481 @@
+// protobench.cpp: microbenchmarks of the protocol and buffer primitives
+//
+// usage: protobench [-n <iterations>] [-r <repeats>] [-w <warmups>] [-f <filter>] [-o <file.json>]
+//
+// every case runs a pinned number of operations over inputs generated from a
+// fixed seed, untimed for the warmups and then timed for each repeat. the
+// fastest, median and slowest repeat are written as json in ns per operation,
+// with a checksum of the results so two runs can be checked to have done the
+// same work; compare the min column between builds
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+
+#include <enet/enet.h>
+
+#include "../tools.h"
+#include "../geom.h"
+#include "../iengine.h"
+#include "../game.h"
+
+constexpr int NUMINPUTS = 4096,     //values cycled through by each case, a power of two
+              NUMSTRINGS = 64;
+
+static uint benchseed = 0x1234567;
+
+//a fixed sequence, so every run and every build benchmarks the same inputs
+static uint benchrand()
+{
+    benchseed = benchseed*1664525 + 1013904223;
+    return benchseed>>8;
+}
+
+static std::vector<int> ints, uints, msgtypes;
+static std::vector<uchar> intdata, uintdata, stringdata;
+static std::vector<vec> vecs;
+static string strings[NUMSTRINGS];
+
+static void setupinputs()
+{
+    for(int i = 0; i < NUMINPUTS; ++i)
+    {
+        //mostly single byte values, as positions and message types are
+        uint r = benchrand()%10;
+        int n = r < 7 ? static_cast<int>(benchrand()%250) - 125 : (r < 9 ? static_cast<int>(benchrand()%0x10000) - 0x8000 : static_cast<int>(benchrand()));
+        ints.push_back(n);
+        putint(intdata, n);
+        int u = r < 7 ? benchrand()%0x80 : (r < 9 ? benchrand()%0x4000 : benchrand()%0x10000000);
+        uints.push_back(u);
+        //a few types outside the protocol, as a hostile client would send
+        msgtypes.push_back(static_cast<int>(benchrand()%(NetMsg_NumMsgs+4)) - 2);
+        vecs.push_back(vec((benchrand()%4096)/4.0f - 512, (benchrand()%4096)/4.0f - 512, (benchrand()%1024)/4.0f + 1));
+    }
+    uintdata.resize(NUMINPUTS*5);
+    ucharbuf p(uintdata.data(), uintdata.size());
+    for(int i = 0; i < NUMINPUTS; ++i)
+    {
+        putuint(p, uints[i]);
+    }
+    uintdata.resize(p.length());
+    for(int i = 0; i < NUMSTRINGS; ++i)
+    {
+        //names and chat: mostly printable, with color codes and the odd control character
+        int len = 1 + benchrand()%40;
+        for(int j = 0; j < len; ++j)
+        {
+            uint r = benchrand()%32;
+            strings[i][j] = r == 0 ? '\f' : (r == 1 ? '\t' : static_cast<char>(' ' + benchrand()%95));
+        }
+        strings[i][len] = '\0';
+        sendstring(strings[i], stringdata);
+    }
+}
+
+static inline uint mix(uint checksum, uint v)
+{
+    return checksum*31 + v;
+}
+
+static inline uint mixfloat(uint checksum, float f)
+{
+    return mix(checksum, static_cast<uint>(static_cast<int>(f*1000)));
+}
+
+static uint benchputint(int n)
+{
+    uchar buf[NUMINPUTS*5];
+    ucharbuf p(buf, sizeof(buf));
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        if(p.remaining() < 5)
+        {
+            checksum = mix(checksum, p.length());
+            p = ucharbuf(buf, sizeof(buf));
+        }
+        putint(p, ints[i&(NUMINPUTS-1)]);
+    }
+    return mix(checksum, p.length());
+}
+
+static uint benchgetint(int n)
+{
+    ucharbuf p(intdata.data(), intdata.size());
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        if(!p.remaining())
+        {
+            p = ucharbuf(intdata.data(), intdata.size());
+        }
+        checksum = mix(checksum, getint(p));
+    }
+    return checksum;
+}
+
+static uint benchputuint(int n)
+{
+    uchar buf[NUMINPUTS*5];
+    ucharbuf p(buf, sizeof(buf));
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        if(p.remaining() < 5)
+        {
+            checksum = mix(checksum, p.length());
+            p = ucharbuf(buf, sizeof(buf));
+        }
+        putuint(p, uints[i&(NUMINPUTS-1)]);
+    }
+    return mix(checksum, p.length());
+}
+
+static uint benchgetuint(int n)
+{
+    ucharbuf p(uintdata.data(), uintdata.size());
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        if(!p.remaining())
+        {
+            p = ucharbuf(uintdata.data(), uintdata.size());
+        }
+        checksum = mix(checksum, getuint(p));
+    }
+    return checksum;
+}
+
+static uint benchsendstring(int n)
+{
+    uchar buf[NUMSTRINGS*(MAXSTRLEN+1)];
+    ucharbuf p(buf, sizeof(buf));
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        if(p.remaining() < MAXSTRLEN+1)
+        {
+            checksum = mix(checksum, p.length());
+            p = ucharbuf(buf, sizeof(buf));
+        }
+        sendstring(strings[i&(NUMSTRINGS-1)], p);
+    }
+    return mix(checksum, p.length());
+}
+
+static uint benchgetstring(int n)
+{
+    ucharbuf p(stringdata.data(), stringdata.size());
+    uint checksum = 0;
+    string text;
+    for(int i = 0; i < n; ++i)
+    {
+        if(!p.remaining())
+        {
+            p = ucharbuf(stringdata.data(), stringdata.size());
+        }
+        getstring(text, p);
+        checksum = mix(checksum, text[0]);
+    }
+    return checksum;
+}
+
+static uint benchfiltertext(int n)
+{
+    uint checksum = 0;
+    string text;
+    for(int i = 0; i < n; ++i)
+    {
+        filtertext(text, strings[i&(NUMSTRINGS-1)], (i&1) != 0);
+        checksum = mix(checksum, strlen(text));
+    }
+    return checksum;
+}
+
+//a 256 value message built in a packet that starts small, as sendf's do when they outgrow MAXTRANS
+static uint benchpacketgrowth(int n)
+{
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        packetbuf p(32, 0);
+        for(int j = 0; j < 256; ++j)
+        {
+            putint(p, ints[(i*256 + j)&(NUMINPUTS-1)]);
+        }
+        ENetPacket *packet = p.finalize();
+        checksum = mix(checksum, packet->dataLength);
+    }
+    return checksum;
+}
+
+//the same message appended to a vector from empty, as the worldstate and demo buffers are
+static uint benchvectorgrowth(int n)
+{
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        std::vector<uchar> p;
+        for(int j = 0; j < 256; ++j)
+        {
+            putint(p, ints[(i*256 + j)&(NUMINPUTS-1)]);
+        }
+        checksum = mix(checksum, p.size());
+    }
+    return checksum;
+}
+
+static int benchformat(packetbuf &p, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int exclude = putformat(p, format, args);
+    va_end(args);
+    return exclude;
+}
+
+//the packet building half of sendf for the formats the server sends most
+static uint benchsendf(int n)
+{
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+        int v = ints[i&(NUMINPUTS-1)];
+        switch(i%4)
+        {
+            case 0:
+            {
+                benchformat(p, "i9", NetMsg_Damage, i&127, (i+1)&127, v, v>>1, 100, 0, 0, 0);
+                break;
+            }
+            case 1:
+            {
+                benchformat(p, "ii3", NetMsg_SpawnState, i&127, v, 100);
+                break;
+            }
+            case 2:
+            {
+                benchformat(p, "xiis", i&127, NetMsg_SayTeam, i&127, strings[i&(NUMSTRINGS-1)]);
+                break;
+            }
+            default:
+            {
+                benchformat(p, "if3", NetMsg_Hitpush, vecs[i&(NUMINPUTS-1)].x, vecs[i&(NUMINPUTS-1)].y, vecs[i&(NUMINPUTS-1)].z);
+                break;
+            }
+        }
+        ENetPacket *packet = p.finalize();
+        checksum = mix(checksum, packet->dataLength);
+    }
+    return checksum;
+}
+
+static uint benchmsgsizelookup(int n)
+{
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        checksum = mix(checksum, server::msgsizelookup(msgtypes[i&(NUMINPUTS-1)]));
+    }
+    return checksum;
+}
+
+//the table lookups checktype makes for a connecting and a connected client;
+//the rest of checktype depends on live client state
+static uint benchchecktype(int n)
+{
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        int type = msgtypes[i&(NUMINPUTS-1)];
+        checksum = mix(checksum, (i&7) ? server::msgfilterlookup(type) : server::connectfilterlookup(type));
+    }
+    return checksum;
+}
+
+static uint benchvecnormalize(int n)
+{
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        vec v = vecs[i&(NUMINPUTS-1)];
+        v.normalize();
+        checksum = mixfloat(checksum, v.x + v.y + v.z);
+    }
+    return checksum;
+}
+
+static uint benchvecdist(int n)
+{
+    uint checksum = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        const vec &a = vecs[i&(NUMINPUTS-1)],
+                  &b = vecs[(i+1)&(NUMINPUTS-1)];
+        checksum = mixfloat(checksum, a.dist(b) + a.dist2(b));
+    }
+    return checksum;
+}
+
+static uint benchvecarith(int n)
+{
+    uint checksum = 0;
+    vec acc(0.0f);
+    for(int i = 0; i < n; ++i)
+    {
+        const vec &a = vecs[i&(NUMINPUTS-1)];
+        acc.add(vec(a).sub(acc).mul(0.5f)).min(1024.0f).max(-1024.0f);
+        checksum = mixfloat(checksum, acc.dot(a));
+    }
+    return checksum;
+}
+
+struct benchcase
+{
+    const char *name;
+    uint (*run)(int n);
+    int weight;         //cost of one operation relative to a putint, divides the iterations
+};
+
+static const benchcase benchcases[] =
+{
+    { "putint", benchputint, 1 },
+    { "getint", benchgetint, 1 },
+    { "putuint", benchputuint, 1 },
+    { "getuint", benchgetuint, 1 },
+    { "sendstring", benchsendstring, 8 },
+    { "getstring", benchgetstring, 8 },
+    { "filtertext", benchfiltertext, 8 },
+    { "packetbuf_growth", benchpacketgrowth, 256 },
+    { "vector_growth", benchvectorgrowth, 256 },
+    { "sendf", benchsendf, 16 },
+    { "msgsizelookup", benchmsgsizelookup, 1 },
+    { "checktype", benchchecktype, 1 },
+    { "vec_normalize", benchvecnormalize, 1 },
+    { "vec_dist", benchvecdist, 1 },
+    { "vec_arith", benchvecarith, 1 }
+};
+
+struct benchresult
+{
+    const benchcase *c;
+    int ops;
+    double minns, medianns, maxns;
+    uint checksum;
+};
+
+static void runcase(const benchcase &c, int iterations, int repeats, int warmups, benchresult &r)
+{
+    r.c = &c;
+    r.ops = std::max(iterations/c.weight, 1);
+    r.checksum = 0;
+    for(int i = 0; i < warmups; ++i)
+    {
+        r.checksum = c.run(r.ops);
+    }
+    std::vector<double> times;
+    for(int i = 0; i < repeats; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint checksum = c.run(r.ops);
+        times.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()/r.ops);
+        if(i && checksum != r.checksum)
+        {
+            fprintf(stderr, "%s: checksum changed between repeats\n", c.name);
+        }
+        r.checksum = checksum;
+    }
+    std::sort(times.begin(), times.end());
+    r.minns = times.front();
+    r.medianns = times[times.size()/2];
+    r.maxns = times.back();
+}
+
+static void writejson(FILE *f, const std::vector<benchresult> &results, int iterations, int repeats, int warmups)
+{
+    fprintf(f, "{\n  \"iterations\": %d,\n  \"repeats\": %d,\n  \"warmups\": %d,\n  \"benchmarks\": [", iterations, repeats, warmups);
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const benchresult &r = results[i];
+        fprintf(f, "%s\n    { \"name\": \"%s\", \"ops\": %d, \"min_ns\": %.3f, \"median_ns\": %.3f, \"max_ns\": %.3f, \"checksum\": \"%08x\" }",
+                i ? "," : "", r.c->name, r.ops, r.minns, r.medianns, r.maxns, r.checksum);
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 1<<22,
+        repeats = 7,
+        warmups = 1;
+    const char *filter = nullptr,
+               *output = nullptr;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-n") && i+1 < argc)
+        {
+            iterations = std::max(atoi(argv[++i]), 1);
+        }
+        else if(!strcmp(argv[i], "-r") && i+1 < argc)
+        {
+            repeats = std::max(atoi(argv[++i]), 1);
+        }
+        else if(!strcmp(argv[i], "-w") && i+1 < argc)
+        {
+            warmups = std::max(atoi(argv[++i]), 0);
+        }
+        else if(!strcmp(argv[i], "-f") && i+1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-o") && i+1 < argc)
+        {
+            output = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-n <iterations>] [-r <repeats>] [-w <warmups>] [-f <filter>] [-o <file.json>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(enet_initialize() < 0)
+    {
+        fprintf(stderr, "unable to initialise network module\n");
+        return EXIT_FAILURE;
+    }
+    setupinputs();
+    std::vector<benchresult> results;
+    for(const benchcase &c : benchcases)
+    {
+        if(filter && !strstr(c.name, filter))
+        {
+            continue;
+        }
+        benchresult r;
+        runcase(c, iterations, repeats, warmups, r);
+        results.push_back(r);
+        fprintf(stderr, "%-18s %10d ops %10.3f ns/op min %10.3f ns/op median\n", c.name, r.ops, r.minns, r.medianns);
+    }
+    FILE *f = output ? fopen(output, "w") : stdout;
+    if(!f)
+    {
+        fprintf(stderr, "could not open %s\n", output);
+        enet_deinitialize();
+        return EXIT_FAILURE;
+    }
+    writejson(f, results, iterations, repeats, warmups);
+    if(f != stdout)
+    {
+        fclose(f);
+    }
+    enet_deinitialize();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,251 @@
+// replaycapture.cpp: replays a capture of received packets through the game logic
+//
+// usage: replaycapture <capture>
+//
+// links the whole server but main. reads a capture written by startcapture
+// into memory, loads the map the capture started on and seeds rand() as the
+// server did at the start of the capture, then feeds its records through the
+// server as fast as it can: a tick runs updateserver on the captured clock, a
+// packet goes to parsepacket from a virtual client in its sender's slot, and a
+// worldstate send runs sendpackets.
+// nothing depends on the wall clock, so every replay of a capture sends the
+// same packets, which the digest of everything sent shows.
+//
+// reports what was replayed and sent, the time spent parsing packets, in
+// serverupdate and in sendpackets, and the ticks replayed per second
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+
+#include <enet/enet.h>
+
+#include "../tools.h"
+#include "../geom.h"
+#include "../iengine.h"
+#include "../igame.h"
+#include "../game.h"
+#include "../cserver.h"
+#include "../capture.h"
+
+struct replaystats
+{
+    unsigned long long ticks, packets, bytes, sentpackets, sentbytes;
+    int connects, refused, moved;
+    double parse, update, send;
+};
+
+static replaystats stats;
+
+//fnv-1a over the client, channel and bytes of every packet the server sends
+static unsigned long long digest = 0xcbf29ce484222325ULL;
+
+static void digestbytes(const void *data, size_t len)
+{
+    const uchar *p = static_cast<const uchar *>(data);
+    for(size_t i = 0; i < len; ++i)
+    {
+        digest = (digest ^ p[i]) * 0x100000001b3ULL;
+    }
+}
+
+static void capturesent(int cn, int chan, ENetPacket *packet)
+{
+    int stamp[3] = { cn, chan, static_cast<int>(packet->dataLength) };
+    digestbytes(stamp, sizeof(stamp));
+    digestbytes(packet->data, packet->dataLength);
+    stats.sentpackets++;
+    stats.sentbytes += packet->dataLength;
+}
+
+static bool loadcapture(const char *filename, std::vector<uchar> &data)
+{
+    string file;
+    copystring(file, filename);
+    stream *f = opengzfile(path(file), "rb");
+    if(!f)
+    {
+        f = openrawfile(file, "rb");
+    }
+    if(!f)
+    {
+        return false;
+    }
+    uchar buf[65536];
+    for(size_t len; (len = f->read(buf, sizeof(buf))) > 0;)
+    {
+        data.insert(data.end(), buf, buf + len);
+    }
+    delete f;
+    return true;
+}
+
+static double elapsed(std::chrono::steady_clock::time_point &last)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double d = std::chrono::duration<double>(now - last).count();
+    last = now;
+    return d;
+}
+
+//returns false if the capture ends in the middle of a record
+static bool replay(const std::vector<uchar> &data, const captureheader &hdr)
+{
+    int slots[MAXCLIENTS]; //replayed client number of each captured one, -1 for none
+    std::fill(slots, slots + MAXCLIENTS, -1);
+    int offset = totalmillis - hdr.millis;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    for(size_t pos = sizeof(hdr); pos < data.size();)
+    {
+        int record[3];
+        if(data.size() - pos < sizeof(record))
+        {
+            return false;
+        }
+        memcpy(record, &data[pos], sizeof(record));
+        pos += sizeof(record);
+        int cn = record[1];
+        switch(record[0]&0xFF)
+        {
+            case Capture_Tick:
+            {
+                elapsed(last);
+                updateserver(record[1] + offset);
+                stats.update += elapsed(last);
+                stats.ticks++;
+                break;
+            }
+            case Capture_Connect:
+            {
+                if(cn < 0 || cn >= MAXCLIENTS)
+                {
+                    break;
+                }
+                slots[cn] = connectvirtualclient(static_cast<uint>(record[2]));
+                stats.connects++;
+                if(slots[cn] < 0)
+                {
+                    stats.refused++;
+                }
+                else if(slots[cn] != cn)
+                {
+                    stats.moved++;
+                }
+                break;
+            }
+            case Capture_Disconnect:
+            {
+                if(cn >= 0 && cn < MAXCLIENTS && slots[cn] >= 0)
+                {
+                    disconnectvirtualclient(slots[cn]);
+                    slots[cn] = -1;
+                }
+                break;
+            }
+            case Capture_Packet:
+            {
+                int len = record[2];
+                if(len < 0 || data.size() - pos < static_cast<size_t>(len))
+                {
+                    return false;
+                }
+                if(cn >= 0 && cn < MAXCLIENTS && slots[cn] >= 0)
+                {
+                    elapsed(last);
+                    receivevirtual(slots[cn], (record[0]>>8)&0xFF, enet_packet_create(&data[pos], len, (record[0]>>16)&0xFF));
+                    stats.parse += elapsed(last);
+                    stats.packets++;
+                    stats.bytes += len;
+                }
+                pos += len;
+                break;
+            }
+            case Capture_Send:
+            {
+                elapsed(last);
+                server::sendpackets(true);
+                stats.send += elapsed(last);
+                break;
+            }
+            default:
+            {
+                fprintf(stderr, "unknown capture record %d\n", record[0]&0xFF);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "usage: %s <capture>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    std::vector<uchar> data;
+    if(!loadcapture(argv[1], data))
+    {
+        fprintf(stderr, "could not read %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    captureheader hdr;
+    if(data.size() < sizeof(hdr))
+    {
+        fprintf(stderr, "%s is not a capture\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    memcpy(&hdr, data.data(), sizeof(hdr));
+    if(memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)))
+    {
+        fprintf(stderr, "%s is not a capture\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if(hdr.version != CAPTURE_VERSION || hdr.protocol != PROTOCOL_VERSION)
+    {
+        fprintf(stderr, "%s is capture version %d of protocol %d, not version %d of protocol %d\n",
+                argv[1], hdr.version, hdr.protocol, CAPTURE_VERSION, PROTOCOL_VERSION);
+        return EXIT_FAILURE;
+    }
+    hdr.map[sizeof(hdr.map) - 1] = '\0';
+    if(enet_initialize() < 0)
+    {
+        fprintf(stderr, "unable to initialise network module\n");
+        return EXIT_FAILURE;
+    }
+    initserver(false);
+    execute("loglevel 2");
+    maxclients = MAXCLIENTS;
+    setvirtualtransport(capturesent);
+    if(hdr.map[0])
+    {
+        server::changemap(hdr.map, hdr.mode);
+    }
+    //after the map, as the server seeds at the start of the capture's first tick
+    srand(hdr.seed);
+    stats.sentpackets = stats.sentbytes = 0;
+    digest = 0xcbf29ce484222325ULL;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool complete = replay(data, hdr);
+    double seconds = elapsed(start);
+    if(!complete)
+    {
+        fprintf(stderr, "%s ends in the middle of a record, replayed up to it\n", argv[1]);
+    }
+    printf("replayed %llu ticks on %s, %d connects (%d refused, %d in another slot), %llu packets, %llu bytes\n",
+           stats.ticks, hdr.map[0] ? hdr.map : "no map", stats.connects, stats.refused, stats.moved, stats.packets, stats.bytes);
+    printf("sent %llu packets, %llu bytes, digest %016llx\n", stats.sentpackets, stats.sentbytes, digest);
+    printf("%.3f s, %.0f ticks/s; parse %.3f s, update %.3f s, send %.3f s\n",
+           seconds, seconds > 0 ? stats.ticks/seconds : 0.0, stats.parse, stats.update, stats.send);
+    enet_deinitialize();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,247 @@
+// statsreader.cpp: aggregates the binary player statistics log written by statslog.cpp
+//
+// usage: statsreader [-from <unixtime>] [-to <unixtime>] [-map <name>] [-ip] [-top <n>] <statsfile>
+//
+// records are read in large blocks; when an index file is present, batches
+// entirely outside the requested time range are skipped without being read.
+// a player who disconnects and rejoins has several records for one round, each
+// holding the running totals, so only the last record per (round, ip, name) counts
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <ctype.h>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <string>
+
+#include <enet/enet.h>
+
+#include "../tools.h"
+#include "../statslog.h"
+
+constexpr uint READBLOCK = 1<<16; // records per read
+
+struct playertotal
+{
+    char name[STATS_NAMELEN];
+    uint ip;
+    int rounds, frags, score, deaths, teamkills, shotdamage, damage;
+    long long timeplayed;
+};
+
+struct statsreader
+{
+    uint from, to;
+    const char *map;
+    bool byip;
+
+    uint curround;
+    std::unordered_map<std::string, statsrecord> roundrecords; // latest record per player of curround
+    std::unordered_map<std::string, playertotal> totals;
+    unsigned long long numread, numused;
+
+    statsreader() : from(0), to(UINT_MAX), map(nullptr), byip(false), curround(0), numread(0), numused(0) {}
+
+    // the name itself, followed by the address with -ip, so that no two players are merged
+    std::string playerkey(const statsrecord &r) const
+    {
+        std::string key(r.name, strnlen(r.name, STATS_NAMELEN));
+        if(byip)
+        {
+            key.append(reinterpret_cast<const char *>(&r.ip), sizeof(r.ip));
+        }
+        return key;
+    }
+
+    void flushround()
+    {
+        for(auto &i : roundrecords)
+        {
+            const statsrecord &r = i.second;
+            playertotal &t = totals[i.first];
+            if(!t.rounds)
+            {
+                memcpy(t.name, r.name, STATS_NAMELEN);
+                t.name[STATS_NAMELEN-1] = '\0';
+                t.ip = r.ip;
+            }
+            t.rounds++;
+            t.frags += r.frags;
+            t.score += r.score;
+            t.deaths += r.deaths;
+            t.teamkills += r.teamkills;
+            t.shotdamage += r.shotdamage;
+            t.damage += r.damage;
+            t.timeplayed += r.timeplayed;
+            numused++;
+        }
+        roundrecords.clear();
+    }
+
+    void add(const statsrecord *records, uint count)
+    {
+        numread += count;
+        for(uint i = 0; i < count; ++i)
+        {
+            const statsrecord &r = records[i];
+            if(r.time < from || r.time > to || (map && strncmp(r.map, map, STATS_MAPLEN)))
+            {
+                continue;
+            }
+            // records are appended in round order, so a new round id closes the previous round
+            if(r.round != curround)
+            {
+                flushround();
+                curround = r.round;
+            }
+            roundrecords[playerkey(r)] = r;
+        }
+    }
+
+    void print(int top)
+    {
+        flushround();
+        std::vector<const playertotal *> sorted;
+        sorted.reserve(totals.size());
+        for(auto &i : totals)
+        {
+            sorted.push_back(&i.second);
+        }
+        std::sort(sorted.begin(), sorted.end(), [] (const playertotal *a, const playertotal *b) { return a->frags > b->frags; });
+        printf("%-16s %-15s %7s %8s %8s %8s %6s %10s %10s %9s\n", "name", "ip", "rounds", "frags", "deaths", "score", "tks", "damage", "shotdmg", "minutes");
+        for(int i = 0; i < static_cast<int>(sorted.size()) && (top <= 0 || i < top); ++i)
+        {
+            const playertotal &t = *sorted[i];
+            string ip = "-";
+            if(byip)
+            {
+                formatstring(ip, "%u.%u.%u.%u", t.ip&0xFF, (t.ip>>8)&0xFF, (t.ip>>16)&0xFF, t.ip>>24);
+            }
+            printf("%-16s %-15s %7d %8d %8d %8d %6d %10d %10d %9lld\n", t.name, ip, t.rounds, t.frags, t.deaths, t.score, t.teamkills, t.damage, t.shotdamage, t.timeplayed/60000);
+        }
+        fprintf(stderr, "%llu records read, %llu used, %u players\n", numread, numused, static_cast<uint>(totals.size()));
+    }
+};
+
+static bool readrange(FILE *f, statsreader &reader, std::vector<statsrecord> &buf, long long first, long long count)
+{
+    if(fseek(f, sizeof(statsheader) + first*sizeof(statsrecord), SEEK_SET))
+    {
+        return false;
+    }
+    while(count > 0)
+    {
+        size_t want = count > READBLOCK ? READBLOCK : count,
+               got = fread(buf.data(), sizeof(statsrecord), want, f);
+        if(!got)
+        {
+            break;
+        }
+        reader.add(buf.data(), got);
+        count -= got;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    statsreader reader;
+    int top = 0;
+    const char *filename = nullptr;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-from") && i+1 < argc)
+        {
+            reader.from = strtoul(argv[++i], nullptr, 10);
+        }
+        else if(!strcmp(argv[i], "-to") && i+1 < argc)
+        {
+            reader.to = strtoul(argv[++i], nullptr, 10);
+        }
+        else if(!strcmp(argv[i], "-map") && i+1 < argc)
+        {
+            reader.map = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-top") && i+1 < argc)
+        {
+            top = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "-ip"))
+        {
+            reader.byip = true;
+        }
+        else
+        {
+            filename = argv[i];
+        }
+    }
+    if(!filename)
+    {
+        fprintf(stderr, "usage: %s [-from <unixtime>] [-to <unixtime>] [-map <name>] [-ip] [-top <n>] <statsfile>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    FILE *f = fopen(filename, "rb");
+    if(!f)
+    {
+        fprintf(stderr, "could not open %s\n", filename);
+        return EXIT_FAILURE;
+    }
+    statsheader hdr;
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, "ISTS", 4) || hdr.version != STATS_VERSION || hdr.recordsize != static_cast<int>(sizeof(statsrecord)))
+    {
+        fprintf(stderr, "%s is not a version %d stats log\n", filename, STATS_VERSION);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    std::vector<statsrecord> buf(READBLOCK);
+    string indexname;
+    formatstring(indexname, "%s.idx", filename);
+    FILE *idx = reader.from || reader.to != UINT_MAX ? fopen(indexname, "rb") : nullptr;
+    if(idx)
+    {
+        // merge adjacent batches that overlap the time range into a single read
+        std::vector<statsindex> batches(READBLOCK);
+        long long first = -1, count = 0;
+        size_t n;
+        while((n = fread(batches.data(), sizeof(statsindex), batches.size(), idx)) > 0)
+        {
+            for(size_t i = 0; i < n; ++i)
+            {
+                const statsindex &b = batches[i];
+                if(b.maxtime < reader.from || b.mintime > reader.to)
+                {
+                    continue;
+                }
+                if(first >= 0 && first + count == b.first)
+                {
+                    count += b.count;
+                    continue;
+                }
+                if(first >= 0)
+                {
+                    readrange(f, reader, buf, first, count);
+                }
+                first = b.first;
+                count = b.count;
+            }
+        }
+        if(first >= 0)
+        {
+            readrange(f, reader, buf, first, count);
+        }
+        fclose(idx);
+    }
+    else
+    {
+        readrange(f, reader, buf, 0, LLONG_MAX);
+    }
+    fclose(f);
+    reader.print(top);
+    return EXIT_SUCCESS;
+}
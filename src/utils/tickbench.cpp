@@ -0,0 +1,471 @@
+// tickbench.cpp: times the game logic against simulated clients
+//
+// usage: tickbench [-c <clients>[,<clients>...]] [-b <bots>] [-t <ticks>] [-w <warmup ticks>] [-m <ms per tick>]
+//
+// links the whole server but main, with virtual clients standing in for enet
+// peers. for each client count the clients connect, answer their spawns, and
+// then every tick send a position, and at fixed rates shots, pulse explosions
+// and chat, as a real client would; each client also sends for the bots it
+// owns. the game runs on a virtual clock that advances a fixed step per tick,
+// so every run sees the same game time however long its ticks took.
+//
+// reports ticks/s of wall time, the time spent parsing the injected packets,
+// in serverupdate (which includes processevents) and in sendpackets (which
+// builds the worldstate), and the bytes, packets and heap allocations per tick
+
+#include <cmath>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <new>
+
+#include <enet/enet.h>
+
+#include "../tools.h"
+#include "../geom.h"
+#include "../iengine.h"
+#include "../igame.h"
+#include "../game.h"
+#include "../cserver.h"
+
+//every allocation, from new and from enet's packets, is counted
+static std::atomic<unsigned long long> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if(!p)
+    {
+        abort();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static void *countedmalloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size);
+}
+
+static uint simseed = 0x5eed;
+
+static uint simrand(uint n)
+{
+    simseed = simseed*1664525 + 1013904223;
+    return (simseed>>8)%n;
+}
+
+constexpr int MAXPLAYERS = MAXCLIENTS + MAXBOTS,
+              CHATMILLIS = 10000,   //mean time between chat lines per client
+              EXPLODEMILLIS = 400;  //flight time of a pulse shot
+
+//what a simulated client knows about one player it controls
+struct simplayer
+{
+    int spawnedls;      //life sequence last answered with a spawn, -1 for none
+    int nextshot, nextchat;
+    int pulseid, pulsemillis; //pulse shot in flight, 0 for none
+    vec o;
+};
+
+static simplayer simplayers[MAXPLAYERS];
+
+//the packets each client sends in one tick
+struct simpackets
+{
+    uchar pos[MAXTRANS], msgs[MAXTRANS];
+    ucharbuf p, m;
+    int cq;             //player the messages currently act for, as NetMsg_FromAI sets it
+};
+
+static simpackets outgoing[MAXCLIENTS];
+
+struct simstats
+{
+    unsigned long long bytes, packets;
+};
+
+static simstats sent;
+
+static void capture(int cn, int chan, ENetPacket *packet)
+{
+    sent.bytes += packet->dataLength;
+    sent.packets++;
+}
+
+static void putpos(ucharbuf &p, int cn, const vec &o)
+{
+    putint(p, NetMsg_Pos);
+    putuint(p, cn);
+    p.put(0);           //physics state
+    putuint(p, 0);      //flags: no 24 bit coordinates, 8 bit velocity
+    for(int k = 0; k < 3; ++k)
+    {
+        int n = static_cast<int>(o[k]*DMF);
+        p.put(n&0xFF);
+        p.put((n>>8)&0xFF);
+    }
+    p.put(simrand(256)); //yaw, pitch and roll
+    p.put(simrand(256));
+    p.put(0);
+    p.put(40);          //speed
+    int dir = simrand(360) + 90*360;
+    p.put(dir&0xFF);
+    p.put(dir>>8);
+}
+
+//a random living player other than ci, or nullptr
+static server::clientinfo *picktarget(server::clientinfo *ci)
+{
+    int n = server::clients.size();
+    for(int tries = 0; tries < 4 && n > 1; ++tries)
+    {
+        server::clientinfo *t = server::clients[simrand(n)];
+        if(t != ci && t->state.state == ClientState_Alive)
+        {
+            return t;
+        }
+    }
+    return nullptr;
+}
+
+static void puthit(ucharbuf &p, server::clientinfo *target, float dist)
+{
+    putint(p, target->clientnum);
+    putint(p, target->state.lifesequence);
+    putint(p, static_cast<int>(dist*DMF));
+    putint(p, 1);
+    putint(p, 0);
+    putint(p, 0);
+    putint(p, static_cast<int>(DNF));
+}
+
+static void actfor(simpackets &s, server::clientinfo *ci)
+{
+    int cq = ci->state.aitype != AI_None ? ci->clientnum : -1;
+    if(s.cq != cq)
+    {
+        putint(s.m, NetMsg_FromAI);
+        putint(s.m, cq);
+        s.cq = cq;
+    }
+}
+
+static void simulate(server::clientinfo *ci, int millis)
+{
+    if(ci->ownernum < 0 || ci->ownernum >= MAXCLIENTS || ci->state.state == ClientState_Spectator)
+    {
+        return;
+    }
+    simpackets &s = outgoing[ci->ownernum];
+    simplayer &sp = simplayers[ci->clientnum];
+    if(s.p.remaining() < 64 || s.m.remaining() < 256)
+    {
+        return;
+    }
+    if(ci->state.state != ClientState_Alive)
+    {
+        if(ci->state.lifesequence != sp.spawnedls)
+        {
+            actfor(s, ci);
+            putint(s.m, NetMsg_Spawn);
+            putint(s.m, ci->state.lifesequence);
+            putint(s.m, Gun_Pulse);
+            putint(s.m, 0);
+            sp.spawnedls = ci->state.lifesequence;
+            sp.o = vec(256 + simrand(3584), 256 + simrand(3584), 64 + simrand(512));
+        }
+        return;
+    }
+    sp.o.add(vec(simrand(9) - 4.0f, simrand(9) - 4.0f, 0.0f)).clamp(16.0f, 4000.0f);
+    putpos(s.p, ci->clientnum, sp.o);
+    if(millis >= sp.nextshot)
+    {
+        int atk = simrand(Attack_NumAttacks);
+        sp.nextshot = millis + attacks[atk].attackdelay + simrand(200);
+        if(atk == Attack_PulseShoot && sp.pulseid)
+        {
+            atk = Attack_RailShot;
+        }
+        server::clientinfo *target = simrand(2) ? picktarget(ci) : nullptr;
+        vec to = target ? target->state.o : vec(sp.o).add(vec(simrand(512), simrand(512), 0.0f));
+        actfor(s, ci);
+        putint(s.m, NetMsg_Shoot);
+        putint(s.m, millis);
+        putint(s.m, atk);
+        for(int k = 0; k < 3; ++k)
+        {
+            putint(s.m, static_cast<int>(sp.o[k]*DMF));
+        }
+        for(int k = 0; k < 3; ++k)
+        {
+            putint(s.m, static_cast<int>(to[k]*DMF));
+        }
+        if(target && atk != Attack_PulseShoot)
+        {
+            putint(s.m, 1);
+            puthit(s.m, target, sp.o.dist(to));
+        }
+        else
+        {
+            putint(s.m, 0);
+        }
+        if(atk == Attack_PulseShoot)
+        {
+            sp.pulseid = millis;
+            sp.pulsemillis = millis + EXPLODEMILLIS;
+        }
+    }
+    if(sp.pulseid && millis >= sp.pulsemillis)
+    {
+        server::clientinfo *target = simrand(2) ? picktarget(ci) : nullptr;
+        actfor(s, ci);
+        putint(s.m, NetMsg_Explode);
+        putint(s.m, millis);
+        putint(s.m, Attack_PulseShoot);
+        putint(s.m, sp.pulseid);
+        if(target)
+        {
+            putint(s.m, 1);
+            puthit(s.m, target, simrand(attacks[Attack_PulseShoot].exprad));
+        }
+        else
+        {
+            putint(s.m, 0);
+        }
+        sp.pulseid = 0;
+    }
+    if(ci->state.aitype == AI_None && millis >= sp.nextchat)
+    {
+        sp.nextchat = millis + CHATMILLIS/2 + simrand(CHATMILLIS);
+        actfor(s, ci);
+        putint(s.m, NetMsg_Text);
+        sendstring(tempformatstring("simulated chat from %d at %d", ci->clientnum, millis), s.m);
+    }
+}
+
+static void inject(int cn, int chan, const ucharbuf &p, int flags)
+{
+    if(p.length())
+    {
+        receivevirtual(cn, chan, enet_packet_create(p.buf, p.length(), flags));
+    }
+}
+
+static void connectclients(int numclients, std::vector<int> &cns)
+{
+    for(int i = 0; i < numclients; ++i)
+    {
+        int cn = connectvirtualclient();
+        if(cn < 0)
+        {
+            fprintf(stderr, "virtual client %d was refused\n", i);
+            continue;
+        }
+        uchar buf[MAXTRANS];
+        ucharbuf p(buf, sizeof(buf));
+        putint(p, NetMsg_Connect);
+        sendstring(tempformatstring("sim%d", i), p);
+        putint(p, 0);   //model
+        putint(p, 0);   //color
+        sendstring("", p);
+        sendstring("", p);
+        sendstring("", p);
+        inject(cn, 1, p, ENET_PACKET_FLAG_RELIABLE);
+        p = ucharbuf(buf, sizeof(buf));
+        putint(p, NetMsg_MapCRC);
+        sendstring(server::smapname, p);
+        putint(p, 1);
+        inject(cn, 1, p, ENET_PACKET_FLAG_RELIABLE);
+        cns.push_back(cn);
+    }
+}
+
+struct simresult
+{
+    int clients, players, ticks;
+    double seconds, parse, update, send;
+    unsigned long long bytes, packets, allocs;
+};
+
+static int simmillis = 0;
+
+static double elapsed(std::chrono::steady_clock::time_point &last)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double d = std::chrono::duration<double>(now - last).count();
+    last = now;
+    return d;
+}
+
+static void run(int numclients, int numbots, int ticks, int warmup, int tickmillis, simresult &r)
+{
+    memset(&r, 0, sizeof(r));
+    r.clients = numclients;
+    server::changemap("def1a", 1);
+    for(int i = 0; i < MAXPLAYERS; ++i)
+    {
+        simplayer &sp = simplayers[i];
+        sp.spawnedls = -1;
+        sp.nextshot = sp.nextchat = simmillis + simrand(1000);
+        sp.pulseid = sp.pulsemillis = 0;
+        sp.o = vec(0.0f);
+    }
+    std::vector<int> cns;
+    connectclients(numclients, cns);
+    server::numbots = numclients + numbots;
+    for(int tick = 0; tick < warmup + ticks; ++tick)
+    {
+        bool measure = tick >= warmup;
+        simmillis += tickmillis;
+        for(int cn : cns)
+        {
+            simpackets &s = outgoing[cn];
+            s.p = ucharbuf(s.pos, sizeof(s.pos));
+            s.m = ucharbuf(s.msgs, sizeof(s.msgs));
+            s.cq = -1;
+        }
+        for(uint i = 0; i < server::clients.size(); ++i)
+        {
+            simulate(server::clients[i], simmillis);
+        }
+        sent.bytes = sent.packets = 0;
+        unsigned long long allocs = allocations.load();
+        std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+        for(int cn : cns)
+        {
+            //the injected packet itself is two allocations a real client would not cost
+            allocs += outgoing[cn].p.length() ? 2 : 0;
+            allocs += outgoing[cn].m.length() ? 2 : 0;
+            inject(cn, 0, outgoing[cn].p, 0);
+            inject(cn, 1, outgoing[cn].m, ENET_PACKET_FLAG_RELIABLE);
+        }
+        double parse = elapsed(last);
+        updateserver(simmillis);
+        double update = elapsed(last);
+        server::sendpackets(true); //its 7ms throttle runs on the wall clock, every virtual tick is longer
+        double send = elapsed(last);
+        if(measure)
+        {
+            r.ticks++;
+            r.parse += parse;
+            r.update += update;
+            r.send += send;
+            r.seconds += parse + update + send;
+            r.bytes += sent.bytes;
+            r.packets += sent.packets;
+            r.allocs += allocations.load() - allocs;
+        }
+    }
+    r.players = server::clients.size();
+    for(int cn : cns)
+    {
+        disconnectvirtualclient(cn);
+    }
+}
+
+static void report(const simresult &r)
+{
+    double ticks = std::max(r.ticks, 1);
+    printf("%7d %7d %9.0f %9.1f %9.1f %9.1f %11.0f %9.1f %9.1f\n",
+           r.clients, r.players, r.seconds > 0 ? r.ticks/r.seconds : 0.0,
+           r.parse*1e6/ticks, r.update*1e6/ticks, r.send*1e6/ticks,
+           r.bytes/ticks, r.packets/ticks, r.allocs/ticks);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<int> counts;
+    int numbots = 8,
+        ticks = 3000,
+        warmup = 300,
+        tickmillis = 33;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-c") && i+1 < argc)
+        {
+            for(char *s = argv[++i]; *s; s = strchr(s, ',') ? strchr(s, ',') + 1 : s + strlen(s))
+            {
+                counts.push_back(std::clamp(atoi(s), 1, MAXCLIENTS));
+            }
+        }
+        else if(!strcmp(argv[i], "-b") && i+1 < argc)
+        {
+            numbots = std::clamp(atoi(argv[++i]), 0, MAXBOTS);
+        }
+        else if(!strcmp(argv[i], "-t") && i+1 < argc)
+        {
+            ticks = std::max(atoi(argv[++i]), 1);
+        }
+        else if(!strcmp(argv[i], "-w") && i+1 < argc)
+        {
+            warmup = std::max(atoi(argv[++i]), 0);
+        }
+        else if(!strcmp(argv[i], "-m") && i+1 < argc)
+        {
+            tickmillis = std::max(atoi(argv[++i]), 1);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-c <clients>[,<clients>...]] [-b <bots>] [-t <ticks>] [-w <warmup ticks>] [-m <ms per tick>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(counts.empty())
+    {
+        counts = { 8, 16, 32, 64, 128 };
+    }
+    ENetCallbacks callbacks = { countedmalloc, free, nullptr };
+    if(enet_initialize_with_callbacks(ENET_VERSION, &callbacks) < 0)
+    {
+        fprintf(stderr, "unable to initialise network module\n");
+        return EXIT_FAILURE;
+    }
+    initserver(false);
+    execute("loglevel 2");
+    maxclients = MAXCLIENTS;
+    setvirtualtransport(capture);
+    printf("%d ms ticks, %d measured after %d warmup, %d bots\n", tickmillis, ticks, warmup, numbots);
+    printf("%7s %7s %9s %9s %9s %9s %11s %9s %9s\n", "clients", "players", "ticks/s", "parse us", "update us", "send us", "bytes/tick", "pkts/tick", "allocs");
+    for(int n : counts)
+    {
+        simresult r;
+        run(n, numbots, ticks, warmup, tickmillis, r);
+        report(r);
+    }
+    enet_deinitialize();
+    return EXIT_SUCCESS;
+}